@@ -0,0 +1,447 @@
+// Нагрузочный генератор: строит БД заданного размера и гоняет смешанную нагрузку чата
+// из нескольких потоков, печатает пропускную способность и p50/p99/p99.9 по каждой операции.
+//
+//   chat_loadgen --db load.db --users 100000 --rooms 5000 --history 100000000
+//                --threads 8 --duration 60 --zipf 1.1 --mix insert=40,tail=40,member=5,login=10,reconnect=5
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <sqlite3.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "db.hpp"
+#include "time_utils.hpp"
+
+namespace {
+    struct Config {
+        std::string db_file = "chat_loadgen.db";
+        int64_t users = 10'000;
+        int64_t rooms = 1'000;
+        int64_t history = 1'000'000;   // сообщений при построении БД
+        int64_t rooms_per_user = 5;
+        int threads = 4;
+        int duration_s = 30;
+        double zipf_s = 1.1;           // показатель распределения популярности комнат
+        int64_t tail = 50;             // размер страницы истории
+        int reconnect_rooms = 10;      // сколько комнат перечитывает клиент при переподключении
+        bool reuse = false;            // не перестраивать существующую БД
+        int busy_timeout_ms = 5'000;   // DBOptions::busy_timeout; 0 - SQLITE_BUSY сразу
+        std::map<std::string, int> mix = { { "insert", 40 }, { "tail", 40 }, { "member", 5 }, { "login", 10 }, { "reconnect", 5 } };
+    };
+
+    enum Op { kInsert, kTail, kMember, kLogin, kReconnect, kOpCount };
+    const char* kOpNames[kOpCount] = { "insert", "tail", "member", "login", "reconnect" };
+
+    // Лог-линейная гистограмма задержек: 64 поддиапазона на каждую степень двойки (точность ~1.5%).
+    class Histogram {
+    public:
+        void Record(int64_t ns) {
+            ++buckets_[Index(std::max<int64_t>(ns, 1))];
+            ++count_;
+        }
+
+        void Merge(const Histogram& other) {
+            for (size_t i = 0; i < buckets_.size(); ++i) {
+                buckets_[i] += other.buckets_[i];
+            }
+            count_ += other.count_;
+        }
+
+        int64_t Percentile(double p) const {
+            if (count_ == 0) {
+                return 0;
+            }
+            uint64_t target = static_cast<uint64_t>(std::ceil(p / 100.0 * static_cast<double>(count_)));
+            uint64_t seen = 0;
+            for (size_t i = 0; i < buckets_.size(); ++i) {
+                seen += buckets_[i];
+                if (seen >= target) {
+                    return UpperBound(i);
+                }
+            }
+            return UpperBound(buckets_.size() - 1);
+        }
+
+        uint64_t Count() const {
+            return count_;
+        }
+
+    private:
+        static constexpr int kSubBits = 6;
+        static constexpr int kSub = 1 << kSubBits;
+
+        static int Log2(uint64_t v) {
+            int exp = 0;
+            while (v >>= 1) {
+                ++exp;
+            }
+            return exp;
+        }
+
+        static size_t Index(int64_t v) {
+            int exp = Log2(static_cast<uint64_t>(v));
+            if (exp < kSubBits) {
+                return static_cast<size_t>(v);
+            }
+            int64_t sub = (v >> (exp - kSubBits)) - kSub;
+            return static_cast<size_t>((exp - kSubBits + 1) * kSub + sub);
+        }
+
+        static int64_t UpperBound(size_t index) {
+            if (index < static_cast<size_t>(kSub)) {
+                return static_cast<int64_t>(index);
+            }
+            int exp = static_cast<int>(index / kSub) + kSubBits - 1;
+            int64_t sub = static_cast<int64_t>(index % kSub) + kSub;
+            return ((sub + 1) << (exp - kSubBits)) - 1;
+        }
+
+        std::array<uint64_t, (64 - kSubBits + 1) * kSub> buckets_{};
+        uint64_t count_ = 0;
+    };
+
+    // Выборка по закону Ципфа через предвычисленную функцию распределения.
+    class Zipf {
+    public:
+        Zipf(int64_t n, double s) : cdf_(static_cast<size_t>(n)) {
+            double sum = 0;
+            for (int64_t i = 0; i < n; ++i) {
+                sum += 1.0 / std::pow(static_cast<double>(i + 1), s);
+                cdf_[static_cast<size_t>(i)] = sum;
+            }
+            for (auto& c : cdf_) {
+                c /= sum;
+            }
+        }
+
+        template <typename Rng>
+        int64_t operator()(Rng& rng) const {
+            double u = std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+            return std::lower_bound(cdf_.begin(), cdf_.end(), u) - cdf_.begin();
+        }
+
+    private:
+        std::vector<double> cdf_;
+    };
+
+    std::string RoomName(int64_t i) {
+        return "room" + std::to_string(i);
+    }
+
+    std::string Login(int64_t i) {
+        return "user" + std::to_string(i);
+    }
+
+    bool Exec(sqlite3* conn, const char* sql) {
+        char* err = nullptr;
+        if (sqlite3_exec(conn, sql, nullptr, nullptr, &err) != SQLITE_OK) {
+            std::cerr << "SQL error: " << (err ? err : "") << "\n";
+            sqlite3_free(err);
+            return false;
+        }
+        return true;
+    }
+
+    // Схема создается библиотекой, массовая загрузка идет напрямую крупными транзакциями.
+    bool BuildDatabase(const Config& cfg, std::vector<std::atomic<int64_t>>& next_id) {
+        std::remove(cfg.db_file.c_str());
+        {
+            db::DB db(cfg.db_file);
+            if (!db.OpenDB()) {
+                return false;
+            }
+        }
+        sqlite3* conn = nullptr;
+        if (sqlite3_open(cfg.db_file.c_str(), &conn) != SQLITE_OK) {
+            return false;
+        }
+        Exec(conn, "PRAGMA journal_mode=WAL; PRAGMA synchronous=OFF;");
+        int64_t now = utime::GetUnixTimeNs();
+        std::mt19937_64 rng(42);
+        Zipf room_pick(cfg.rooms, cfg.zipf_s);
+
+        Exec(conn, "BEGIN;");
+        sqlite3_stmt* room_stmt = nullptr;
+        sqlite3_prepare_v2(conn, "INSERT INTO rooms(rooms_id, room, unixtime) VALUES(?, ?, ?);", -1, &room_stmt, nullptr);
+        for (int64_t r = 0; r < cfg.rooms; ++r) {
+            std::string name = RoomName(r);
+            sqlite3_bind_int64(room_stmt, 1, r + 1);
+            sqlite3_bind_text(room_stmt, 2, name.c_str(), -1, SQLITE_TRANSIENT);
+            sqlite3_bind_int64(room_stmt, 3, now);
+            sqlite3_step(room_stmt);
+            sqlite3_reset(room_stmt);
+        }
+        sqlite3_finalize(room_stmt);
+
+        sqlite3_stmt* user_stmt = nullptr;
+        sqlite3_prepare_v2(conn, "INSERT INTO users(users_id, login, name, password_hash, roles_id, is_deleted, unixtime) "
+                                 "VALUES(?, ?, ?, 'hash', (SELECT roles_id FROM roles WHERE role = 'user'), 0, ?);",
+                           -1, &user_stmt, nullptr);
+        sqlite3_stmt* member_stmt = nullptr;
+        sqlite3_prepare_v2(conn, "INSERT OR IGNORE INTO user_rooms(users_id, rooms_id) VALUES(?, ?);", -1, &member_stmt, nullptr);
+        for (int64_t u = 0; u < cfg.users; ++u) {
+            std::string login = Login(u);
+            sqlite3_bind_int64(user_stmt, 1, u + 1);
+            sqlite3_bind_text(user_stmt, 2, login.c_str(), -1, SQLITE_TRANSIENT);
+            sqlite3_bind_text(user_stmt, 3, login.c_str(), -1, SQLITE_TRANSIENT);
+            sqlite3_bind_int64(user_stmt, 4, now);
+            sqlite3_step(user_stmt);
+            sqlite3_reset(user_stmt);
+            for (int64_t k = 0; k < cfg.rooms_per_user; ++k) {
+                sqlite3_bind_int64(member_stmt, 1, u + 1);
+                sqlite3_bind_int64(member_stmt, 2, room_pick(rng) + 1);
+                sqlite3_step(member_stmt);
+                sqlite3_reset(member_stmt);
+            }
+        }
+        sqlite3_finalize(user_stmt);
+        sqlite3_finalize(member_stmt);
+        Exec(conn, "COMMIT;");
+
+        sqlite3_stmt* msg_stmt = nullptr;
+        sqlite3_prepare_v2(conn, "INSERT INTO messages(message, unixtime, users_id, rooms_id, date, time, id_message_in_room) "
+                                 "VALUES(?, ?, ?, ?, ?, ?, ?);", -1, &msg_stmt, nullptr);
+        const std::string text(80, 'x');
+        int64_t t0 = now - cfg.history * 1'000'000;  // по сообщению в миллисекунду до текущего момента
+        auto started = std::chrono::steady_clock::now();
+        Exec(conn, "BEGIN;");
+        for (int64_t i = 0; i < cfg.history; ++i) {
+            int64_t room = room_pick(rng);
+            int64_t unixtime = t0 + i * 1'000'000;
+            auto [date, time] = utime::UnixTimeNsToDateTimeCached(unixtime);
+            sqlite3_bind_text(msg_stmt, 1, text.data(), static_cast<int>(text.size()), SQLITE_STATIC);
+            sqlite3_bind_int64(msg_stmt, 2, unixtime);
+            sqlite3_bind_int64(msg_stmt, 3, static_cast<int64_t>(rng() % static_cast<uint64_t>(cfg.users)) + 1);
+            sqlite3_bind_int64(msg_stmt, 4, room + 1);
+            sqlite3_bind_text(msg_stmt, 5, date.c_str(), -1, SQLITE_TRANSIENT);
+            sqlite3_bind_text(msg_stmt, 6, time.c_str(), -1, SQLITE_TRANSIENT);
+            sqlite3_bind_int64(msg_stmt, 7, next_id[static_cast<size_t>(room)]++);
+            sqlite3_step(msg_stmt);
+            sqlite3_reset(msg_stmt);
+            if ((i + 1) % 100'000 == 0) {
+                Exec(conn, "COMMIT; BEGIN;");
+                double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+                std::fprintf(stderr, "\rhistory: %lld / %lld (%.0f rows/s)", static_cast<long long>(i + 1),
+                             static_cast<long long>(cfg.history), static_cast<double>(i + 1) / sec);
+            }
+        }
+        Exec(conn, "COMMIT;");
+        std::fprintf(stderr, "\n");
+        sqlite3_finalize(msg_stmt);
+        Exec(conn, "PRAGMA wal_checkpoint(TRUNCATE);");
+        sqlite3_close(conn);
+        return true;
+    }
+
+    // Номера сообщений существующей БД продолжаются с максимального по каждой комнате.
+    bool LoadCounters(const Config& cfg, std::vector<std::atomic<int64_t>>& next_id) {
+        sqlite3* conn = nullptr;
+        if (sqlite3_open_v2(cfg.db_file.c_str(), &conn, SQLITE_OPEN_READONLY, nullptr) != SQLITE_OK) {
+            return false;
+        }
+        sqlite3_stmt* stmt = nullptr;
+        sqlite3_prepare_v2(conn, "SELECT rooms_id, MAX(id_message_in_room) FROM messages GROUP BY rooms_id;", -1, &stmt, nullptr);
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            int64_t room = sqlite3_column_int64(stmt, 0) - 1;
+            if (room >= 0 && room < cfg.rooms) {
+                next_id[static_cast<size_t>(room)] = sqlite3_column_int64(stmt, 1) + 1;
+            }
+        }
+        sqlite3_finalize(stmt);
+        sqlite3_close(conn);
+        return true;
+    }
+
+    struct ThreadStats {
+        std::array<Histogram, kOpCount> latency;
+        std::array<uint64_t, kOpCount> errors{};
+    };
+
+    void Worker(const Config& cfg, int index, db::DB& db, const Zipf& room_pick, std::vector<std::atomic<int64_t>>& next_id,
+                const std::atomic<bool>& stop, ThreadStats& stats) {
+        std::mt19937_64 rng(1000 + index);
+        std::vector<int> weights;
+        for (int op = 0; op < kOpCount; ++op) {
+            auto it = cfg.mix.find(kOpNames[op]);
+            weights.push_back(it == cfg.mix.end() ? 0 : it->second);
+        }
+        std::discrete_distribution<int> pick_op(weights.begin(), weights.end());
+        const std::string text(80, 'y');
+
+        while (!stop.load(std::memory_order_relaxed)) {
+            int op = pick_op(rng);
+            int64_t room_index = room_pick(rng);
+            std::string room = RoomName(room_index);
+            std::string login = Login(static_cast<int64_t>(rng() % static_cast<uint64_t>(cfg.users)));
+            bool ok = true;
+
+            auto started = std::chrono::steady_clock::now();
+            switch (op) {
+            case kInsert: {
+                int64_t id = next_id[static_cast<size_t>(room_index)].fetch_add(1);
+                ok = db.InsertMessageToDB({ text, utime::GetUnixTimeNs(), login, room, id });
+                break;
+            }
+            case kTail: {
+                int64_t last = next_id[static_cast<size_t>(room_index)].load() - 1;
+                db.GetRangeMessagesRoomBatch(room, last, std::max<int64_t>(0, last - cfg.tail + 1));
+                break;
+            }
+            case kMember:
+                ok = (rng() & 1) ? db.AddUserToRoom(login, room) : db.DeleteUserFromRoom(login, room);
+                break;
+            case kLogin:
+                ok = db.GetUserData(login).has_value();
+                break;
+            case kReconnect: {
+                // клиент заново получает свои комнаты, их состав и хвост истории каждой
+                auto rooms = db.GetUserRooms(login);
+                int n = 0;
+                for (const auto& r : rooms) {
+                    if (n++ == cfg.reconnect_rooms) {
+                        break;
+                    }
+                    db.GetRoomActiveUsers(r);
+                    int64_t last = db.GetCountRoomMessages(r) - 1;  // номера в комнате идут с 0 без пропусков
+                    db.GetRangeMessagesRoomBatch(r, last, std::max<int64_t>(0, last - cfg.tail + 1));
+                }
+                break;
+            }
+            default:
+                break;
+            }
+            int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started).count();
+            stats.latency[op].Record(ns);
+            if (!ok) {
+                ++stats.errors[op];
+            }
+        }
+    }
+
+    bool ParseArgs(int argc, char** argv, Config& cfg) {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            auto value = [&]() -> std::string {
+                return i + 1 < argc ? argv[++i] : "";
+            };
+            if (arg == "--db") cfg.db_file = value();
+            else if (arg == "--users") cfg.users = std::stoll(value());
+            else if (arg == "--rooms") cfg.rooms = std::stoll(value());
+            else if (arg == "--history") cfg.history = std::stoll(value());
+            else if (arg == "--rooms-per-user") cfg.rooms_per_user = std::stoll(value());
+            else if (arg == "--threads") cfg.threads = std::stoi(value());
+            else if (arg == "--duration") cfg.duration_s = std::stoi(value());
+            else if (arg == "--zipf") cfg.zipf_s = std::stod(value());
+            else if (arg == "--tail") cfg.tail = std::stoll(value());
+            else if (arg == "--reuse") cfg.reuse = true;
+            else if (arg == "--busy-timeout") cfg.busy_timeout_ms = std::stoi(value());
+            else if (arg == "--mix") {
+                // insert=40,tail=40,...
+                std::string mix = value();
+                size_t pos = 0;
+                while (pos < mix.size()) {
+                    size_t end = mix.find(',', pos);
+                    std::string item = mix.substr(pos, end == std::string::npos ? std::string::npos : end - pos);
+                    size_t eq = item.find('=');
+                    if (eq == std::string::npos) {
+                        return false;
+                    }
+                    cfg.mix[item.substr(0, eq)] = std::stoi(item.substr(eq + 1));
+                    pos = end == std::string::npos ? mix.size() : end + 1;
+                }
+            } else {
+                return false;
+            }
+        }
+        return cfg.users > 0 && cfg.rooms > 0 && cfg.threads > 0;
+    }
+} // namespace
+
+int main(int argc, char** argv) {
+    Config cfg;
+    if (!ParseArgs(argc, argv, cfg)) {
+        std::cerr << "usage: chat_loadgen [--db file] [--users N] [--rooms N] [--history N] [--rooms-per-user N]\n"
+                     "                    [--threads N] [--duration sec] [--zipf s] [--tail N] [--reuse] [--busy-timeout ms]\n"
+                     "                    [--mix insert=40,tail=40,member=5,login=10,reconnect=5]\n";
+        return 2;
+    }
+
+    std::vector<std::atomic<int64_t>> next_id(static_cast<size_t>(cfg.rooms));
+    bool ready = cfg.reuse ? LoadCounters(cfg, next_id) : BuildDatabase(cfg, next_id);
+    if (!ready) {
+        std::cerr << "failed to prepare " << cfg.db_file << "\n";
+        return 1;
+    }
+
+    // подключения открываются по очереди: InitSchema нескольких подключений одновременно конфликтует по блокировке
+    db::DBOptions options = db::DBOptions::MultiProcess();
+    options.busy_timeout = std::chrono::milliseconds(cfg.busy_timeout_ms);
+    std::vector<std::unique_ptr<db::DB>> connections;
+    for (int t = 0; t < cfg.threads; ++t) {
+        connections.push_back(std::make_unique<db::DB>(cfg.db_file, options));
+        if (!connections.back()->OpenDB()) {
+            std::cerr << "failed to open " << cfg.db_file << "\n";
+            return 1;
+        }
+    }
+
+    Zipf room_pick(cfg.rooms, cfg.zipf_s);
+    std::atomic<bool> stop{ false };
+    std::vector<ThreadStats> stats(static_cast<size_t>(cfg.threads));
+    std::vector<std::thread> workers;
+    auto started = std::chrono::steady_clock::now();
+    for (int t = 0; t < cfg.threads; ++t) {
+        workers.emplace_back(Worker, std::cref(cfg), t, std::ref(*connections[static_cast<size_t>(t)]), std::cref(room_pick), std::ref(next_id), std::cref(stop),
+                             std::ref(stats[static_cast<size_t>(t)]));
+    }
+    std::this_thread::sleep_for(std::chrono::seconds(cfg.duration_s));
+    stop = true;
+    for (auto& w : workers) {
+        w.join();
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+    std::printf("threads=%d duration=%.1fs users=%lld rooms=%lld zipf=%.2f\n", cfg.threads, elapsed,
+                static_cast<long long>(cfg.users), static_cast<long long>(cfg.rooms), cfg.zipf_s);
+    std::printf("%-10s %12s %10s %8s %12s %12s %12s\n", "op", "count", "ops/s", "errors", "p50 us", "p99 us", "p99.9 us");
+    uint64_t total = 0;
+    for (int op = 0; op < kOpCount; ++op) {
+        Histogram merged;
+        uint64_t errors = 0;
+        for (const auto& s : stats) {
+            merged.Merge(s.latency[op]);
+            errors += s.errors[op];
+        }
+        total += merged.Count();
+        std::printf("%-10s %12llu %10.0f %8llu %12.1f %12.1f %12.1f\n", kOpNames[op],
+                    static_cast<unsigned long long>(merged.Count()), static_cast<double>(merged.Count()) / elapsed,
+                    static_cast<unsigned long long>(errors),
+                    static_cast<double>(merged.Percentile(50)) / 1000.0, static_cast<double>(merged.Percentile(99)) / 1000.0,
+                    static_cast<double>(merged.Percentile(99.9)) / 1000.0);
+    }
+    std::printf("%-10s %12llu %10.0f\n", "total", static_cast<unsigned long long>(total), static_cast<double>(total) / elapsed);
+
+    db::ContentionStats contention{};
+    for (const auto& connection : connections) {
+        db::ContentionStats c = connection->GetContentionStats();
+        contention.busy_events += c.busy_events;
+        contention.busy_timeouts += c.busy_timeouts;
+        contention.retries += c.retries;
+        contention.wait_ns += c.wait_ns;
+    }
+    std::printf("busy: events=%llu timeouts=%llu retries=%llu wait=%.1f ms\n",
+                static_cast<unsigned long long>(contention.busy_events), static_cast<unsigned long long>(contention.busy_timeouts),
+                static_cast<unsigned long long>(contention.retries), static_cast<double>(contention.wait_ns) / 1e6);
+    return 0;
+}
@@ -0,0 +1,187 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+namespace db {
+    // Ссылка на строку внутри TextArena.
+    struct TextRef {
+        uint32_t offset = 0;
+        uint32_t length = 0;
+    };
+
+    // Все строки пакета лежат подряд в одном буфере; повторяющиеся значения (комната, логин, роль)
+    // хранятся один раз через Intern.
+    class TextArena {
+    public:
+        TextArena();
+        TextArena(TextArena&& other) noexcept;
+        TextArena& operator=(TextArena&& other) noexcept;
+        TextArena(const TextArena&) = delete;
+        TextArena& operator=(const TextArena&) = delete;
+
+        void Reserve(size_t bytes);
+        TextRef Append(std::string_view text);
+        TextRef Intern(std::string_view text);
+        // Освобождает таблицу дедупликации, когда пакет заполнен.
+        void Seal();
+
+        std::string_view Get(TextRef ref) const {
+            return std::string_view(data_.data() + ref.offset, ref.length);
+        }
+
+        size_t Bytes() const {
+            return data_.size();
+        }
+
+    private:
+        struct RefHash {
+            const std::string* data;
+            size_t operator()(TextRef ref) const;
+        };
+        struct RefEqual {
+            const std::string* data;
+            bool operator()(TextRef a, TextRef b) const;
+        };
+
+        std::string data_;
+        std::unordered_set<TextRef, RefHash, RefEqual> interned_;
+    };
+
+    // Индексный итератор по пакету: разыменование возвращает легкое представление строки.
+    template <typename Batch, typename View>
+    class BatchIterator {
+    public:
+        BatchIterator(const Batch* batch, size_t index) : batch_(batch), index_(index) {}
+
+        View operator*() const {
+            return (*batch_)[index_];
+        }
+
+        BatchIterator& operator++() {
+            ++index_;
+            return *this;
+        }
+
+        bool operator!=(const BatchIterator& other) const {
+            return index_ != other.index_;
+        }
+
+    private:
+        const Batch* batch_;
+        size_t index_;
+    };
+
+    struct UserView {
+        std::string_view login;
+        std::string_view name;
+        std::string_view password_hash;
+        std::string_view role;
+        bool is_deleted;
+        int64_t unixtime; //ns
+    };
+
+    // Пользователи в колоночном виде. Представления действительны, пока жив пакет.
+    class UserBatch {
+    public:
+        void Reserve(size_t rows);
+        void Append(std::string_view login, std::string_view name, std::string_view password_hash,
+                    std::string_view role, bool is_deleted, int64_t unixtime);
+        void Seal() {
+            arena_.Seal();
+        }
+
+        size_t size() const {
+            return unixtime_.size();
+        }
+
+        bool empty() const {
+            return unixtime_.empty();
+        }
+
+        std::string_view login(size_t i) const { return arena_.Get(login_[i]); }
+        std::string_view name(size_t i) const { return arena_.Get(name_[i]); }
+        std::string_view password_hash(size_t i) const { return arena_.Get(password_hash_[i]); }
+        std::string_view role(size_t i) const { return arena_.Get(role_[i]); }
+        bool is_deleted(size_t i) const { return is_deleted_[i] != 0; }
+        int64_t unixtime(size_t i) const { return unixtime_[i]; }
+
+        UserView operator[](size_t i) const {
+            return { login(i), name(i), password_hash(i), role(i), is_deleted(i), unixtime(i) };
+        }
+
+        BatchIterator<UserBatch, UserView> begin() const { return { this, 0 }; }
+        BatchIterator<UserBatch, UserView> end() const { return { this, size() }; }
+
+        const TextArena& arena() const {
+            return arena_;
+        }
+
+    private:
+        TextArena arena_;
+        std::vector<TextRef> login_;
+        std::vector<TextRef> name_;
+        std::vector<TextRef> password_hash_;
+        std::vector<TextRef> role_;
+        std::vector<uint8_t> is_deleted_;
+        std::vector<int64_t> unixtime_;
+    };
+
+    struct MessageView {
+        std::string_view message;
+        int64_t unixtime; //ns
+        std::string_view user_login;
+        std::string_view room;
+        int64_t id_message_in_room;
+    };
+
+    // Сообщения в колоночном виде; логин и комната дедуплицируются.
+    class MessageBatch {
+    public:
+        void Reserve(size_t rows);
+        void Append(std::string_view message, int64_t unixtime, std::string_view user_login,
+                    std::string_view room, int64_t id_message_in_room);
+        void Seal() {
+            arena_.Seal();
+        }
+
+        size_t size() const {
+            return unixtime_.size();
+        }
+
+        bool empty() const {
+            return unixtime_.empty();
+        }
+
+        std::string_view message(size_t i) const { return arena_.Get(message_[i]); }
+        int64_t unixtime(size_t i) const { return unixtime_[i]; }
+        std::string_view user_login(size_t i) const { return arena_.Get(user_login_[i]); }
+        std::string_view room(size_t i) const { return arena_.Get(room_[i]); }
+        int64_t id_message_in_room(size_t i) const { return id_message_in_room_[i]; }
+
+        const std::vector<int64_t>& unixtimes() const { return unixtime_; }
+        const std::vector<int64_t>& ids_message_in_room() const { return id_message_in_room_; }
+
+        MessageView operator[](size_t i) const {
+            return { message(i), unixtime(i), user_login(i), room(i), id_message_in_room(i) };
+        }
+
+        BatchIterator<MessageBatch, MessageView> begin() const { return { this, 0 }; }
+        BatchIterator<MessageBatch, MessageView> end() const { return { this, size() }; }
+
+        const TextArena& arena() const {
+            return arena_;
+        }
+
+    private:
+        TextArena arena_;
+        std::vector<TextRef> message_;
+        std::vector<int64_t> unixtime_;
+        std::vector<TextRef> user_login_;
+        std::vector<TextRef> room_;
+        std::vector<int64_t> id_message_in_room_;
+    };
+} // db
@@ -0,0 +1,37 @@
+#pragma once
+#include <cstdint>
+#include <string>
+
+namespace db {
+    // Значения совпадают с кодами в change_log (см. sql::CHANGE_FEED_SQL).
+    enum class ChangeEntity : int {
+        kMessage = 0,
+        kUser = 1,
+        kRoom = 2,
+        kMembership = 3  // user_rooms
+    };
+
+    enum class ChangeOp : int {
+        kInsert = 0,
+        kUpdate = 1,
+        kDelete = 2
+    };
+
+    // Зафиксированное изменение. position строго возрастает в порядке фиксации транзакций.
+    struct ChangeRecord {
+        int64_t position;
+        ChangeEntity entity;
+        ChangeOp op;
+        int64_t row_id;              // rowid строки в таблице сущности
+        std::string room;            // пусто, если не применимо или комната уже удалена
+        std::string login;           // пусто, если не применимо или пользователь уже удален
+        int64_t id_message_in_room;  // только для kMessage, иначе 0
+    };
+
+    // Получатель ленты изменений. Вызывается в потоке, выполнившем запись, после фиксации транзакции.
+    class ChangeSubscriber {
+    public:
+        virtual ~ChangeSubscriber() = default;
+        virtual void OnChange(const ChangeRecord& record) = 0;
+    };
+} // db
@@ -1,16 +1,31 @@
 #pragma once
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <optional>
+#include <random>
+#include <shared_mutex>
 #include <sqlite3.h>
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
+#include <utility>
 #include <vector>
 
+#include "batch.hpp"
+#include "change_feed.hpp"
+#include "export.hpp"
+#include "io_stats.hpp"
+#include "transaction.hpp"
+
 namespace db {
     struct User {
 
         User(std::string login, std::string name, std::string password_hash, std::string role, bool is_deleted, int64_t unixtime) :
-            login(login), name(name), password_hash(password_hash), role(role), is_deleted(is_deleted), unixtime(unixtime) {}
+            login(std::move(login)), name(std::move(name)), password_hash(std::move(password_hash)), role(std::move(role)),
+            is_deleted(is_deleted), unixtime(unixtime) {}
 
         std::string login;
         std::string name;
@@ -24,10 +39,10 @@ namespace db {
         
         Message(std::string message, int64_t unixtime, 
                 std::string user_login, std::string room, int64_t id_message_in_room):
-            message(message), 
+            message(std::move(message)), 
             unixtime(unixtime), 
-            user_login(user_login), 
-            room(room), 
+            user_login(std::move(user_login)), 
+            room(std::move(room)), 
             id_message_in_room(id_message_in_room){}
         
         std::string message;
@@ -37,16 +52,186 @@ namespace db {
         int64_t id_message_in_room;
     };
 
+    // Сводка по комнате из room_stats, поддерживается при записи сообщений.
+    struct RoomStats {
+        std::string room;
+        int64_t message_count;
+        int64_t last_message_id;  // наибольший id_message_in_room, -1 - сообщений нет
+        int64_t last_activity;    // ns, время последнего сообщения или создания комнаты
+    };
+
+    // Вложение сообщения. Содержимое хранится в attachments.data и читается/пишется частями, в Attachment его нет.
+    struct Attachment {
+        int64_t id;
+        std::string name;
+        int64_t size;  // байт
+    };
+
+    // Параметры подключения. По умолчанию - единственный процесс на файле: SQLITE_BUSY возвращается сразу.
+    struct DBOptions {
+        // Ожидание блокировки, занятой другим подключением: повторные попытки с экспоненциальной задержкой
+        // от backoff_min до backoff_max со случайным разбросом. 0 - не ждать.
+        std::chrono::milliseconds busy_timeout{ 0 };
+        std::chrono::microseconds backoff_min{ 100 };
+        std::chrono::microseconds backoff_max{ 20'000 };
+        // Повторы идемпотентных операций (чтение, INSERT OR IGNORE, UPDATE/DELETE по ключу), не дождавшихся
+        // блокировки. Вне явной транзакции: в ней решение о повторе за вызывающим.
+        int busy_retries = 0;
+        // Учет ввода-вывода по методам DB (GetIoStats): файл открывается через прослойку VFS поверх VFS по умолчанию.
+        // Цена - два замера времени на каждое чтение/запись страницы.
+        bool io_accounting = false;
+        // Эфемерные комнаты (SetRoomEphemeral): к подключению присоединяется БД в памяти. Имя файла БД при этом
+        // разбирается как URI ("file:chat.db?..."), обычный путь работает как раньше.
+        bool ephemeral_rooms = false;
+        // Кэш страниц подключения, КиБ (PRAGMA cache_size = -N); 0 - по умолчанию SQLite, 2 МиБ.
+        int64_t cache_size_kib = 0;
+        // Окно отображения файла в память, байт (PRAGMA mmap_size); 0 - чтение через read().
+        // Чтение через mmap идет из страничного кэша ОС, который прогревает StartWarmup.
+        int64_t mmap_size = 0;
+
+        // несколько процессов (сервер, утилиты администрирования) на одном файле
+        static DBOptions MultiProcess() {
+            DBOptions options;
+            options.busy_timeout = std::chrono::milliseconds(5'000);
+            options.busy_retries = 3;
+            return options;
+        }
+    };
+
+    // Счетчики ожидания блокировок подключения; читать можно из любого потока.
+    struct ContentionStats {
+        uint64_t busy_events;    // блокировка оказалась занята (первый вызов обработчика занятости)
+        uint64_t busy_timeouts;  // не дождались за busy_timeout, операция получила SQLITE_BUSY
+        uint64_t retries;        // повторы идемпотентных операций
+        int64_t wait_ns;         // суммарное время ожидания
+    };
+
+    // Фоновая очистка свободных страниц (DB::StartMaintenance).
+    struct MaintenanceOptions {
+        std::chrono::milliseconds check_interval{ 1'000 };
+        // простой - столько времени без записей через это подключение DB
+        std::chrono::milliseconds idle_after{ 2'000 };
+        int64_t pages_per_slice = 256;  // страниц за один PRAGMA incremental_vacuum
+        // пауза между срезами: запись, ждущая блокировку, успевает ее взять
+        std::chrono::milliseconds slice_pause{ 5 };
+        int64_t min_free_pages = 64;    // меньше - не очищать
+    };
+
+    struct SpaceStats {
+        bool incremental;         // auto_vacuum = INCREMENTAL
+        int64_t page_size;        // байт
+        int64_t page_count;
+        int64_t free_pages;       // страницы в списке свободных, файл можно уменьшить на столько
+        int64_t reclaimed_pages;  // возвращено фоновой очисткой с ее запуска
+        int64_t slices;           // выполнено срезов incremental_vacuum
+    };
+
+    // Сообщения эфемерной комнаты пишутся в память, без фиксации в WAL. Фоновая задача (StartEphemeralSnapshots)
+    // либо переносит их в файл, либо удаляет по истечении ttl.
+    struct EphemeralPolicy {
+        bool persist = true;
+        // для persist = false: сообщение удаляется, когда его unixtime старше текущего времени на ttl
+        std::chrono::milliseconds ttl{ 60'000 };
+    };
+
+    struct EphemeralOptions {
+        std::chrono::milliseconds interval{ 5'000 };  // период снимков и удаления истекших
+        int64_t batch_rows = 10'000;                  // сообщений за одну транзакцию переноса
+    };
+
+    struct EphemeralStats {
+        int64_t rooms;      // эфемерных комнат
+        int64_t messages;   // сообщений в памяти сейчас
+        int64_t persisted;  // перенесено в файл
+        int64_t expired;    // удалено по истечении ttl
+    };
+
+    // Прогрев после запуска (DB::StartWarmup): users, rooms и их индексы, затем хвосты самых активных комнат.
+    struct WarmupProgress {
+        bool running;
+        bool done;            // завершен (не остановлен StopWarmup)
+        int64_t steps_done;   // таблица, индекс или комната
+        int64_t steps_total;  // 0 - еще не подсчитано
+        int64_t rows;         // прочитано строк
+    };
+
+    struct WarmupOptions {
+        int64_t hot_rooms = 16;         // комнат по last_activity
+        int64_t tail_messages = 1'000;  // последних сообщений каждой
+        // вызывается из потока прогрева после каждого шага и в конце (running = false) - до того, как
+        // GetWarmupProgress покажет завершение
+        std::function<void(const WarmupProgress&)> on_progress;
+    };
+
+    class MaintenanceTask;
+    class ReadSnapshot;
+    class WarmupTask;
+    class EphemeralTier;
+    namespace io {
+        class Account;
+    }
+
     class DB {
     public:
         DB();
         explicit DB(const std::string& db_file);
+        DB(const std::string& db_file, const DBOptions& options);
         ~DB();
 
         // --- System ---
         bool OpenDB();
         void CloseDB();
         std::string GetVersionDB();
+        // открыта транзакция (Transaction, Savepoint): записи методов DB присоединяются к ней
+        bool InTransaction() const;
+        ContentionStats GetContentionStats() const;
+        // при выключенном DBOptions::io_accounting - пустая статистика
+        IoStats GetIoStats() const;
+        void ResetIoStats();
+
+        // --- Maintenance ---
+        // Новые файлы создаются с auto_vacuum = INCREMENTAL. Файлы, созданные раньше, переводятся однократным VACUUM:
+        bool MigrateToIncrementalVacuum();
+        // фоновая задача на отдельном подключении: в простое возвращает свободные страницы срезами; только для файла
+        bool StartMaintenance(const MaintenanceOptions& options = {});
+        void StopMaintenance();
+        // один срез сразу, на этом подключении; возвращает число освобожденных страниц, -1 - ошибка:
+        int64_t IncrementalVacuum(int64_t pages);
+        SpaceStats GetSpaceStats();
+        // доля разрывов между логически соседними листовыми страницами таблицы (0 - подряд, 1 - все вразброс);
+        // обходит всю таблицу; -1, если SQLite собран без dbstat:
+        double GetFragmentation(const std::string& table = "messages");
+
+        // --- Export ---
+        // Сообщения файла с after_messages_id в колоночный формат (см. export.hpp) одной читающей транзакцией,
+        // на отдельном подключении: рабочее подключение не ждет. Внутри транзакции или ReadSnapshot - в ней.
+        // Память - один блок. Эфемерные сообщения не выгружаются.
+        // sink получает данные частями по блоку; false из sink прекращает выгрузку (nullopt).
+        std::optional<ExportStats> ExportMessages(const std::function<bool(const char* data, size_t size)>& sink,
+                                                  const ExportOptions& options = {});
+
+        // --- Warmup ---
+        // Фоновое чтение горячих страниц на отдельном подключении, только для файла. Прогревается страничный кэш ОС:
+        // кэш страниц SQLite у каждого подключения свой. Рабочее подключение читает параллельно, без ожидания (WAL);
+        // с DBOptions::mmap_size оно берет прогретые страницы без копирования.
+        bool StartWarmup(const WarmupOptions& options = {});
+        void StopWarmup();
+        WarmupProgress GetWarmupProgress() const;
+
+        // --- Ephemeral rooms (DBOptions::ephemeral_rooms) ---
+        // Чтения сообщений и сводки комнаты объединяют файл и память. Сообщения в памяти не попадают в ленту изменений
+        // и не принимают вложения до переноса в файл, видны только этому подключению и теряются при сбое процесса.
+        bool SetRoomEphemeral(const std::string& room, const EphemeralPolicy& policy = {});
+        // переносит сообщения комнаты из памяти в файл сразу:
+        bool SetRoomDurable(const std::string& room);
+        bool IsRoomEphemeral(const std::string& room) const;
+        // фоновая задача на отдельном подключении; только для файла:
+        bool StartEphemeralSnapshots(const EphemeralOptions& options = {});
+        void StopEphemeralSnapshots();
+        // один проход переноса и удаления истекших на этом подключении; возвращает число перенесенных, -1 - ошибка.
+        // Выполняется и в CloseDB: сообщения persist-комнат не теряются при штатном закрытии.
+        int64_t FlushEphemeral();
+        EphemeralStats GetEphemeralStats();
 
         // --- Users ---
         bool CreateUser(const User& user);
@@ -56,9 +241,15 @@ namespace db {
         bool IsAliveUser(const std::string& user_login);
         bool ChangeUserName(const std::string& user_login, const std::string& new_name);
         std::optional<User> GetUserData(const std::string& user_login);
+        // пакетные варианты, один запрос на весь пакет; i-й элемент результата соответствует i-му логину/комнате:
+        std::vector<std::optional<User>> GetUsersData(const std::vector<std::string>& logins);
+        std::vector<bool> AreAliveUsers(const std::vector<std::string>& logins);
         std::vector<User> GetAllUsers();
         std::vector<User> GetActiveUsers();
         std::vector<User> GetDeletedUsers();
+        // то же, что GetAllUsers/GetActiveUsers, но строки в одном буфере, без std::string на поле:
+        UserBatch GetAllUsersBatch();
+        UserBatch GetActiveUsersBatch();
         std::vector<std::string> GetUserRooms(const std::string& user_login);
         std::unordered_map<std::string, std::unordered_set<std::string>> GetAllRoomWithRegisteredUsers();
 
@@ -70,6 +261,7 @@ namespace db {
         bool IsRoom(const std::string& room);
         bool AddUserToRoom(const std::string& user_login, const std::string& room);
         std::vector<User> GetRoomActiveUsers(const std::string& room);
+        std::vector<std::vector<User>> GetRoomsActiveUsers(const std::vector<std::string>& rooms);
         // без удаления сообщений пользователя в комнате, только из TABLE user_rooms:
         bool DeleteUserFromRoom(const std::string& user_login, const std::string& room);
         std::vector<std::string> GetRooms();
@@ -77,17 +269,127 @@ namespace db {
         // --- Messages ---
         bool InsertMessageToDB(const Message& message); 
         std::vector<Message> GetRangeMessagesRoom(const std::string& room, int64_t id_message_begin, int64_t id_message_end);
+        MessageBatch GetRangeMessagesRoomBatch(const std::string& room, int64_t id_message_begin, int64_t id_message_end);
         int GetCountRoomMessages(const std::string& room);
+        // сводка без обхода сообщений комнаты (room_stats):
+        std::optional<RoomStats> GetRoomStats(const std::string& room);
+        std::vector<RoomStats> GetAllRoomStats();
+        // не более limit комнат, начиная с последней активной:
+        std::vector<RoomStats> GetRoomStatsByActivity(int64_t limit);
+        // сообщения с unixtime в [t_begin_ns, t_end_ns] по возрастанию времени, не более limit:
+        std::vector<Message> GetMessagesByTime(const std::string& room, int64_t t_begin_ns, int64_t t_end_ns, int64_t limit);
+        std::vector<Message> GetUserMessagesByTime(const std::string& user_login, int64_t t_begin_ns, int64_t t_end_ns, int64_t limit);
+        // номер первого сообщения комнаты с unixtime >= t_ns, для перевода даты в диапазон номеров:
+        std::optional<int64_t> GetFirstMessageIdAtOrAfter(const std::string& room, int64_t t_ns);
+
+        // --- Attachments ---
+        // Большие тела и вложения лежат в отдельной таблице attachments, строка messages хранит только связь с ними.
+        // source заполняет буфер (не более cap байт) и возвращает число записанных байт; должен выдать ровно size байт.
+        // Вложение появляется целиком или никак; id - для остальных методов:
+        std::optional<int64_t> InsertAttachment(const std::string& room, int64_t id_message_in_room, const std::string& name,
+                                                int64_t size, const std::function<size_t(char* buffer, size_t cap)>& source);
+        // sink получает содержимое кусками по kAttachmentChunkSize; false из sink прекращает чтение:
+        bool StreamAttachment(int64_t attachment_id, const std::function<bool(const char* data, size_t size)>& sink);
+        // чтение в буфер вызывающего с позиции offset; возвращает число прочитанных байт, -1 - ошибка:
+        int64_t ReadAttachment(int64_t attachment_id, int64_t offset, char* buffer, size_t size);
+        // перезапись части содержимого; размер вложения не меняется:
+        bool WriteAttachment(int64_t attachment_id, int64_t offset, const char* data, size_t size);
+        std::vector<Attachment> GetMessageAttachments(const std::string& room, int64_t id_message_in_room);
+        bool DeleteAttachment(int64_t attachment_id);
+
+        static constexpr size_t kAttachmentChunkSize = 64 * 1024;
+
+        // --- Change feed ---
+        // создает триггеры change_log; после включения изменения пишутся в журнал всеми подключениями к файлу.
+        // Без ленты журнал пуст: чтения возвращают пустой результат и позицию 0.
+        bool EnableChangeFeed();
+        // доставляет подписчику записи с position > after_position (nullopt - только новые), затем новые по мере фиксации:
+        void Subscribe(std::shared_ptr<ChangeSubscriber> subscriber, std::optional<int64_t> after_position = std::nullopt);
+        void Unsubscribe(const std::shared_ptr<ChangeSubscriber>& subscriber);
+        // доставляет подписчикам изменения, зафиксированные другими подключениями:
+        void PollChangeFeed();
+        std::vector<ChangeRecord> GetChanges(int64_t after_position, int64_t limit);
+        int64_t GetChangeLogPosition();
+        // удаляет записи журнала с position <= up_to_position (все узлы уже их получили):
+        bool TrimChangeLog(int64_t up_to_position);
 
     private:
+        friend class Transaction;
+        friend class Savepoint;
+        friend class ReadSnapshot;
+
+        struct Subscription {
+            std::shared_ptr<ChangeSubscriber> subscriber;
+            int64_t position;
+        };
+
         sqlite3* db_ = nullptr;
         std::string db_filename_ = "chat.db";
+        DBOptions options_;
+
+        std::atomic<uint64_t> busy_events_{ 0 };
+        std::atomic<uint64_t> busy_timeouts_{ 0 };
+        std::atomic<uint64_t> busy_retries_{ 0 };
+        std::atomic<int64_t> busy_wait_ns_{ 0 };
+        std::chrono::steady_clock::time_point busy_since_;
+        int background_waits_ = 0;  // запущенных фоновых задач, см. HoldBackgroundWait
+        static constexpr std::chrono::milliseconds kBackgroundBusyTimeout{ 1'000 };
+        std::minstd_rand backoff_rng_{ std::random_device{}() };
+
+        std::atomic<int64_t> last_write_ns_{ 0 };  // steady_clock, время последней фиксации записи
+        std::unique_ptr<MaintenanceTask> maintenance_;
+        std::unique_ptr<WarmupTask> warmup_;
+        std::unique_ptr<io::Account> io_;
+        std::unique_ptr<EphemeralTier> ephemeral_;
+        // свободные подключения ReadSnapshot(dedicated); снимки берут и возвращают их из любого потока
+        std::mutex readers_mutex_;
+        std::vector<std::unique_ptr<DB>> readers_;
+        bool readers_open_ = true;  // false после CloseDB: возвращенные подключения закрываются
+
+        std::vector<Subscription> subscribers_;
+        uint64_t subscribers_version_ = 0;  // меняется при Subscribe/Unsubscribe, в том числе из OnChange
+        bool feed_pending_ = false;    // в текущей транзакции были вставки в change_log
+        bool feed_committed_ = false;  // зафиксированы записи, еще не доставленные подписчикам
+        bool dispatching_ = false;
+        int savepoint_depth_ = 0;
+
+        std::string PushSavepoint();
+        void PopSavepoint();
+
+        void DispatchChanges();
+        static void FeedUpdateHook(void* self, int op, const char* db_name, const char* table, sqlite3_int64 rowid);
+        static int FeedCommitHook(void* self);
+        static void FeedRollbackHook(void* self);
+
+        void MarkWrite();
+        static int BusyHandler(void* self, int count);
+        // DBOptions::busy_timeout, а при 0 и работающей фоновой задаче с блокировкой записи - kBackgroundBusyTimeout
+        std::chrono::milliseconds BusyTimeout() const;
+        // Фоновая задача держит блокировку записи короткими срезами: без ожидания запись, совпавшая со срезом,
+        // сразу получила бы SQLITE_BUSY. Парные вызовы на запуск и остановку задачи.
+        void HoldBackgroundWait();
+        void ReleaseBackgroundWait();
+        // пауза перед попыткой attempt (с 0), не длиннее limit; учитывается в wait_ns
+        void Backoff(int attempt, std::chrono::nanoseconds limit);
+        // повтор fn после SQLITE_BUSY, только для идемпотентных операций (см. DBOptions::busy_retries)
+        template <typename Fn>
+        auto Retry(Fn&& fn) -> decltype(fn());
 
         bool InitSchema();
+        bool AttachEphemeral();
+        // подключение ReadSnapshot(dedicated): только чтение, без схемы, хуков и eph
+        bool OpenReader();
+        // nullptr - не файл или открыть не удалось
+        std::unique_ptr<DB> TakeReader();
+        void ReturnReader(std::unique_ptr<DB> reader);
+        // Сообщения комнаты (или любой комнаты, без room) могут быть в памяти: чтение через *_TIERED под этой
+        // блокировкой, чтобы не застать перенос фоновой задачей наполовину. Иначе - пустая блокировка.
+        std::shared_lock<std::shared_mutex> LockEphemeral(const std::string& room) const;
+        std::shared_lock<std::shared_mutex> LockEphemeral() const;
+        // заменяет сводки эфемерных комнат на сводки с учетом памяти; limit >= 0 - порядок и отсечение по активности
+        void MergeEphemeralStats(std::vector<RoomStats>& stats, int64_t limit);
         bool SetUserForDelete(const std::string& user_login);
-        bool PerformSQLReturnBool(const char* sql_query, std::vector<std::string> param);
         bool DelDeletedUsersWithoutRoom();
-        std::vector<User> GetUsers(const char* sql);
     };
 } // db
 
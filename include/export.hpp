@@ -0,0 +1,93 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "batch.hpp"
+
+namespace db {
+    // Колоночный файл сообщений (DB::ExportMessages). Все числа - varint (LEB128), со знаком - zigzag.
+    //   заголовок: "LDBMSG", версия (2 байта LE), after_messages_id
+    //   блоки:     длина тела (4 байта LE), FNV-1a тела (4 байта LE), тело; длина 0 - конец файла
+    //   тело:      строк; новые комнаты и логины (число, затем длина и байты каждого: код - порядковый номер
+    //              в файле); столбцы, каждый с длиной в байтах:
+    //              messages_id         - разность с предыдущим (первый - с ExportOptions::after_messages_id)
+    //              комната, логин      - коды словарей
+    //              id_message_in_room  - zigzag-разность с предыдущим сообщением той же комнаты
+    //              unixtime            - zigzag-разность с предыдущей строкой
+    //              длины текстов; тексты - размер без сжатия, затем lz-блок (см. src/lz.hpp)
+    static constexpr char kExportMagic[] = "LDBMSG";
+    static constexpr uint16_t kExportVersion = 1;
+
+    struct ExportOptions {
+        int64_t after_messages_id = 0;          // продолжение прошлой выгрузки: ExportStats::last_messages_id
+        size_t block_rows = 65'536;
+        size_t block_text_bytes = 4 << 20;      // блок закрывается раньше, если тексты заняли больше
+    };
+
+    struct ExportStats {
+        int64_t rows;
+        int64_t blocks;
+        int64_t last_messages_id;   // after_messages_id, если новых сообщений нет
+        int64_t text_bytes;         // тексты без сжатия
+        int64_t bytes;              // записано в sink
+    };
+
+    // Чтение файла ExportMessages по блокам. source как у DB::InsertAttachment: 0 - конец данных.
+    class MessageExportReader {
+    public:
+        explicit MessageExportReader(std::function<size_t(char* buffer, size_t cap)> source);
+
+        // Следующий блок в batch (прежнее содержимое заменяется); false - конец файла или ошибка (см. Failed).
+        bool Next(MessageBatch& batch);
+        // Блок без сборки строк: коды словарей, поля по номеру строки.
+        bool Next();
+
+        bool Failed() const {
+            return failed_;
+        }
+
+        // Текущий блок; message действительно до следующего Next
+        size_t size() const { return messages_id_.size(); }
+        int64_t messages_id(size_t i) const { return messages_id_[i]; }
+        uint32_t room_code(size_t i) const { return room_[i]; }
+        uint32_t login_code(size_t i) const { return login_[i]; }
+        int64_t id_message_in_room(size_t i) const { return id_message_in_room_[i]; }
+        int64_t unixtime(size_t i) const { return unixtime_[i]; }
+        std::string_view message(size_t i) const {
+            return std::string_view(text_.data() + text_offset_[i], text_offset_[i + 1] - text_offset_[i]);
+        }
+
+        // Словари, накопленные с начала файла
+        const std::vector<std::string>& rooms() const { return rooms_; }
+        const std::vector<std::string>& logins() const { return logins_; }
+
+    private:
+        bool ReadExact(char* buffer, size_t size);
+        bool ReadHeader();
+        bool DecodeBlock();
+
+        std::function<size_t(char*, size_t)> source_;
+        bool started_ = false;
+        bool finished_ = false;
+        bool failed_ = false;
+
+        std::string body_;
+        std::vector<std::string> rooms_;
+        std::vector<std::string> logins_;
+        std::vector<int64_t> room_last_id_;  // по коду комнаты, для разностей id_message_in_room
+        int64_t last_messages_id_ = 0;
+        int64_t last_unixtime_ = 0;
+
+        std::vector<int64_t> messages_id_;
+        std::vector<uint32_t> room_;
+        std::vector<uint32_t> login_;
+        std::vector<int64_t> id_message_in_room_;
+        std::vector<int64_t> unixtime_;
+        std::vector<size_t> text_offset_;
+        std::string text_;
+    };
+} // db
@@ -0,0 +1,25 @@
+#pragma once
+#include <cstdint>
+#include <map>
+#include <string>
+
+namespace db {
+    // Ввод-вывод SQLite через прослойку VFS (DBOptions::io_accounting), время - в наносекундах.
+    struct IoCounters {
+        uint64_t calls = 0;        // вызовов метода DB
+        uint64_t reads = 0;
+        uint64_t read_bytes = 0;
+        int64_t read_ns = 0;
+        uint64_t writes = 0;
+        uint64_t write_bytes = 0;
+        int64_t write_ns = 0;
+        uint64_t syncs = 0;
+        int64_t sync_ns = 0;
+    };
+
+    // by_method - по внешнему вызванному методу DB (вложенные вызовы учитываются во внешнем), total - сумма.
+    struct IoStats {
+        IoCounters total;
+        std::map<std::string, IoCounters> by_method;
+    };
+} // db
@@ -0,0 +1,50 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+
+namespace db::log {
+    enum class Level : int {
+        kTrace = 0,
+        kDebug = 1,
+        kInfo = 2,
+        kWarn = 3,
+        kError = 4,
+        kOff = 5
+    };
+
+    // Структурированная запись журнала. Строковые поля действительны только на время вызова Sink::Write.
+    struct Record {
+        Level level;
+        int64_t unixtime;         //ns
+        std::string_view method;  // метод DB, в котором произошло событие
+        int rc;                   // код возврата SQLite (0, если не применимо)
+        std::string_view room;
+        std::string_view login;
+        std::string_view text;
+        uint32_t suppressed;      // сколько таких же записей (method + rc) отброшено ограничителем до этой
+    };
+
+    // Приемник записей. Вызывается только из фонового потока журнала.
+    class Sink {
+    public:
+        virtual ~Sink() = default;
+        virtual void Write(const Record& record) = 0;
+        virtual void Flush() {}
+    };
+
+    // Заменяет приемник; nullptr возвращает приемник по умолчанию (spdlog, если собран с ним, иначе std::cerr).
+    void SetSink(std::shared_ptr<Sink> sink);
+
+    // Не более burst записей с одинаковыми (method, rc) за окно window, остальные считаются в Record::suppressed.
+    // Счетчики у каждой пары свои: поток ошибок одного метода не расходует лимит другого.
+    // burst == 0 отключает ограничение. Окна и счетчики отброшенных начинаются заново.
+    void SetRateLimit(std::chrono::milliseconds window, uint32_t burst);
+
+    // Дожидается доставки в приемник всех записей, поставленных в очередь до вызова.
+    void Flush();
+
+    // Количество записей, отброшенных из-за переполнения кольцевого буфера.
+    uint64_t GetDroppedCount();
+} // db::log
@@ -0,0 +1,84 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "db.hpp"
+
+namespace db {
+    // Согласованное чтение несколькими вызовами: одна читающая транзакция WAL на все чтения снимка, без своей
+    // транзакции на каждый вызов. Записи, зафиксированные после открытия снимка, в нем не видны.
+    //   dedicated = false - на рабочем подключении DB. Чтения DB до Release тоже идут в снимке, записи через DB
+    //                       отклоняются (SQLITE_READONLY); внутри открытой транзакции снимок читает в ней.
+    //   dedicated = true  - на отдельном подключении только для чтения из пула DB (только для файла): запись через DB
+    //                       идет параллельно, снимок можно читать из другого потока. Эфемерные сообщения (в памяти) в нем не видны.
+    // Снимок не должен пережить DB. Читающая транзакция не дает checkpoint перенести WAL дальше своего начала:
+    // долго не держать.
+    class ReadSnapshot {
+    public:
+        explicit ReadSnapshot(DB& db, bool dedicated = false);
+        ~ReadSnapshot();
+
+        ReadSnapshot(const ReadSnapshot&) = delete;
+        ReadSnapshot& operator=(const ReadSnapshot&) = delete;
+
+        // false - снимок открыть не удалось, читать нельзя
+        explicit operator bool() const {
+            return active_;
+        }
+
+        // Завершает читающую транзакцию раньше деструктора; подключение возвращается в пул.
+        void Release();
+
+        // --- Users ---
+        bool IsUser(const std::string& user_login);
+        bool IsAliveUser(const std::string& user_login);
+        std::optional<User> GetUserData(const std::string& user_login);
+        std::vector<std::optional<User>> GetUsersData(const std::vector<std::string>& logins);
+        std::vector<bool> AreAliveUsers(const std::vector<std::string>& logins);
+        std::vector<User> GetAllUsers();
+        std::vector<User> GetActiveUsers();
+        std::vector<User> GetDeletedUsers();
+        UserBatch GetAllUsersBatch();
+        UserBatch GetActiveUsersBatch();
+        std::vector<std::string> GetUserRooms(const std::string& user_login);
+        std::unordered_map<std::string, std::unordered_set<std::string>> GetAllRoomWithRegisteredUsers();
+
+        // --- Rooms ---
+        bool IsRoom(const std::string& room);
+        std::vector<std::string> GetRooms();
+        std::vector<User> GetRoomActiveUsers(const std::string& room);
+        std::vector<std::vector<User>> GetRoomsActiveUsers(const std::vector<std::string>& rooms);
+
+        // --- Messages ---
+        std::vector<Message> GetRangeMessagesRoom(const std::string& room, int64_t id_message_begin, int64_t id_message_end);
+        MessageBatch GetRangeMessagesRoomBatch(const std::string& room, int64_t id_message_begin, int64_t id_message_end);
+        int GetCountRoomMessages(const std::string& room);
+        std::optional<RoomStats> GetRoomStats(const std::string& room);
+        std::vector<RoomStats> GetAllRoomStats();
+        std::vector<RoomStats> GetRoomStatsByActivity(int64_t limit);
+        std::vector<Message> GetMessagesByTime(const std::string& room, int64_t t_begin_ns, int64_t t_end_ns, int64_t limit);
+        std::vector<Message> GetUserMessagesByTime(const std::string& user_login, int64_t t_begin_ns, int64_t t_end_ns, int64_t limit);
+        std::optional<int64_t> GetFirstMessageIdAtOrAfter(const std::string& room, int64_t t_ns);
+        std::vector<Attachment> GetMessageAttachments(const std::string& room, int64_t id_message_in_room);
+
+        // --- Change feed, export ---
+        std::vector<ChangeRecord> GetChanges(int64_t after_position, int64_t limit);
+        int64_t GetChangeLogPosition();
+        // выгрузка ровно того состояния, которое видит снимок
+        std::optional<ExportStats> ExportMessages(const std::function<bool(const char* data, size_t size)>& sink,
+                                                  const ExportOptions& options = {});
+
+    private:
+        DB& owner_;
+        std::unique_ptr<DB> reader_;  // dedicated: подключение из пула owner_
+        DB* db_ = nullptr;            // owner_ или reader_
+        bool began_ = false;          // BEGIN выполнен снимком (не чтение внутри чужой транзакции)
+        bool active_ = false;
+    };
+} // db
@@ -2,8 +2,13 @@
 
 #include <chrono>
 #include <cstdint>
+#include <cstring>
+#include <ctime>
 #include <sstream>
 #include <iomanip>
+#include <string>
+#include <utility>
+#include <vector>
 
 namespace utime {
     inline int64_t GetUnixTimeNs() {
@@ -30,4 +35,126 @@ namespace utime {
 
         return { date_buf, time_buf };
     }
+
+    // То же преобразование, что UnixTimeNsToDateTime, без localtime_r на каждый вызов.
+    // Кэшируется интервал секунд с одной локальной датой и постоянным смещением от UTC: внутри него дата
+    // берется из кэша, время суток считается целочисленно. На границе суток или перехода на летнее/зимнее время
+    // интервал пересчитывается. Смена TZ во время работы процесса не отслеживается. Объект не потокобезопасен.
+    class DateTimeCache {
+    public:
+        // date - не меньше 11 байт ("2023-11-15\0"), time - не меньше 9 ("14:30:45\0")
+        bool Format(int64_t unix_time_ns, char* date, char* time) {
+            std::time_t t = static_cast<time_t>(unix_time_ns / 1'000'000'000);
+            if (!(t >= begin_ && t < end_) && !Refresh(t)) {
+                return false;
+            }
+            std::memcpy(date, date_, sizeof(date_));
+            int64_t second_of_day = static_cast<int64_t>(t - base_);
+            WriteTwoDigits(time, second_of_day / 3600);
+            time[2] = ':';
+            WriteTwoDigits(time + 3, second_of_day / 60 % 60);
+            time[5] = ':';
+            WriteTwoDigits(time + 6, second_of_day % 60);
+            time[8] = '\0';
+            return true;
+        }
+
+        std::pair<std::string, std::string> Format(int64_t unix_time_ns) {
+            char date_buf[11], time_buf[9];
+            if (!Format(unix_time_ns, date_buf, time_buf)) {
+                return { "error", "error" };
+            }
+            return { date_buf, time_buf };
+        }
+
+    private:
+        static bool LocalTime(std::time_t t, std::tm& tm_struct) {
+#if defined(_WIN32)
+            return localtime_s(&tm_struct, &t) == 0;
+#else
+            return localtime_r(&t, &tm_struct) != nullptr;
+#endif
+        }
+
+        static void WriteTwoDigits(char* out, int64_t value) {
+            out[0] = static_cast<char>('0' + value / 10);
+            out[1] = static_cast<char>('0' + value % 10);
+        }
+
+        // x показывается той же датой и временем суток x - base_, что и опорная секунда
+        bool SameInterval(std::time_t x, const std::tm& ref) const {
+            std::tm tm_struct{};
+            if (!LocalTime(x, tm_struct)) {
+                return false;
+            }
+            return tm_struct.tm_year == ref.tm_year && tm_struct.tm_yday == ref.tm_yday
+                   && tm_struct.tm_hour * 3600 + tm_struct.tm_min * 60 + tm_struct.tm_sec == x - base_;
+        }
+
+        // Границы ищутся двоичным поиском только в сутки с переходом: за сутки не бывает больше одного.
+        bool Refresh(std::time_t t) {
+            std::tm ref{};
+            if (!LocalTime(t, ref)) {
+                return false;
+            }
+            base_ = t - (ref.tm_hour * 3600 + ref.tm_min * 60 + ref.tm_sec);
+            std::strftime(date_, sizeof(date_), "%Y-%m-%d", &ref);
+
+            std::time_t lo = base_;
+            if (!SameInterval(lo, ref)) {
+                std::time_t bad = lo, good = t;
+                while (good - bad > 1) {
+                    std::time_t mid = bad + (good - bad) / 2;
+                    if (SameInterval(mid, ref)) {
+                        good = mid;
+                    } else {
+                        bad = mid;
+                    }
+                }
+                lo = good;
+            }
+            std::time_t hi = base_ + 86'399;
+            if (!SameInterval(hi, ref)) {
+                std::time_t good = t, bad = hi;
+                while (bad - good > 1) {
+                    std::time_t mid = good + (bad - good) / 2;
+                    if (SameInterval(mid, ref)) {
+                        good = mid;
+                    } else {
+                        bad = mid;
+                    }
+                }
+                hi = good;
+            }
+            begin_ = lo;
+            end_ = hi + 1;
+            return true;
+        }
+
+        std::time_t begin_ = 0;
+        std::time_t end_ = 0;  // пустой интервал до первого вызова
+        std::time_t base_ = 0; // UTC-секунда, соответствующая локальной полуночи по смещению интервала
+        char date_[11] = {};
+    };
+
+    // Кэш на поток: InsertMessageToDB из разных потоков не делит ни кэш, ни блокировку часового пояса glibc.
+    inline DateTimeCache& ThreadDateTimeCache() {
+        thread_local DateTimeCache cache;
+        return cache;
+    }
+
+    inline std::pair<std::string, std::string> UnixTimeNsToDateTimeCached(int64_t unix_time_ns) {
+        return ThreadDateTimeCache().Format(unix_time_ns);
+    }
+
+    // Для выборок целиком: соседние по времени значения попадают в один кэшированный интервал.
+    inline std::vector<std::pair<std::string, std::string>> UnixTimeNsToDateTimeBatch(const std::vector<int64_t>& unix_times_ns) {
+        std::vector<std::pair<std::string, std::string>> result;
+        result.reserve(unix_times_ns.size());
+        DateTimeCache& cache = ThreadDateTimeCache();
+        for (int64_t ns : unix_times_ns) {
+            result.push_back(cache.Format(ns));
+        }
+        return result;
+    }
 } // utime
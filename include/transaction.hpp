@@ -0,0 +1,55 @@
+#pragma once
+#include <string>
+
+namespace db {
+    class DB;
+
+    // Транзакция записи: BEGIN IMMEDIATE, блокировка записи берется сразу, без повышения из чтения.
+    // Созданная внутри уже открытой транзакции становится точкой сохранения и фиксируется вместе с внешней.
+    // Методы DB внутри транзакции не фиксируют каждый свою запись. Без Commit откатывается в деструкторе.
+    class Transaction {
+    public:
+        explicit Transaction(DB& db);
+        ~Transaction();
+
+        Transaction(const Transaction&) = delete;
+        Transaction& operator=(const Transaction&) = delete;
+
+        // false - транзакцию начать не удалось (например, SQLITE_BUSY), запись не выполнять
+        explicit operator bool() const {
+            return active_;
+        }
+
+        bool Commit();
+        void Rollback();
+
+    private:
+        DB& db_;
+        std::string savepoint_;  // пусто - внешняя транзакция
+        bool active_ = false;
+    };
+
+    // Точка сохранения: частичный откат внутри транзакции. Вне транзакции SQLite начинает отложенную (DEFERRED).
+    class Savepoint {
+    public:
+        explicit Savepoint(DB& db);
+        ~Savepoint();
+
+        Savepoint(const Savepoint&) = delete;
+        Savepoint& operator=(const Savepoint&) = delete;
+
+        explicit operator bool() const {
+            return active_;
+        }
+
+        // RELEASE: изменения остаются в охватывающей транзакции
+        bool Release();
+        // ROLLBACK TO + RELEASE: отменяет изменения после создания точки
+        void Rollback();
+
+    private:
+        DB& db_;
+        std::string name_;
+        bool active_ = false;
+    };
+} // db
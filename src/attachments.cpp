@@ -0,0 +1,145 @@
+#include <algorithm>
+#include <climits>
+#include <sqlite3.h>
+#include <vector>
+
+#include "db.hpp"
+#include "io_vfs.hpp"
+#include "logger.hpp"
+#include "sql_queries.hpp"
+#include "stmt.hpp"
+
+namespace db {
+    namespace {
+        // Смещения и длины sqlite3_blob_* - int.
+        bool FitsBlobRange(int64_t offset, size_t size) {
+            return offset >= 0 && size <= static_cast<size_t>(INT_MAX) &&
+                   offset <= static_cast<int64_t>(INT_MAX) - static_cast<int64_t>(size);
+        }
+    } // namespace
+
+    std::optional<int64_t> DB::InsertAttachment(const std::string& room, int64_t id_message_in_room, const std::string& name,
+                                                int64_t size, const std::function<size_t(char* buffer, size_t cap)>& source) {
+        DB_IO_SCOPE();
+        if (size < 0 || size > INT_MAX) {
+            DB_LOG_ERROR("InsertAttachment", SQLITE_TOOBIG, room, {}, "attachment size out of range");
+            return std::nullopt;
+        }
+        // строка и содержимое фиксируются вместе
+        Transaction tx(*this);
+        if (!tx) {
+            return std::nullopt;
+        }
+
+        bool success = false;
+        int64_t attachment_id = 0;
+        {
+            Query<void(std::string_view, int64_t, std::string_view, int64_t, int64_t)> query(db_, sql::typed::CREATE_ATTACHMENT);
+            success = query.Bind(room, id_message_in_room, name, size, size).Exec();
+            if (!success) {
+                DB_LOG_ERROR("InsertAttachment", query.Rc(), room, {}, sqlite3_errmsg(db_));
+            }
+        }
+        if (success) {
+            attachment_id = sqlite3_last_insert_rowid(db_);
+            Blob blob(db_, "attachments", "data", attachment_id, true);
+            std::vector<char> chunk(static_cast<size_t>(std::min<int64_t>(size, kAttachmentChunkSize)));
+            int64_t written = 0;
+            success = blob.IsOpen();
+            while (success && written < size) {
+                size_t want = static_cast<size_t>(std::min<int64_t>(size - written, kAttachmentChunkSize));
+                size_t got = source(chunk.data(), want);
+                if (got == 0 || got > want) {
+                    DB_LOG_ERROR("InsertAttachment", SQLITE_MISUSE, room, {}, "source size does not match attachment size");
+                    success = false;
+                    break;
+                }
+                success = blob.Write(chunk.data(), static_cast<int>(got), static_cast<int>(written));
+                written += static_cast<int64_t>(got);
+            }
+            if (!blob.IsOpen() || blob.Rc() != SQLITE_OK) {
+                DB_LOG_ERROR("InsertAttachment", blob.Rc(), room, {}, sqlite3_errmsg(db_));
+            }
+        }
+
+        if (!success || !tx.Commit()) {
+            return std::nullopt;
+        }
+        return attachment_id;
+    }
+
+    bool DB::StreamAttachment(int64_t attachment_id, const std::function<bool(const char* data, size_t size)>& sink) {
+        DB_IO_SCOPE();
+        Blob blob(db_, "attachments", "data", attachment_id, false);
+        if (!blob.IsOpen()) {
+            DB_LOG_ERROR("StreamAttachment", blob.Rc(), {}, {}, sqlite3_errmsg(db_));
+            return false;
+        }
+        int64_t size = blob.Size();
+        std::vector<char> chunk(static_cast<size_t>(std::min<int64_t>(size, kAttachmentChunkSize)));
+        for (int64_t offset = 0; offset < size;) {
+            int n = static_cast<int>(std::min<int64_t>(size - offset, kAttachmentChunkSize));
+            if (!blob.Read(chunk.data(), n, static_cast<int>(offset))) {
+                DB_LOG_ERROR("StreamAttachment", blob.Rc(), {}, {}, sqlite3_errmsg(db_));
+                return false;
+            }
+            if (!sink(chunk.data(), static_cast<size_t>(n))) {
+                return true;
+            }
+            offset += n;
+        }
+        return true;
+    }
+
+    int64_t DB::ReadAttachment(int64_t attachment_id, int64_t offset, char* buffer, size_t size) {
+        DB_IO_SCOPE();
+        Blob blob(db_, "attachments", "data", attachment_id, false);
+        if (!blob.IsOpen()) {
+            DB_LOG_ERROR("ReadAttachment", blob.Rc(), {}, {}, sqlite3_errmsg(db_));
+            return -1;
+        }
+        if (offset < 0 || offset > blob.Size()) {
+            DB_LOG_ERROR("ReadAttachment", SQLITE_RANGE, {}, {}, "offset out of range");
+            return -1;
+        }
+        int n = static_cast<int>(std::min<int64_t>(blob.Size() - offset, static_cast<int64_t>(std::min<size_t>(size, INT_MAX))));
+        if (n > 0 && !blob.Read(buffer, n, static_cast<int>(offset))) {
+            DB_LOG_ERROR("ReadAttachment", blob.Rc(), {}, {}, sqlite3_errmsg(db_));
+            return -1;
+        }
+        return n;
+    }
+
+    bool DB::WriteAttachment(int64_t attachment_id, int64_t offset, const char* data, size_t size) {
+        DB_IO_SCOPE();
+        Blob blob(db_, "attachments", "data", attachment_id, true);
+        if (!blob.IsOpen()) {
+            DB_LOG_ERROR("WriteAttachment", blob.Rc(), {}, {}, sqlite3_errmsg(db_));
+            return false;
+        }
+        if (!FitsBlobRange(offset, size) || offset + static_cast<int64_t>(size) > blob.Size()) {
+            DB_LOG_ERROR("WriteAttachment", SQLITE_RANGE, {}, {}, "write past the end of attachment");
+            return false;
+        }
+        if (!blob.Write(data, static_cast<int>(size), static_cast<int>(offset))) {
+            DB_LOG_ERROR("WriteAttachment", blob.Rc(), {}, {}, sqlite3_errmsg(db_));
+            return false;
+        }
+        return true;
+    }
+
+    std::vector<Attachment> DB::GetMessageAttachments(const std::string& room, int64_t id_message_in_room) {
+        DB_IO_SCOPE();
+        Query<Attachment(std::string_view, int64_t)> query(db_, sql::typed::GET_MESSAGE_ATTACHMENTS);
+        std::vector<Attachment> attachments = query.Bind(room, id_message_in_room).All();
+        if (query.Rc() != SQLITE_DONE) {
+            DB_LOG_ERROR("GetMessageAttachments", query.Rc(), room, {}, sqlite3_errmsg(db_));
+        }
+        return attachments;
+    }
+
+    bool DB::DeleteAttachment(int64_t attachment_id) {
+        DB_IO_SCOPE();
+        return Query<void(int64_t)>(db_, sql::typed::DELETE_ATTACHMENT).Bind(attachment_id).Exec();
+    }
+} // db
@@ -0,0 +1,103 @@
+#include <functional>
+#include <stdexcept>
+
+#include "batch.hpp"
+
+namespace db {
+    namespace {
+        constexpr size_t kTextBytesPerRowHint = 48;
+    } // namespace
+
+    size_t TextArena::RefHash::operator()(TextRef ref) const {
+        return std::hash<std::string_view>{}(std::string_view(data->data() + ref.offset, ref.length));
+    }
+
+    bool TextArena::RefEqual::operator()(TextRef a, TextRef b) const {
+        return std::string_view(data->data() + a.offset, a.length) == std::string_view(data->data() + b.offset, b.length);
+    }
+
+    TextArena::TextArena() : interned_(0, RefHash{ &data_ }, RefEqual{ &data_ }) {}
+
+    // Хешер и компаратор ссылаются на data_ своего объекта, поэтому таблица пересобирается.
+    TextArena::TextArena(TextArena&& other) noexcept
+        : data_(std::move(other.data_)), interned_(0, RefHash{ &data_ }, RefEqual{ &data_ }) {
+        interned_.insert(other.interned_.begin(), other.interned_.end());
+        other.interned_.clear();
+    }
+
+    TextArena& TextArena::operator=(TextArena&& other) noexcept {
+        if (this != &other) {
+            data_ = std::move(other.data_);
+            interned_ = std::unordered_set<TextRef, RefHash, RefEqual>(0, RefHash{ &data_ }, RefEqual{ &data_ });
+            interned_.insert(other.interned_.begin(), other.interned_.end());
+            other.interned_.clear();
+        }
+        return *this;
+    }
+
+    void TextArena::Reserve(size_t bytes) {
+        data_.reserve(bytes);
+    }
+
+    TextRef TextArena::Append(std::string_view text) {
+        if (data_.size() + text.size() > UINT32_MAX) {
+            throw std::length_error("TextArena exceeds 4 GiB");
+        }
+        TextRef ref{ static_cast<uint32_t>(data_.size()), static_cast<uint32_t>(text.size()) };
+        data_.append(text.data(), text.size());
+        return ref;
+    }
+
+    // Строка дописывается в конец; если такая уже есть, хвост отрезается и возвращается старая ссылка.
+    TextRef TextArena::Intern(std::string_view text) {
+        size_t mark = data_.size();
+        TextRef candidate = Append(text);
+        auto [it, inserted] = interned_.insert(candidate);
+        if (!inserted) {
+            data_.resize(mark);
+        }
+        return *it;
+    }
+
+    void TextArena::Seal() {
+        std::unordered_set<TextRef, RefHash, RefEqual>(0, RefHash{ &data_ }, RefEqual{ &data_ }).swap(interned_);
+    }
+
+    void UserBatch::Reserve(size_t rows) {
+        arena_.Reserve(rows * kTextBytesPerRowHint);
+        login_.reserve(rows);
+        name_.reserve(rows);
+        password_hash_.reserve(rows);
+        role_.reserve(rows);
+        is_deleted_.reserve(rows);
+        unixtime_.reserve(rows);
+    }
+
+    void UserBatch::Append(std::string_view login, std::string_view name, std::string_view password_hash,
+                           std::string_view role, bool is_deleted, int64_t unixtime) {
+        login_.push_back(arena_.Append(login));
+        name_.push_back(arena_.Append(name));
+        password_hash_.push_back(arena_.Append(password_hash));
+        role_.push_back(arena_.Intern(role));
+        is_deleted_.push_back(is_deleted ? 1 : 0);
+        unixtime_.push_back(unixtime);
+    }
+
+    void MessageBatch::Reserve(size_t rows) {
+        arena_.Reserve(rows * kTextBytesPerRowHint);
+        message_.reserve(rows);
+        unixtime_.reserve(rows);
+        user_login_.reserve(rows);
+        room_.reserve(rows);
+        id_message_in_room_.reserve(rows);
+    }
+
+    void MessageBatch::Append(std::string_view message, int64_t unixtime, std::string_view user_login,
+                              std::string_view room, int64_t id_message_in_room) {
+        message_.push_back(arena_.Append(message));
+        unixtime_.push_back(unixtime);
+        user_login_.push_back(arena_.Intern(user_login));
+        room_.push_back(arena_.Intern(room));
+        id_message_in_room_.push_back(id_message_in_room);
+    }
+} // db
@@ -0,0 +1,149 @@
+#include <algorithm>
+#include <cstring>
+#include <sqlite3.h>
+
+#include "db.hpp"
+#include "io_vfs.hpp"
+#include "logger.hpp"
+#include "sql_queries.hpp"
+#include "stmt.hpp"
+
+namespace db {
+    namespace {
+        constexpr int64_t kDispatchBatch = 1024;
+    } // namespace
+
+    // Хуки только выставляют флаги: обращаться к подключению из них нельзя.
+    void DB::FeedUpdateHook(void* self, int op, const char* /*db_name*/, const char* table, sqlite3_int64 /*rowid*/) {
+        if (op == SQLITE_INSERT && std::strcmp(table, "change_log") == 0) {
+            static_cast<DB*>(self)->feed_pending_ = true;
+        }
+    }
+
+    int DB::FeedCommitHook(void* self) {
+        DB* db = static_cast<DB*>(self);
+        db->MarkWrite();  // для фоновой очистки: простой отсчитывается от последней фиксации
+        db->feed_committed_ = db->feed_committed_ || db->feed_pending_;
+        db->feed_pending_ = false;
+        return 0;
+    }
+
+    void DB::FeedRollbackHook(void* self) {
+        static_cast<DB*>(self)->feed_pending_ = false;
+    }
+
+    bool DB::EnableChangeFeed() {
+        DB_IO_SCOPE();
+        char* errmsg = nullptr;
+        int rc = sqlite3_exec(db_, sql::CHANGE_FEED_SQL, nullptr, nullptr, &errmsg);
+        if (rc != SQLITE_OK) {
+            DB_LOG_ERROR("EnableChangeFeed", rc, {}, {}, errmsg);
+            sqlite3_free(errmsg);
+            return false;
+        }
+        return true;
+    }
+
+    void DB::Subscribe(std::shared_ptr<ChangeSubscriber> subscriber, std::optional<int64_t> after_position) {
+        DB_IO_SCOPE();
+        int64_t position = after_position ? *after_position : GetChangeLogPosition();
+        subscribers_.push_back({ std::move(subscriber), position });
+        ++subscribers_version_;
+        PollChangeFeed();
+    }
+
+    void DB::Unsubscribe(const std::shared_ptr<ChangeSubscriber>& subscriber) {
+        subscribers_.erase(std::remove_if(subscribers_.begin(), subscribers_.end(),
+                                          [&](const Subscription& s) { return s.subscriber == subscriber; }),
+                           subscribers_.end());
+        ++subscribers_version_;
+    }
+
+    void DB::PollChangeFeed() {
+        DB_IO_SCOPE();
+        feed_committed_ = true;
+        DispatchChanges();
+    }
+
+    // Вызывается после записей. Внутри открытой транзакции ничего не делает: доставка после ее фиксации.
+    void DB::DispatchChanges() {
+        if (!feed_committed_ || dispatching_ || sqlite3_get_autocommit(db_) == 0) {
+            return;
+        }
+        feed_committed_ = false;
+        if (subscribers_.empty()) {
+            return;
+        }
+        dispatching_ = true;
+        for (;;) {
+            int64_t from = subscribers_.front().position;
+            for (const auto& s : subscribers_) {
+                from = std::min(from, s.position);
+            }
+            // записи читаются целиком до вызова подписчиков: те могут обращаться к DB
+            std::vector<ChangeRecord> records = GetChanges(from, kDispatchBatch);
+            if (records.empty()) {
+                break;
+            }
+            // копия списка на пачку: подписчик может подписать или отписать кого-то из OnChange
+            std::vector<Subscription> offered = subscribers_;
+            const uint64_t version = subscribers_version_;
+            auto subscribed = [this](const Subscription& s) {
+                return std::any_of(subscribers_.begin(), subscribers_.end(),
+                                   [&s](const Subscription& current) { return current.subscriber == s.subscriber; });
+            };
+            for (const auto& record : records) {
+                for (auto& s : offered) {
+                    if (s.position >= record.position) {
+                        continue;
+                    }
+                    s.position = record.position;
+                    if (version == subscribers_version_ || subscribed(s)) {
+                        s.subscriber->OnChange(record);
+                    }
+                }
+            }
+            // позиция растет только у тех, кому пачка предлагалась: подписанный из OnChange получит ее
+            // со своей позиции на следующем круге
+            for (auto& current : subscribers_) {
+                for (const auto& s : offered) {
+                    if (s.subscriber == current.subscriber) {
+                        current.position = std::max(current.position, s.position);
+                        break;
+                    }
+                }
+            }
+            if (static_cast<int64_t>(records.size()) < kDispatchBatch && !feed_committed_) {
+                break;
+            }
+            feed_committed_ = false;
+        }
+        dispatching_ = false;
+    }
+
+    std::vector<ChangeRecord> DB::GetChanges(int64_t after_position, int64_t limit) {
+        DB_IO_SCOPE();
+        Query<ChangeRecord(int64_t, int64_t)> query(db_, sql::typed::GET_CHANGES);
+        std::vector<ChangeRecord> records = query.Bind(after_position, limit).All();
+        if (query.Rc() != SQLITE_DONE) {
+            DB_LOG_ERROR("GetChanges", query.Rc(), {}, {}, sqlite3_errmsg(db_));
+        }
+        return records;
+    }
+
+    int64_t DB::GetChangeLogPosition() {
+        DB_IO_SCOPE();
+        Query<int64_t()> query(db_, sql::typed::GET_CHANGE_LOG_POSITION);
+        auto position = query.One();
+        if (!position) {
+            DB_LOG_ERROR("GetChangeLogPosition", query.Rc(), {}, {}, sqlite3_errmsg(db_));
+            return 0;
+        }
+        return *position;
+    }
+
+    bool DB::TrimChangeLog(int64_t up_to_position) {
+        DB_IO_SCOPE();
+        return Query<void(int64_t)>(db_, sql::typed::TRIM_CHANGE_LOG).Bind(up_to_position).Exec();
+    }
+} // db
@@ -1,29 +1,175 @@
-#include <iostream>
+#include <algorithm>
+#include <cstring>
 #include <sqlite3.h>
+#include <thread>
 
 #include "db.hpp"
+#include "ephemeral.hpp"
+#include "io_vfs.hpp"
+#include "logger.hpp"
+#include "maintenance.hpp"
 #include "sql_queries.hpp"
 #include "stmt.hpp"
 #include "time_utils.hpp"
+#include "warmup.hpp"
 
 namespace db {
+    namespace {
+        // Заранее резервируется не больше строк, чем обычная страница истории: широкий диапазон или пустая комната
+        // не должны выделять память под строки, которых нет. Дальше пакет растет сам.
+        constexpr uint64_t kBatchReserveRows = 256;
+
+        std::vector<User> FetchUsers(sqlite3* db, const sql::QueryDef<User()>& def, const char* method) {
+            Query<User()> query(db, def);
+            std::vector<User> users = query.All();
+            if (query.Rc() != SQLITE_DONE) {
+                DB_LOG_ERROR(method, query.Rc(), {}, {}, sqlite3_errmsg(db));
+            }
+            return users;
+        }
+
+        // Параметр пакетных запросов: JSON-массив строк для json_each.
+        std::string ToJsonArray(const std::vector<std::string>& values) {
+            static constexpr char kHex[] = "0123456789abcdef";
+            std::string json;
+            size_t bytes = 2;
+            for (const auto& value : values) {
+                bytes += value.size() + 3;
+            }
+            json.reserve(bytes);
+            json += '[';
+            for (size_t i = 0; i < values.size(); ++i) {
+                json += i == 0 ? "\"" : ",\"";
+                for (unsigned char c : values[i]) {
+                    if (c == '"' || c == '\\') {
+                        json += '\\';
+                        json += static_cast<char>(c);
+                    } else if (c < 0x20) {
+                        json += "\\u00";
+                        json += kHex[c >> 4];
+                        json += kHex[c & 0xf];
+                    } else {
+                        json += static_cast<char>(c);
+                    }
+                }
+                json += '"';
+            }
+            json += ']';
+            return json;
+        }
+
+        UserBatch FetchUserBatch(sqlite3* db, const sql::QueryDef<User()>& def, const char* method) {
+            UserBatch batch;
+            Query<User()> query(db, def);
+            query.ForEachRow([&batch](Stmt& row) {
+                batch.Append(row.GetColumnView(0), row.GetColumnView(1), row.GetColumnView(2), row.GetColumnView(3),
+                             sqlite3_column_int(row.Get(), 4) != 0, sqlite3_column_int64(row.Get(), 5));
+            });
+            if (query.Rc() != SQLITE_DONE) {
+                DB_LOG_ERROR(method, query.Rc(), {}, {}, sqlite3_errmsg(db));
+            }
+            batch.Seal();
+            return batch;
+        }
+    } // namespace
+
     DB::DB() {}
     DB::DB(const std::string& db_file) : db_filename_(db_file), db_(nullptr) {}
+    DB::DB(const std::string& db_file, const DBOptions& options) : db_filename_(db_file), options_(options) {
+        if (options_.io_accounting) {
+            io_ = std::make_unique<io::Account>();
+        }
+    }
 
     DB::~DB() {
         CloseDB();
     }
 
-    std::string DB::GetVersionDB() {
-        std::string result;
-        Stmt stmt(db_, "SELECT key, value FROM metadata LIMIT 1;"); // принимаем, что имеется только одна строка в таблице
-        if (sqlite3_step(stmt.Get()) != SQLITE_ROW) {
-            std::cerr << "[IsUser] SQL error: " << sqlite3_errmsg(db_) << "\n";
-            return result;
+    // Код ошибки подключения после fn: SQLITE_BUSY оставляют и шаг запроса, и его финализация.
+    template <typename Fn>
+    auto DB::Retry(Fn&& fn) -> decltype(fn()) {
+        for (int attempt = 0;; ++attempt) {
+            auto result = fn();
+            if (attempt >= options_.busy_retries || (sqlite3_errcode(db_) & 0xff) != SQLITE_BUSY || InTransaction()) {
+                return result;
+            }
+            ++busy_retries_;
+            Backoff(attempt, options_.backoff_max);
+        }
+    }
+
+    void DB::Backoff(int attempt, std::chrono::nanoseconds limit) {
+        auto delay = std::chrono::nanoseconds(options_.backoff_min) * (int64_t{ 1 } << std::min(attempt, 20));
+        delay = std::min<std::chrono::nanoseconds>({ delay, options_.backoff_max, limit });
+        // случайный разброс в [delay / 2, delay]: ожидающие процессы не просыпаются одновременно
+        std::uniform_int_distribution<int64_t> jitter(delay.count() / 2, delay.count());
+        auto pause = std::chrono::nanoseconds(jitter(backoff_rng_));
+        auto started = std::chrono::steady_clock::now();
+        std::this_thread::sleep_for(pause);
+        busy_wait_ns_ += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started).count();
+    }
+
+    // count - число предыдущих вызовов для той же блокировки; 0 из обработчика - вернуть SQLITE_BUSY.
+    int DB::BusyHandler(void* self, int count) {
+        DB* db = static_cast<DB*>(self);
+        auto now = std::chrono::steady_clock::now();
+        if (count == 0) {
+            db->busy_since_ = now;
+            ++db->busy_events_;
+        }
+        // ожидающая запись - тоже активность: фоновое обслуживание не начинает новый срез, пока она ждет
+        db->MarkWrite();
+        auto remaining = db->BusyTimeout() - (now - db->busy_since_);
+        if (remaining <= std::chrono::nanoseconds::zero()) {
+            ++db->busy_timeouts_;
+            return 0;
+        }
+        db->Backoff(count, remaining);
+        return 1;
+    }
+
+    std::chrono::milliseconds DB::BusyTimeout() const {
+        return options_.busy_timeout.count() == 0 && background_waits_ > 0 ? kBackgroundBusyTimeout : options_.busy_timeout;
+    }
+
+    // Без DBOptions::busy_timeout обработчик ставится только на время работы фоновых задач и снимается после них.
+    void DB::HoldBackgroundWait() {
+        if (background_waits_++ == 0 && options_.busy_timeout.count() == 0) {
+            sqlite3_busy_handler(db_, &DB::BusyHandler, this);
+        }
+    }
+
+    void DB::ReleaseBackgroundWait() {
+        if (background_waits_ > 0 && --background_waits_ == 0 && options_.busy_timeout.count() == 0 && db_) {
+            sqlite3_busy_handler(db_, nullptr, nullptr);
         }
-        std::string key = stmt.GetColumnText(0);
-        std::string value = stmt.GetColumnText(1);
-        return value;
+    }
+
+    ContentionStats DB::GetContentionStats() const {
+        return { busy_events_.load(), busy_timeouts_.load(), busy_retries_.load(), busy_wait_ns_.load() };
+    }
+
+    IoStats DB::GetIoStats() const {
+        return io_ ? io_->Snapshot() : IoStats{};
+    }
+
+    void DB::ResetIoStats() {
+        if (io_) {
+            io_->Reset();
+        }
+    }
+
+    std::string DB::GetVersionDB() {
+        DB_IO_SCOPE();
+        return Retry([&]() -> std::string {
+            Query<std::string()> query(db_, sql::typed::GET_VERSION_DB);
+            auto version = query.One();
+            if (!version) {
+                DB_LOG_ERROR("GetVersionDB", query.Rc(), {}, {}, sqlite3_errmsg(db_));
+                return {};
+            }
+            return std::move(*version);
+        });
     }
 
     bool CheckVersionDB() {
@@ -38,299 +184,530 @@ namespace db {
             return true;
         }
 
-        if (sqlite3_open(db_filename_.c_str(), &db_) != SQLITE_OK) {
+        DB_IO_SCOPE();
+        {
+            std::lock_guard lock(readers_mutex_);
+            readers_open_ = true;
+        }
+        const char* vfs = nullptr;
+        if (io_ && (vfs = io::RegisterVfs()) == nullptr) {
+            DB_LOG_ERROR("OpenDB", SQLITE_ERROR, {}, {}, "cannot register I/O accounting VFS");
             return false;
         }
+        int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | (options_.ephemeral_rooms ? SQLITE_OPEN_URI : 0);
+        if (sqlite3_open_v2(db_filename_.c_str(), &db_, flags, vfs) != SQLITE_OK) {
+            return false;
+        }
+        // до первых PRAGMA: переключение в WAL и создание схемы тоже ждут чужие блокировки
+        if (options_.busy_timeout.count() > 0) {
+            sqlite3_busy_handler(db_, &DB::BusyHandler, this);
+        }
+        // действует только для нового файла и должен идти до journal_mode: тот уже записывает заголовок БД
+        sqlite3_exec(db_, "PRAGMA auto_vacuum = INCREMENTAL;", nullptr, nullptr, nullptr);
         sqlite3_exec(db_, "PRAGMA journal_mode=WAL;", nullptr, nullptr, nullptr);
         sqlite3_exec(db_, "PRAGMA synchronous=NORMAL;", nullptr, nullptr, nullptr);
         sqlite3_exec(db_, "PRAGMA foreign_keys = ON;", nullptr, nullptr, nullptr);
+        if (options_.cache_size_kib > 0) {
+            std::string pragma = "PRAGMA cache_size = -" + std::to_string(options_.cache_size_kib) + ";";
+            sqlite3_exec(db_, pragma.c_str(), nullptr, nullptr, nullptr);
+        }
+        if (options_.mmap_size > 0) {
+            std::string pragma = "PRAGMA mmap_size = " + std::to_string(options_.mmap_size) + ";";
+            sqlite3_exec(db_, pragma.c_str(), nullptr, nullptr, nullptr);
+        }
+        sqlite3_update_hook(db_, &DB::FeedUpdateHook, this);
+        sqlite3_commit_hook(db_, &DB::FeedCommitHook, this);
+        sqlite3_rollback_hook(db_, &DB::FeedRollbackHook, this);
+        MarkWrite();
 
         if (!CheckVersionDB()) {
-            std::cerr << "Incompatible DB schema version.\n";
+            DB_LOG_ERROR("OpenDB", SQLITE_OK, {}, {}, "Incompatible DB schema version");
             return false;
         }
 
-        return InitSchema();
+        if (!InitSchema()) {
+            return false;
+        }
+        return !options_.ephemeral_rooms || AttachEphemeral();
     }
 
     void DB::CloseDB() {
+        {
+            std::lock_guard lock(readers_mutex_);
+            readers_.clear();
+            readers_open_ = false;
+        }
+        warmup_.reset();
+        StopMaintenance();
+        if (ephemeral_) {
+            StopEphemeralSnapshots();
+            FlushEphemeral();
+            ephemeral_.reset();
+        }
         if (db_) {
+            // последнее подключение к файлу переносит WAL в основной файл при закрытии
+            DB_IO_SCOPE();
             sqlite3_close(reinterpret_cast<sqlite3*>(db_));
             db_ = nullptr;
         }
     }
 
     bool DB::CreateRoom(const std::string& room, int64_t unixtime) {
-        Stmt stmt(db_, "INSERT OR IGNORE INTO rooms (room, unixtime) VALUES (?, ?);");
-        stmt.Bind(1, room);
-        stmt.Bind(2, unixtime);
-        bool success = sqlite3_step(stmt.Get()) == SQLITE_DONE;
-        return success;
+        DB_IO_SCOPE();
+        return Retry([&]() -> bool {
+            bool success = Query<void(std::string_view, int64_t)>(db_, sql::typed::CREATE_ROOM).Bind(room, unixtime).Exec();
+            DispatchChanges();
+            return success;
+        });
     }
 
     bool DB::DeleteRoom(const std::string& room) {
-        Stmt stmt(db_, "DELETE FROM rooms WHERE room = ?;");
-        stmt.Bind(1, room);
-        bool success = sqlite3_step(stmt.Get()) == SQLITE_DONE;
-
-        DelDeletedUsersWithoutRoom();
-
-        return success;
+        DB_IO_SCOPE();
+        return Retry([&]() -> bool {
+            Transaction tx(*this);
+            if (!tx) {
+                return false;
+            }
+            // сообщения в памяти не связаны с rooms внешним ключом: удаляются явно, пока имя комнаты еще есть
+            auto tier = LockEphemeral(room);
+            bool success = (!tier || (Query<void(std::string_view)>(db_, sql::typed::EPHEMERAL_DELETE_ROOM_MESSAGES).Bind(room).Exec()
+                                      && Query<void(std::string_view)>(db_, sql::typed::EPHEMERAL_DELETE_ROOM).Bind(room).Exec()))
+                           && Query<void(std::string_view)>(db_, sql::typed::DELETE_ROOM).Bind(room).Exec()
+                           && DelDeletedUsersWithoutRoom();
+
+            if (!success || !tx.Commit()) {
+                return false;
+            }
+            if (tier) {
+                ephemeral_->rooms.erase(room);
+            }
+            return true;
+        });
     }
 
     bool DB::IsRoom(const std::string& room) {
-        Stmt stmt(db_, "SELECT EXISTS (SELECT 1 FROM rooms WHERE room = ?);");
-        stmt.Bind(1, room);
-        if (sqlite3_step(stmt.Get()) != SQLITE_ROW) {
-            std::cerr << "[IsRoom] SQL error: " << sqlite3_errmsg(db_) << "\n";
-            return false;
-        }
-        return sqlite3_column_int(stmt.Get(), 0) != 0;
+        DB_IO_SCOPE();
+        return Retry([&]() -> bool {
+            Query<bool(std::string_view)> query(db_, sql::typed::IS_ROOM);
+            auto exists = query.Bind(room).One();
+            if (!exists) {
+                DB_LOG_ERROR("IsRoom", query.Rc(), room, {}, sqlite3_errmsg(db_));
+                return false;
+            }
+            return *exists;
+        });
     }
 
     std::vector<std::string> DB::GetRooms() {
-        Stmt stmt(db_, "SELECT room FROM rooms;");
-        std::vector < std::string> result;
-        int rc;
-        while ((rc = sqlite3_step(stmt.Get())) == SQLITE_ROW) {
-            result.emplace_back(reinterpret_cast<const char*>(sqlite3_column_text(stmt.Get(), 0)));
-        }
-        if (rc != SQLITE_DONE) {
-            std::cerr << "SQL error during fetch: " << sqlite3_errmsg(db_) << "\n";
-        }
-        return result;
+        DB_IO_SCOPE();
+        return Retry([&]() -> std::vector<std::string> {
+            Query<std::string()> query(db_, sql::typed::GET_ROOMS);
+            std::vector<std::string> result = query.All();
+            if (query.Rc() != SQLITE_DONE) {
+                DB_LOG_ERROR("GetRooms", query.Rc(), {}, {}, sqlite3_errmsg(db_));
+            }
+            return result;
+        });
     }
 
     bool DB::CreateUser(const User& user) {
-        Stmt stmt(db_, sql::CREATE_USER);
-        stmt.Bind(1, user.login);
-        stmt.Bind(2, user.name);
-        stmt.Bind(3, user.password_hash);
-        stmt.Bind(4, user.role);
-        stmt.Bind(5, user.is_deleted);
-        stmt.Bind(6, user.unixtime);
-        bool success = sqlite3_step(stmt.Get()) == SQLITE_DONE;
-        return success;
+        DB_IO_SCOPE();
+        return Retry([&]() -> bool {
+            Query<void(std::string_view, std::string_view, std::string_view, std::string_view, bool, int64_t)>
+                query(db_, sql::typed::CREATE_USER);
+            bool success = query.Bind(user.login, user.name, user.password_hash, user.role, user.is_deleted, user.unixtime).Exec();
+            DispatchChanges();
+            return success;
+        });
     }
 
     bool DB::SetUserForDelete(const std::string& user_login) {
-        Stmt stmt(db_, "UPDATE users SET is_deleted = 1 WHERE login = ?;");
-        stmt.Bind(1, user_login);
-        bool success = sqlite3_step(stmt.Get()) == SQLITE_DONE;
-        return success;
+        return Query<void(std::string_view)>(db_, sql::typed::SET_USER_FOR_DELETE).Bind(user_login).Exec();
     }
 
     bool DB::DeleteUser(const std::string& user_login) {
+        DB_IO_SCOPE();
+        return Retry([&]() -> bool {
+            Transaction tx(*this);
+            if (!tx) {
+                return false;
+            }
+            bool success = SetUserForDelete(user_login)
+                           && Query<void(std::string_view)>(db_, sql::typed::DELETE_USER).Bind(user_login).Exec();
 
-       bool success1 = SetUserForDelete(user_login);
-
-       Stmt stmt(db_, sql::DELETE_USER);
-       stmt.Bind(1, user_login);
-       bool success2 = sqlite3_step(stmt.Get()) == SQLITE_DONE;
-
-       return success1 && success2;
+            return success && tx.Commit();
+        });
     }
 
     bool DB::IsUser(const std::string& user_login) {
-        Stmt stmt(db_, "SELECT EXISTS (SELECT 1 FROM users WHERE login = ?);");
-        stmt.Bind(1, user_login);
-        if (sqlite3_step(stmt.Get()) != SQLITE_ROW) {
-            std::cerr << "[IsUser] SQL error: " << sqlite3_errmsg(db_) << "\n";
-            return false;
-        }
-        return sqlite3_column_int(stmt.Get(), 0) != 0;
+        DB_IO_SCOPE();
+        return Retry([&]() -> bool {
+            Query<bool(std::string_view)> query(db_, sql::typed::IS_USER);
+            auto exists = query.Bind(user_login).One();
+            if (!exists) {
+                DB_LOG_ERROR("IsUser", query.Rc(), {}, user_login, sqlite3_errmsg(db_));
+                return false;
+            }
+            return *exists;
+        });
     }
 
     bool DB::IsAliveUser(const std::string& user_login) {
-        Stmt stmt(db_, "SELECT EXISTS (SELECT 1 FROM users WHERE login = ? AND is_deleted = false);");
-        stmt.Bind(1, user_login);
-        if (sqlite3_step(stmt.Get()) != SQLITE_ROW) {
-            std::cerr << "[IsAliveUser] SQL error: " << sqlite3_errmsg(db_) << "\n";
-            return false;
-        }
-        return sqlite3_column_int(stmt.Get(), 0) != 0;
+        DB_IO_SCOPE();
+        return Retry([&]() -> bool {
+            Query<bool(std::string_view)> query(db_, sql::typed::IS_ALIVE_USER);
+            auto alive = query.Bind(user_login).One();
+            if (!alive) {
+                DB_LOG_ERROR("IsAliveUser", query.Rc(), {}, user_login, sqlite3_errmsg(db_));
+                return false;
+            }
+            return *alive;
+        });
     }
 
     bool DB::ChangeUserName(const std::string& user_login, const std::string& new_name) {
-        Stmt stmt(db_, sql::CHANGE_USER_NAME);
-        stmt.Bind(1, new_name);
-        stmt.Bind(2, user_login);
-        bool success = sqlite3_step(stmt.Get()) == SQLITE_DONE;
-        return success;
+        DB_IO_SCOPE();
+        return Retry([&]() -> bool {
+            bool success = Query<void(std::string_view, std::string_view)>(db_, sql::typed::CHANGE_USER_NAME)
+                .Bind(new_name, user_login).Exec();
+            DispatchChanges();
+            return success;
+        });
     }
 
     bool DB::ChangeRoomName(const std::string& current_room_name, const std::string& new_room_name) {
-        Stmt stmt(db_, sql::CHANGE_ROOM_NAME);
-        stmt.Bind(1, new_room_name);
-        stmt.Bind(2, current_room_name);
-        bool success = sqlite3_step(stmt.Get()) == SQLITE_DONE;
-        return success;
+        DB_IO_SCOPE();
+        return Retry([&]() -> bool {
+            bool success = Query<void(std::string_view, std::string_view)>(db_, sql::typed::CHANGE_ROOM_NAME)
+                .Bind(new_room_name, current_room_name).Exec();
+            if (success && sqlite3_changes(db_) > 0 && IsRoomEphemeral(current_room_name)) {
+                ephemeral_->rooms.erase(current_room_name);
+                ephemeral_->rooms.insert(new_room_name);
+            }
+            DispatchChanges();
+            return success;
+        });
     }
-        
+
     std::optional<User> DB::GetUserData(const std::string& user_login) {
-        Stmt stmt(db_, sql::GET_USER_DATA);
-        stmt.Bind(1, user_login);
-        int rc = sqlite3_step(stmt.Get());
-
-        if (rc == SQLITE_ROW) {
-            std::string login = stmt.GetColumnText(0);
-            std::string name = stmt.GetColumnText(1);
-            std::string password_hash = stmt.GetColumnText(2);
-            std::string role = stmt.GetColumnText(3);
-            bool is_deleted = sqlite3_column_int(stmt.Get(), 4) != 0;
-            int64_t unixtime = sqlite3_column_int64(stmt.Get(), 5);
-            return User{ login, name, password_hash, role, is_deleted, unixtime };
-        }
-        std::cerr << "[GetUserData] SQL error or unexpected result (" << rc << "): "
-            << sqlite3_errmsg(db_) << "\n";
-        return std::nullopt;
-    }
-
-    std::vector<User> DB::GetUsers(const char* sql) {
-        std::vector<User> users;
-        Stmt stmt(db_, sql);
-        int rc;
-        while ((rc = sqlite3_step(stmt.Get())) == SQLITE_ROW) {
-            std::string login = stmt.GetColumnText(0);
-            std::string name = stmt.GetColumnText(1);
-            std::string password_hash = stmt.GetColumnText(2);
-            std::string role = stmt.GetColumnText(3);
-            bool is_deleted = sqlite3_column_int(stmt.Get(), 4) != 0;
-            int64_t unixtime = sqlite3_column_int64(stmt.Get(), 5);
-            users.emplace_back(login, name, password_hash, role, is_deleted, unixtime);
-        }
-        if (rc != SQLITE_DONE) {
-            std::cerr << "SQL error during fetch: " << sqlite3_errmsg(db_) << "\n";
-        }
-        return users;
+        DB_IO_SCOPE();
+        return Retry([&]() -> std::optional<User> {
+            Query<User(std::string_view)> query(db_, sql::typed::GET_USER_DATA);
+            auto user = query.Bind(user_login).One();
+            if (!user) {
+                DB_LOG_ERROR("GetUserData", query.Rc(), {}, user_login, sqlite3_errmsg(db_));
+            }
+            return user;
+        });
+    }
+
+    std::vector<std::optional<User>> DB::GetUsersData(const std::vector<std::string>& logins) {
+        DB_IO_SCOPE();
+        return Retry([&]() -> std::vector<std::optional<User>> {
+            std::vector<std::optional<User>> users(logins.size());
+            std::string json = ToJsonArray(logins);
+            Query<std::pair<int64_t, User>(std::string_view)> query(db_, sql::typed::GET_USERS_DATA);
+            query.Bind(json).ForEach([&users](std::pair<int64_t, User>&& row) {
+                users[static_cast<size_t>(row.first)] = std::move(row.second);
+            });
+            if (query.Rc() != SQLITE_DONE) {
+                DB_LOG_ERROR("GetUsersData", query.Rc(), {}, {}, sqlite3_errmsg(db_));
+            }
+            return users;
+        });
+    }
+
+    std::vector<bool> DB::AreAliveUsers(const std::vector<std::string>& logins) {
+        DB_IO_SCOPE();
+        return Retry([&]() -> std::vector<bool> {
+            std::vector<bool> alive(logins.size(), false);
+            std::string json = ToJsonArray(logins);
+            Query<int64_t(std::string_view)> query(db_, sql::typed::ARE_ALIVE_USERS);
+            query.Bind(json).ForEach([&alive](int64_t index) {
+                alive[static_cast<size_t>(index)] = true;
+            });
+            if (query.Rc() != SQLITE_DONE) {
+                DB_LOG_ERROR("AreAliveUsers", query.Rc(), {}, {}, sqlite3_errmsg(db_));
+            }
+            return alive;
+        });
     }
 
     std::vector<User> DB::GetAllUsers() {
-        return GetUsers(sql::GET_ALL_USERS);
+        DB_IO_SCOPE();
+        return Retry([&]() -> std::vector<User> {
+            return FetchUsers(db_, sql::typed::GET_ALL_USERS, "GetAllUsers");
+        });
     }
 
     std::vector<User> DB::GetActiveUsers() {
-        return GetUsers(sql::GET_ACTIVE_USERS);
+        DB_IO_SCOPE();
+        return Retry([&]() -> std::vector<User> {
+            return FetchUsers(db_, sql::typed::GET_ACTIVE_USERS, "GetActiveUsers");
+        });
     }
 
     std::vector<User> DB::GetDeletedUsers() {
-        return GetUsers(sql::GET_DELETED_USERS);
+        DB_IO_SCOPE();
+        return Retry([&]() -> std::vector<User> {
+            return FetchUsers(db_, sql::typed::GET_DELETED_USERS, "GetDeletedUsers");
+        });
+    }
+
+    UserBatch DB::GetAllUsersBatch() {
+        DB_IO_SCOPE();
+        return Retry([&]() -> UserBatch {
+            return FetchUserBatch(db_, sql::typed::GET_ALL_USERS, "GetAllUsersBatch");
+        });
+    }
+
+    UserBatch DB::GetActiveUsersBatch() {
+        DB_IO_SCOPE();
+        return Retry([&]() -> UserBatch {
+            return FetchUserBatch(db_, sql::typed::GET_ACTIVE_USERS, "GetActiveUsersBatch");
+        });
     }
 
     std::vector<std::string> DB::GetUserRooms(const std::string& user_login) {
-        std::vector<std::string> result;
-        Stmt stmt(db_, sql::GET_USER_ROOMS);
-        stmt.Bind(1, user_login);
-        int rc;
-        while ((rc = sqlite3_step(stmt.Get())) == SQLITE_ROW) {
-            result.emplace_back(stmt.GetColumnText(0));
-        }
-        if (rc != SQLITE_DONE) {
-            std::cerr << "SQL error during fetch: " << sqlite3_errmsg(db_) << "\n";
-        }
-        return result;
+        DB_IO_SCOPE();
+        return Retry([&]() -> std::vector<std::string> {
+            Query<std::string(std::string_view)> query(db_, sql::typed::GET_USER_ROOMS);
+            std::vector<std::string> result = query.Bind(user_login).All();
+            if (query.Rc() != SQLITE_DONE) {
+                DB_LOG_ERROR("GetUserRooms", query.Rc(), {}, user_login, sqlite3_errmsg(db_));
+            }
+            return result;
+        });
     }
 
     std::unordered_map<std::string, std::unordered_set<std::string>> DB::GetAllRoomWithRegisteredUsers() {
-        std::unordered_map<std::string, std::unordered_set<std::string>> list_room_and_user;
+        DB_IO_SCOPE();
+        return Retry([&]() -> std::unordered_map<std::string, std::unordered_set<std::string>> {
+            std::unordered_map<std::string, std::unordered_set<std::string>> list_room_and_user;
 
-        Stmt stmt(db_, sql::GET_ALL_PAIR_ROOMS_AND_USERS);
-        int rc;
-        while ((rc = sqlite3_step(stmt.Get())) == SQLITE_ROW) {
-            list_room_and_user[stmt.GetColumnText(0)].insert(stmt.GetColumnText(1));
-        }
-        if (rc != SQLITE_DONE) {
-            std::cerr << "SQL error during fetch: " << sqlite3_errmsg(db_) << "\n";
-        }
-        return list_room_and_user;
+            Query<std::pair<std::string, std::string>()> query(db_, sql::typed::GET_ALL_PAIR_ROOMS_AND_USERS);
+            query.ForEach([&list_room_and_user](std::pair<std::string, std::string>&& room_and_user) {
+                list_room_and_user[std::move(room_and_user.first)].insert(std::move(room_and_user.second));
+            });
+            if (query.Rc() != SQLITE_DONE) {
+                DB_LOG_ERROR("GetAllRoomWithRegisteredUsers", query.Rc(), {}, {}, sqlite3_errmsg(db_));
+            }
+            return list_room_and_user;
+        });
     }
 
     std::vector<User> DB::GetRoomActiveUsers(const std::string& room) {
-        std::vector<User> users;
-        Stmt stmt(db_, sql::GET_ROOM_ACTIVE_USERS);
-        stmt.Bind(1, room);
-        while (sqlite3_step(stmt.Get()) == SQLITE_ROW) {
-            std::string login = stmt.GetColumnText(0);
-            std::string name = stmt.GetColumnText(1);
-            std::string password_hash = stmt.GetColumnText(2);
-            std::string role = stmt.GetColumnText(3);
-            bool is_deleted = sqlite3_column_int(stmt.Get(), 4) != 0;
-            int64_t unixtime = sqlite3_column_int64(stmt.Get(), 5);
-            users.emplace_back(login, name, password_hash, role, is_deleted, unixtime);
-        }
-        return users;
+        DB_IO_SCOPE();
+        return Retry([&]() -> std::vector<User> {
+            Query<User(std::string_view)> query(db_, sql::typed::GET_ROOM_ACTIVE_USERS);
+            std::vector<User> users = query.Bind(room).All();
+            if (query.Rc() != SQLITE_DONE) {
+                DB_LOG_ERROR("GetRoomActiveUsers", query.Rc(), room, {}, sqlite3_errmsg(db_));
+            }
+            return users;
+        });
+    }
+
+    std::vector<std::vector<User>> DB::GetRoomsActiveUsers(const std::vector<std::string>& rooms) {
+        DB_IO_SCOPE();
+        return Retry([&]() -> std::vector<std::vector<User>> {
+            std::vector<std::vector<User>> users(rooms.size());
+            std::string json = ToJsonArray(rooms);
+            Query<std::pair<int64_t, User>(std::string_view)> query(db_, sql::typed::GET_ROOMS_ACTIVE_USERS);
+            query.Bind(json).ForEach([&users](std::pair<int64_t, User>&& row) {
+                users[static_cast<size_t>(row.first)].push_back(std::move(row.second));
+            });
+            if (query.Rc() != SQLITE_DONE) {
+                DB_LOG_ERROR("GetRoomsActiveUsers", query.Rc(), {}, {}, sqlite3_errmsg(db_));
+            }
+            return users;
+        });
     }
 
     std::vector<Message> DB::GetRangeMessagesRoom(const std::string& room, int64_t id_message_begin, int64_t id_message_end) {
-        std::vector<Message> messages;
-        Stmt stmt(db_, sql::GET_RANGE_MESSAGES_ROOM);
-        stmt.Bind(1, room);
-        stmt.Bind(2, id_message_begin);
-        stmt.Bind(3, id_message_end);
-        int rc;
-        while ((rc = sqlite3_step(stmt.Get())) == SQLITE_ROW) {
-            std::string message = stmt.GetColumnText(0);
-            std::string login = stmt.GetColumnText(1);
-            std::string room = stmt.GetColumnText(2);
-            int64_t unixtime = sqlite3_column_int64(stmt.Get(), 3);
-            int64_t  id_message_in_room = sqlite3_column_int64(stmt.Get(), 4);
-            messages.emplace_back(message, unixtime, login, room, id_message_in_room);
-        }
-        if (rc != SQLITE_DONE) {
-            std::cerr << "SQL error during fetch: " << sqlite3_errmsg(db_) << "\n";
-        }
-        return messages;
-    }
-    
-    bool DB::PerformSQLReturnBool(const char* sql_query, std::vector<std::string> param) {
-        Stmt stmt(db_, sql_query);
-        for (size_t i = 0; i < param.size(); ++i) {
-            stmt.Bind(static_cast<int>(i + 1), param[i]);
-        }
-        bool success = sqlite3_step(stmt.Get()) == SQLITE_DONE;
-        return success;
+        DB_IO_SCOPE();
+        return Retry([&]() -> std::vector<Message> {
+            auto tier = LockEphemeral(room);
+            Query<Message(std::string_view, int64_t, int64_t)> query(
+                db_, tier ? sql::typed::GET_RANGE_MESSAGES_ROOM_TIERED : sql::typed::GET_RANGE_MESSAGES_ROOM);
+            std::vector<Message> messages = query.Bind(room, id_message_begin, id_message_end).All();
+            if (query.Rc() != SQLITE_DONE) {
+                DB_LOG_ERROR("GetRangeMessagesRoom", query.Rc(), room, {}, sqlite3_errmsg(db_));
+            }
+            return messages;
+        });
+    }
+
+    MessageBatch DB::GetRangeMessagesRoomBatch(const std::string& room, int64_t id_message_begin, int64_t id_message_end) {
+        DB_IO_SCOPE();
+        return Retry([&]() -> MessageBatch {
+            MessageBatch batch;
+            if (id_message_begin >= id_message_end) {
+                // разность в беззнаковых: диапазон шире INT64_MAX не переполняется
+                uint64_t span = static_cast<uint64_t>(id_message_begin) - static_cast<uint64_t>(id_message_end);
+                batch.Reserve(static_cast<size_t>(std::min(span, kBatchReserveRows - 1) + 1));
+            }
+            auto tier = LockEphemeral(room);
+            Query<Message(std::string_view, int64_t, int64_t)> query(
+                db_, tier ? sql::typed::GET_RANGE_MESSAGES_ROOM_TIERED : sql::typed::GET_RANGE_MESSAGES_ROOM);
+            query.Bind(room, id_message_begin, id_message_end).ForEachRow([&batch](Stmt& row) {
+                batch.Append(row.GetColumnView(0), sqlite3_column_int64(row.Get(), 3), row.GetColumnView(1),
+                             row.GetColumnView(2), sqlite3_column_int64(row.Get(), 4));
+            });
+            if (query.Rc() != SQLITE_DONE) {
+                DB_LOG_ERROR("GetRangeMessagesRoomBatch", query.Rc(), room, {}, sqlite3_errmsg(db_));
+            }
+            batch.Seal();
+            return batch;
+        });
     }
 
     bool DB::AddUserToRoom(const std::string& user_login, const std::string& room) {
-        return PerformSQLReturnBool(sql::ADD_USER_TO_ROOM, { user_login , room });
+        DB_IO_SCOPE();
+        return Retry([&]() -> bool {
+            bool success = Query<void(std::string_view, std::string_view)>(db_, sql::typed::ADD_USER_TO_ROOM)
+                .Bind(user_login, room).Exec();
+            DispatchChanges();
+            return success;
+        });
     }
 
     bool DB::DeleteUserFromRoom(const std::string& user_login, const std::string& room) {
-        return PerformSQLReturnBool(sql::DELETE_USER_FROM_ROOM, { user_login , room });
+        DB_IO_SCOPE();
+        return Retry([&]() -> bool {
+            bool success = Query<void(std::string_view, std::string_view)>(db_, sql::typed::DELETE_USER_FROM_ROOM)
+                .Bind(user_login, room).Exec();
+            DispatchChanges();
+            return success;
+        });
     }
 
     bool DB::InsertMessageToDB(const Message& message) {
-        auto [date,time] = utime::UnixTimeNsToDateTime(message.unixtime);
-        Stmt stmt(db_, sql::INSERT_MESSAGE_TO_DB);
-        stmt.Bind(1, message.message);
-        stmt.Bind(2, message.unixtime);
-        stmt.Bind(3, message.user_login);
-        stmt.Bind(4, message.room);
-        stmt.Bind(5, date);
-        stmt.Bind(6, time);
-        stmt.Bind(7, message.id_message_in_room);
-        bool success = sqlite3_step(stmt.Get()) == SQLITE_DONE;
+        DB_IO_SCOPE();
+        char date[11], time[9];
+        if (!utime::ThreadDateTimeCache().Format(message.unixtime, date, time)) {
+            std::strcpy(date, "error");
+            std::strcpy(time, "error");
+        }
+        auto tier = LockEphemeral(message.room);
+        Query<void(std::string_view, int64_t, std::string_view, std::string_view,
+                   std::string_view, std::string_view, int64_t)> query(
+            db_, tier ? sql::typed::EPHEMERAL_INSERT_MESSAGE : sql::typed::INSERT_MESSAGE_TO_DB);
+        bool success = query.Bind(message.message, message.unixtime, message.user_login, message.room,
+                                  date, time, message.id_message_in_room).Exec();
+        DispatchChanges();
         return success;
     }
 
     int DB::GetCountRoomMessages(const std::string& room) {
-        Stmt stmt(db_, sql::GET_COUNT_ROOM_MESSAGES);
-        stmt.Bind(1, room);
-        int rc = sqlite3_step(stmt.Get());
-
-        if (rc == SQLITE_ROW) {
-            return sqlite3_column_int(stmt.Get(), 0);
-        }
-        std::cerr << "[GetCountRoomMessages] SQL error or unexpected result (" << rc << "): "
-            << sqlite3_errmsg(db_) << "\n";
-        return -1;
+        DB_IO_SCOPE();
+        return Retry([&]() -> int {
+            auto tier = LockEphemeral(room);
+            Query<int64_t(std::string_view)> query(
+                db_, tier ? sql::typed::GET_COUNT_ROOM_MESSAGES_TIERED : sql::typed::GET_COUNT_ROOM_MESSAGES);
+            auto count = query.Bind(room).One();
+            if (!count) {
+                DB_LOG_ERROR("GetCountRoomMessages", query.Rc(), room, {}, sqlite3_errmsg(db_));
+                return -1;
+            }
+            return static_cast<int>(*count);
+        });
+    }
+
+    std::optional<RoomStats> DB::GetRoomStats(const std::string& room) {
+        DB_IO_SCOPE();
+        return Retry([&]() -> std::optional<RoomStats> {
+            auto tier = LockEphemeral(room);
+            Query<RoomStats(std::string_view)> query(db_, tier ? sql::typed::GET_ROOM_STATS_TIERED : sql::typed::GET_ROOM_STATS);
+            auto stats = query.Bind(room).One();
+            if (!stats && query.Rc() != SQLITE_DONE) {
+                DB_LOG_ERROR("GetRoomStats", query.Rc(), room, {}, sqlite3_errmsg(db_));
+            }
+            return stats;
+        });
+    }
+
+    std::vector<RoomStats> DB::GetAllRoomStats() {
+        DB_IO_SCOPE();
+        return Retry([&]() -> std::vector<RoomStats> {
+            auto tier = LockEphemeral();
+            Query<RoomStats()> query(db_, sql::typed::GET_ALL_ROOM_STATS);
+            std::vector<RoomStats> stats = query.All();
+            if (query.Rc() != SQLITE_DONE) {
+                DB_LOG_ERROR("GetAllRoomStats", query.Rc(), {}, {}, sqlite3_errmsg(db_));
+            }
+            if (tier) {
+                MergeEphemeralStats(stats, -1);
+            }
+            return stats;
+        });
+    }
+
+    std::vector<RoomStats> DB::GetRoomStatsByActivity(int64_t limit) {
+        DB_IO_SCOPE();
+        return Retry([&]() -> std::vector<RoomStats> {
+            // эфемерные комнаты могут занимать места в первых limit: столько же строк запрашивается сверх limit
+            auto tier = LockEphemeral();
+            int64_t extra = tier ? static_cast<int64_t>(ephemeral_->rooms.size()) : 0;
+            Query<RoomStats(int64_t)> query(db_, sql::typed::GET_ROOM_STATS_BY_ACTIVITY);
+            std::vector<RoomStats> stats = query.Bind(limit + extra).All();
+            if (query.Rc() != SQLITE_DONE) {
+                DB_LOG_ERROR("GetRoomStatsByActivity", query.Rc(), {}, {}, sqlite3_errmsg(db_));
+            }
+            if (tier) {
+                MergeEphemeralStats(stats, limit);
+            }
+            return stats;
+        });
+    }
+
+    std::vector<Message> DB::GetMessagesByTime(const std::string& room, int64_t t_begin_ns, int64_t t_end_ns, int64_t limit) {
+        DB_IO_SCOPE();
+        return Retry([&]() -> std::vector<Message> {
+            auto tier = LockEphemeral(room);
+            Query<Message(std::string_view, int64_t, int64_t, int64_t)> query(
+                db_, tier ? sql::typed::GET_MESSAGES_BY_TIME_TIERED : sql::typed::GET_MESSAGES_BY_TIME);
+            std::vector<Message> messages = query.Bind(room, t_begin_ns, t_end_ns, limit).All();
+            if (query.Rc() != SQLITE_DONE) {
+                DB_LOG_ERROR("GetMessagesByTime", query.Rc(), room, {}, sqlite3_errmsg(db_));
+            }
+            return messages;
+        });
+    }
+
+    std::vector<Message> DB::GetUserMessagesByTime(const std::string& user_login, int64_t t_begin_ns, int64_t t_end_ns, int64_t limit) {
+        DB_IO_SCOPE();
+        return Retry([&]() -> std::vector<Message> {
+            auto tier = LockEphemeral();
+            Query<Message(std::string_view, int64_t, int64_t, int64_t)> query(
+                db_, tier ? sql::typed::GET_USER_MESSAGES_BY_TIME_TIERED : sql::typed::GET_USER_MESSAGES_BY_TIME);
+            std::vector<Message> messages = query.Bind(user_login, t_begin_ns, t_end_ns, limit).All();
+            if (query.Rc() != SQLITE_DONE) {
+                DB_LOG_ERROR("GetUserMessagesByTime", query.Rc(), {}, user_login, sqlite3_errmsg(db_));
+            }
+            return messages;
+        });
+    }
+
+    std::optional<int64_t> DB::GetFirstMessageIdAtOrAfter(const std::string& room, int64_t t_ns) {
+        DB_IO_SCOPE();
+        return Retry([&]() -> std::optional<int64_t> {
+            auto tier = LockEphemeral(room);
+            Query<int64_t(std::string_view, int64_t)> query(
+                db_, tier ? sql::typed::GET_FIRST_MESSAGE_ID_AT_OR_AFTER_TIERED : sql::typed::GET_FIRST_MESSAGE_ID_AT_OR_AFTER);
+            auto id = query.Bind(room, t_ns).One();
+            if (!id && query.Rc() != SQLITE_DONE) {
+                DB_LOG_ERROR("GetFirstMessageIdAtOrAfter", query.Rc(), room, {}, sqlite3_errmsg(db_));
+            }
+            return id;
+        });
     }
 
     bool DB::InitSchema() {
         char* errmsg = nullptr;
         int rc = sqlite3_exec(reinterpret_cast<sqlite3*>(db_), sql::INIT_SQL, nullptr, nullptr, &errmsg);
         if (rc != SQLITE_OK) {
-            std::cerr << "Failed to initialize DB schema: " << errmsg << "\n";
+            DB_LOG_ERROR("InitSchema", rc, {}, {}, errmsg);
             sqlite3_free(errmsg);
             return false;
         }
@@ -338,8 +715,6 @@ namespace db {
     }
 
     bool DB::DelDeletedUsersWithoutRoom() {
-        Stmt stmt(db_, sql::DELETE_DELETED_USER_WITHOUT_ROOM);
-        return sqlite3_step(stmt.Get()) == SQLITE_DONE;
+        return Query<void()>(db_, sql::typed::DELETE_DELETED_USER_WITHOUT_ROOM).Exec();
     }
 } // db
-
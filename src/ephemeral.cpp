@@ -0,0 +1,277 @@
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <sqlite3.h>
+#include <string>
+
+#include "db.hpp"
+#include "ephemeral.hpp"
+#include "io_vfs.hpp"
+#include "logger.hpp"
+#include "sql_queries.hpp"
+#include "stmt.hpp"
+#include "time_utils.hpp"
+
+namespace db {
+    namespace {
+        // FlushEphemeral: все сообщения одной транзакцией
+        constexpr int64_t kAllRows = std::numeric_limits<int32_t>::max();
+
+        std::atomic<uint64_t> next_tier_id{ 0 };
+
+        bool AttachMemory(sqlite3* conn, const std::string& uri) {
+            std::string sql = "ATTACH DATABASE '" + uri + "' AS eph;";
+            return sqlite3_exec(conn, sql.c_str(), nullptr, nullptr, nullptr) == SQLITE_OK;
+        }
+    } // namespace
+
+    std::optional<EphemeralPassResult> EphemeralPass(sqlite3* conn, int64_t batch_rows, int64_t now_ns) {
+        EphemeralPassResult result{};
+        auto range = Query<std::pair<int64_t, int64_t>()>(conn, sql::typed::EPHEMERAL_ID_RANGE).One();
+        if (!range) {
+            return std::nullopt;
+        }
+        if (range->second > 0) {
+            int64_t bound = range->first + batch_rows - 1;
+            if (!Query<void(int64_t)>(conn, sql::typed::EPHEMERAL_PERSIST).Bind(bound).Exec()) {
+                return std::nullopt;
+            }
+            result.persisted = sqlite3_changes(conn);
+            if (!Query<void(int64_t)>(conn, sql::typed::EPHEMERAL_DELETE_PERSISTED).Bind(bound).Exec()) {
+                return std::nullopt;
+            }
+            // срез без перенесенных строк не продвигает перенос: остаток - в следующий интервал
+            result.more = result.persisted > 0 && range->second > bound;
+        }
+        if (!Query<void(int64_t)>(conn, sql::typed::EPHEMERAL_EXPIRE).Bind(now_ns).Exec()) {
+            return std::nullopt;
+        }
+        result.expired = sqlite3_changes(conn);
+        return result;
+    }
+
+    EphemeralTier::EphemeralTier()
+        : uri_("file:/libdb_eph_" + std::to_string(next_tier_id.fetch_add(1)) + "?vfs=memdb") {}
+
+    EphemeralTask::EphemeralTask(const std::string& db_file, const EphemeralOptions& options, EphemeralTier& tier)
+        : db_file_(db_file), options_(options), tier_(tier) {}
+
+    EphemeralTask::~EphemeralTask() {
+        {
+            std::lock_guard lock(mutex_);
+            stop_ = true;
+        }
+        stop_cv_.notify_all();
+        if (worker_.joinable()) {
+            worker_.join();
+        }
+        if (conn_) {
+            sqlite3_close(conn_);
+        }
+    }
+
+    bool EphemeralTask::Start() {
+        if (sqlite3_open_v2(db_file_.c_str(), &conn_, SQLITE_OPEN_READWRITE | SQLITE_OPEN_URI, nullptr) != SQLITE_OK
+            || !AttachMemory(conn_, tier_.Uri())) {
+            DB_LOG_ERROR("StartEphemeralSnapshots", sqlite3_errcode(conn_), {}, {}, sqlite3_errmsg(conn_));
+            return false;
+        }
+        // блокировку записи держит рабочее подключение - проход откладывается до следующего интервала
+        sqlite3_busy_timeout(conn_, 20);
+        worker_ = std::thread(&EphemeralTask::Run, this);
+        return true;
+    }
+
+    // Срезы подряд, пока перенос не догонит вставки; затем ожидание интервала.
+    void EphemeralTask::Run() {
+        std::unique_lock lock(mutex_);
+        while (!stop_cv_.wait_for(lock, options_.interval, [this] { return stop_; })) {
+            lock.unlock();
+            bool more = true;
+            while (more && PassOnce(more)) {
+                std::lock_guard stop_lock(mutex_);
+                if (stop_) {
+                    break;
+                }
+            }
+            lock.lock();
+        }
+    }
+
+    // Поток DB при этом ждет только в обращениях к эфемерным комнатам, не дольше одного среза.
+    bool EphemeralTask::PassOnce(bool& more) {
+        more = false;
+        std::unique_lock lock(tier_.mutex);
+        if (sqlite3_exec(conn_, "BEGIN IMMEDIATE;", nullptr, nullptr, nullptr) != SQLITE_OK) {
+            return false;
+        }
+        auto result = EphemeralPass(conn_, options_.batch_rows, utime::GetUnixTimeNs());
+        if (!result || sqlite3_exec(conn_, "COMMIT;", nullptr, nullptr, nullptr) != SQLITE_OK) {
+            int rc = sqlite3_errcode(conn_);
+            if ((rc & 0xff) != SQLITE_BUSY) {
+                DB_LOG_ERROR("EphemeralSnapshot", rc, {}, {}, sqlite3_errmsg(conn_));
+            }
+            sqlite3_exec(conn_, "ROLLBACK;", nullptr, nullptr, nullptr);
+            return false;
+        }
+        tier_.persisted.fetch_add(result->persisted, std::memory_order_relaxed);
+        tier_.expired.fetch_add(result->expired, std::memory_order_relaxed);
+        more = result->more;
+        return true;
+    }
+
+    bool DB::AttachEphemeral() {
+        auto tier = std::make_unique<EphemeralTier>();
+        char* errmsg = nullptr;
+        if (!AttachMemory(db_, tier->Uri())
+            || sqlite3_exec(db_, sql::EPHEMERAL_INIT_SQL, nullptr, nullptr, &errmsg) != SQLITE_OK) {
+            DB_LOG_ERROR("OpenDB", sqlite3_errcode(db_), {}, {}, errmsg ? errmsg : sqlite3_errmsg(db_));
+            sqlite3_free(errmsg);
+            return false;
+        }
+        ephemeral_ = std::move(tier);
+        return true;
+    }
+
+    std::shared_lock<std::shared_mutex> DB::LockEphemeral(const std::string& room) const {
+        if (!ephemeral_ || ephemeral_->rooms.count(room) == 0) {
+            return {};
+        }
+        return std::shared_lock(ephemeral_->mutex);
+    }
+
+    std::shared_lock<std::shared_mutex> DB::LockEphemeral() const {
+        if (!ephemeral_ || ephemeral_->rooms.empty()) {
+            return {};
+        }
+        return std::shared_lock(ephemeral_->mutex);
+    }
+
+    void DB::MergeEphemeralStats(std::vector<RoomStats>& stats, int64_t limit) {
+        stats.erase(std::remove_if(stats.begin(), stats.end(),
+                                   [this](const RoomStats& s) { return ephemeral_->rooms.count(s.room) != 0; }),
+                    stats.end());
+        for (const auto& room : ephemeral_->rooms) {
+            Query<RoomStats(std::string_view)> query(db_, sql::typed::GET_ROOM_STATS_TIERED);
+            if (auto room_stats = query.Bind(room).One()) {
+                stats.push_back(std::move(*room_stats));
+            }
+        }
+        if (limit >= 0) {
+            std::stable_sort(stats.begin(), stats.end(),
+                             [](const RoomStats& a, const RoomStats& b) { return a.last_activity > b.last_activity; });
+            if (static_cast<int64_t>(stats.size()) > limit) {
+                stats.resize(static_cast<size_t>(limit));
+            }
+        }
+    }
+
+    bool DB::SetRoomEphemeral(const std::string& room, const EphemeralPolicy& policy) {
+        DB_IO_SCOPE();
+        if (!ephemeral_) {
+            DB_LOG_WARN("SetRoomEphemeral", SQLITE_MISUSE, room, {}, "DBOptions::ephemeral_rooms is off");
+            return false;
+        }
+        std::shared_lock lock(ephemeral_->mutex);
+        int64_t ttl_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(policy.ttl).count();
+        Query<void(bool, int64_t, std::string_view)> query(db_, sql::typed::EPHEMERAL_SET_ROOM);
+        if (!query.Bind(policy.persist, ttl_ns, room).Exec()) {
+            DB_LOG_ERROR("SetRoomEphemeral", query.Rc(), room, {}, sqlite3_errmsg(db_));
+            return false;
+        }
+        if (sqlite3_changes(db_) == 0) {
+            return false;  // нет такой комнаты
+        }
+        ephemeral_->rooms.insert(room);
+        return true;
+    }
+
+    bool DB::SetRoomDurable(const std::string& room) {
+        DB_IO_SCOPE();
+        if (!ephemeral_ || ephemeral_->rooms.count(room) == 0) {
+            return IsRoom(room);
+        }
+        std::shared_lock lock(ephemeral_->mutex);
+        Transaction tx(*this);
+        if (!tx) {
+            return false;
+        }
+        bool success = Query<void(std::string_view)>(db_, sql::typed::EPHEMERAL_PERSIST_ROOM).Bind(room).Exec();
+        int64_t persisted = success ? sqlite3_changes(db_) : 0;
+        success = success
+                  && Query<void(std::string_view)>(db_, sql::typed::EPHEMERAL_DELETE_ROOM_MESSAGES).Bind(room).Exec()
+                  && Query<void(std::string_view)>(db_, sql::typed::EPHEMERAL_DELETE_ROOM).Bind(room).Exec();
+        if (!success || !tx.Commit()) {
+            DB_LOG_ERROR("SetRoomDurable", sqlite3_errcode(db_), room, {}, sqlite3_errmsg(db_));
+            return false;
+        }
+        ephemeral_->persisted.fetch_add(persisted, std::memory_order_relaxed);
+        ephemeral_->rooms.erase(room);
+        return true;
+    }
+
+    bool DB::IsRoomEphemeral(const std::string& room) const {
+        return ephemeral_ && ephemeral_->rooms.count(room) != 0;
+    }
+
+    bool DB::StartEphemeralSnapshots(const EphemeralOptions& options) {
+        if (!ephemeral_ || ephemeral_->task) {
+            return ephemeral_ && ephemeral_->task;
+        }
+        const char* file = sqlite3_db_filename(db_, "main");
+        if (file == nullptr || *file == '\0') {
+            DB_LOG_WARN("StartEphemeralSnapshots", SQLITE_MISUSE, {}, {}, "snapshots need a file database");
+            return false;
+        }
+        auto task = std::make_unique<EphemeralTask>(file, options, *ephemeral_);
+        if (!task->Start()) {
+            return false;
+        }
+        ephemeral_->task = std::move(task);
+        // перенос держит блокировку записи файла; см. StartMaintenance
+        HoldBackgroundWait();
+        return true;
+    }
+
+    void DB::StopEphemeralSnapshots() {
+        if (ephemeral_ && ephemeral_->task) {
+            ephemeral_->task.reset();
+            ReleaseBackgroundWait();
+        }
+    }
+
+    int64_t DB::FlushEphemeral() {
+        DB_IO_SCOPE();
+        if (!ephemeral_) {
+            return 0;
+        }
+        std::shared_lock lock(ephemeral_->mutex);
+        Transaction tx(*this);
+        if (!tx) {
+            return -1;
+        }
+        auto result = EphemeralPass(db_, kAllRows, utime::GetUnixTimeNs());
+        if (!result || !tx.Commit()) {
+            DB_LOG_ERROR("FlushEphemeral", sqlite3_errcode(db_), {}, {}, sqlite3_errmsg(db_));
+            return -1;
+        }
+        ephemeral_->persisted.fetch_add(result->persisted, std::memory_order_relaxed);
+        ephemeral_->expired.fetch_add(result->expired, std::memory_order_relaxed);
+        return result->persisted;
+    }
+
+    EphemeralStats DB::GetEphemeralStats() {
+        DB_IO_SCOPE();
+        if (!ephemeral_) {
+            return {};
+        }
+        std::shared_lock lock(ephemeral_->mutex);
+        Query<int64_t()> query(db_, sql::typed::EPHEMERAL_COUNT_MESSAGES);
+        auto messages = query.One();
+        if (!messages) {
+            DB_LOG_ERROR("GetEphemeralStats", query.Rc(), {}, {}, sqlite3_errmsg(db_));
+        }
+        return { static_cast<int64_t>(ephemeral_->rooms.size()), messages.value_or(-1),
+                 ephemeral_->persisted.load(std::memory_order_relaxed), ephemeral_->expired.load(std::memory_order_relaxed) };
+    }
+} // db
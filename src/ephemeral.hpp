@@ -0,0 +1,76 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <sqlite3.h>
+#include <string>
+#include <thread>
+#include <unordered_set>
+
+#include "db.hpp"
+
+namespace db {
+    struct EphemeralPassResult {
+        int64_t persisted;
+        int64_t expired;
+        bool more;  // в памяти остались сообщения за границей среза
+    };
+
+    // Перенос в файл не более batch_rows сообщений persist-комнат и удаление истекших; транзакция - у вызывающего.
+    std::optional<EphemeralPassResult> EphemeralPass(sqlite3* conn, int64_t batch_rows, int64_t now_ns);
+
+    class EphemeralTier;
+
+    // Фоновые снимки на собственном подключении к файлу, с той же БД в памяти (memdb, общая по имени в процессе).
+    class EphemeralTask {
+    public:
+        EphemeralTask(const std::string& db_file, const EphemeralOptions& options, EphemeralTier& tier);
+        ~EphemeralTask();
+
+        EphemeralTask(const EphemeralTask&) = delete;
+        EphemeralTask& operator=(const EphemeralTask&) = delete;
+
+        bool Start();
+
+    private:
+        void Run();
+        // false - проход не удался (занято рабочим подключением), повтор на следующем интервале
+        bool PassOnce(bool& more);
+
+        std::string db_file_;
+        EphemeralOptions options_;
+        EphemeralTier& tier_;
+        sqlite3* conn_ = nullptr;
+
+        std::mutex mutex_;
+        std::condition_variable stop_cv_;
+        bool stop_ = false;
+        std::thread worker_;
+    };
+
+    // Состояние уровня памяти одного подключения DB.
+    class EphemeralTier {
+    public:
+        EphemeralTier();
+
+        // URI для ATTACH: имя уникально в процессе, содержимое живет, пока БД подключена хоть к одному соединению
+        const std::string& Uri() const {
+            return uri_;
+        }
+
+        // shared - чтение и запись eph потоком DB, exclusive - транзакция переноса фоновой задачи:
+        // перенос фиксируется в файле и в памяти раздельно, и чтение не должно попасть между ними
+        std::shared_mutex mutex;
+        std::unordered_set<std::string> rooms;  // только поток DB
+        std::atomic<int64_t> persisted{ 0 };
+        std::atomic<int64_t> expired{ 0 };
+        std::unique_ptr<EphemeralTask> task;
+
+    private:
+        std::string uri_;
+    };
+} // db
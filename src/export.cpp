@@ -0,0 +1,493 @@
+#include <cstring>
+#include <sqlite3.h>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "db.hpp"
+#include "export.hpp"
+#include "io_vfs.hpp"
+#include "logger.hpp"
+#include "lz.hpp"
+#include "sql_queries.hpp"
+#include "stmt.hpp"
+
+namespace db {
+    namespace {
+        void PutVarint(std::string& out, uint64_t value) {
+            while (value >= 0x80) {
+                out.push_back(static_cast<char>(value | 0x80));
+                value >>= 7;
+            }
+            out.push_back(static_cast<char>(value));
+        }
+
+        uint64_t Zigzag(int64_t value) {
+            return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+        }
+
+        int64_t Unzigzag(uint64_t value) {
+            return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+        }
+
+        bool GetVarint(const uint8_t*& p, const uint8_t* end, uint64_t& value) {
+            value = 0;
+            for (int shift = 0; shift < 64; shift += 7) {
+                if (p == end) {
+                    return false;
+                }
+                uint8_t byte = *p++;
+                value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+                if ((byte & 0x80) == 0) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void PutU32(std::string& out, uint32_t value) {
+            for (int i = 0; i < 4; ++i) {
+                out.push_back(static_cast<char>(value >> (8 * i)));
+            }
+        }
+
+        // FNV-1a тела блока: повреждение файла обнаруживается до разбора
+        uint32_t Checksum(const char* data, size_t size) {
+            uint32_t hash = 2166136261u;
+            for (size_t i = 0; i < size; ++i) {
+                hash = (hash ^ static_cast<uint8_t>(data[i])) * 16777619u;
+            }
+            return hash;
+        }
+
+        void PutColumn(std::string& out, const std::string& column) {
+            PutVarint(out, column.size());
+            out += column;
+        }
+
+        // Столбцы одного блока; буферы переиспользуются между блоками, память ограничена размером блока.
+        class BlockWriter {
+        public:
+            size_t rows() const {
+                return rows_;
+            }
+
+            size_t text_bytes() const {
+                return text_.size();
+            }
+
+            void AddRoom(std::string_view room) {
+                ++new_rooms_count_;
+                PutVarint(new_rooms_, room.size());
+                new_rooms_ += room;
+            }
+
+            void AddLogin(std::string_view login) {
+                ++new_logins_count_;
+                PutVarint(new_logins_, login.size());
+                new_logins_ += login;
+            }
+
+            void Append(uint64_t id_delta, uint32_t room, uint32_t login, int64_t id_in_room_delta, int64_t time_delta,
+                        std::string_view message) {
+                PutVarint(ids_, id_delta);
+                PutVarint(rooms_, room);
+                PutVarint(logins_, login);
+                PutVarint(ids_in_room_, Zigzag(id_in_room_delta));
+                PutVarint(times_, Zigzag(time_delta));
+                PutVarint(lengths_, message.size());
+                text_ += message;
+                ++rows_;
+            }
+
+            // Длина, контрольная сумма и тело блока в out (out очищается), затем состояние блока сбрасывается.
+            void Finish(std::string& out) {
+                out.clear();
+                PutU32(out, 0);
+                PutU32(out, 0);
+                PutVarint(out, rows_);
+                PutVarint(out, new_rooms_count_);
+                out += new_rooms_;
+                PutVarint(out, new_logins_count_);
+                out += new_logins_;
+                PutColumn(out, ids_);
+                PutColumn(out, rooms_);
+                PutColumn(out, logins_);
+                PutColumn(out, ids_in_room_);
+                PutColumn(out, times_);
+                PutColumn(out, lengths_);
+                packed_.clear();
+                PutVarint(packed_, text_.size());
+                lz::Compress(text_, packed_);
+                PutColumn(out, packed_);
+                std::string header;
+                PutU32(header, static_cast<uint32_t>(out.size() - 8));
+                PutU32(header, Checksum(out.data() + 8, out.size() - 8));
+                out.replace(0, header.size(), header);
+
+                rows_ = new_rooms_count_ = new_logins_count_ = 0;
+                for (std::string* column : { &new_rooms_, &new_logins_, &ids_, &rooms_, &logins_, &ids_in_room_,
+                                             &times_, &lengths_, &text_ }) {
+                    column->clear();
+                }
+            }
+
+        private:
+            size_t rows_ = 0;
+            size_t new_rooms_count_ = 0;
+            size_t new_logins_count_ = 0;
+            std::string new_rooms_, new_logins_;
+            std::string ids_, rooms_, logins_, ids_in_room_, times_, lengths_, text_;
+            std::string packed_;
+        };
+
+        // Снимок для выгрузки: файл - отдельное подключение только для чтения, рабочее не занято и не ждет;
+        // ":memory:" или открытая транзакция (ReadSnapshot) - рабочее подключение. Читающая транзакция держится
+        // до конца выгрузки.
+        class ExportSnapshot {
+        public:
+            ExportSnapshot(sqlite3* db, const char* vfs) {
+                const char* file = sqlite3_db_filename(db, "main");
+                if (file != nullptr && *file != '\0' && sqlite3_get_autocommit(db) != 0) {
+                    if (sqlite3_open_v2(file, &own_, SQLITE_OPEN_READONLY, vfs) != SQLITE_OK) {
+                        return;
+                    }
+                    conn_ = own_;
+                } else {
+                    conn_ = db;
+                }
+                if (sqlite3_get_autocommit(conn_) != 0) {
+                    began_ = sqlite3_exec(conn_, "BEGIN;", nullptr, nullptr, nullptr) == SQLITE_OK;
+                    ok_ = began_;
+                } else {
+                    ok_ = true;  // уже внутри транзакции вызывающего
+                }
+            }
+
+            ~ExportSnapshot() {
+                if (began_) {
+                    sqlite3_exec(conn_, "COMMIT;", nullptr, nullptr, nullptr);
+                }
+                if (own_) {
+                    sqlite3_close(own_);
+                }
+            }
+
+            ExportSnapshot(const ExportSnapshot&) = delete;
+            ExportSnapshot& operator=(const ExportSnapshot&) = delete;
+
+            explicit operator bool() const {
+                return ok_;
+            }
+
+            sqlite3* conn() const {
+                return conn_ ? conn_ : own_;
+            }
+
+        private:
+            sqlite3* own_ = nullptr;
+            sqlite3* conn_ = nullptr;
+            bool began_ = false;
+            bool ok_ = false;
+        };
+    } // namespace
+
+    std::optional<ExportStats> DB::ExportMessages(const std::function<bool(const char* data, size_t size)>& sink,
+                                                  const ExportOptions& options) {
+        DB_IO_SCOPE();
+        if (!db_) {
+            return std::nullopt;
+        }
+        ExportSnapshot snapshot(db_, io_ ? io::RegisterVfs() : nullptr);
+        sqlite3* conn = snapshot.conn();
+        if (!snapshot) {
+            DB_LOG_ERROR("ExportMessages", conn ? sqlite3_errcode(conn) : SQLITE_CANTOPEN, {}, {},
+                         conn ? sqlite3_errmsg(conn) : "cannot open snapshot");
+            return std::nullopt;
+        }
+
+        ExportStats stats{ 0, 0, options.after_messages_id, 0, 0 };
+        std::string out(kExportMagic, sizeof(kExportMagic) - 1);
+        out.push_back(static_cast<char>(kExportVersion & 0xff));
+        out.push_back(static_cast<char>(kExportVersion >> 8));
+        PutVarint(out, Zigzag(options.after_messages_id));
+        auto write = [&]() {
+            stats.bytes += static_cast<int64_t>(out.size());
+            return sink(out.data(), out.size());
+        };
+        if (!write()) {
+            return std::nullopt;
+        }
+
+        std::unordered_map<int64_t, uint32_t> room_codes;
+        std::unordered_map<int64_t, uint32_t> login_codes;
+        std::vector<int64_t> room_last_id;
+        BlockWriter block;
+        // соседние сообщения чаще всего из той же комнаты: поиск в словаре пропускается
+        int64_t cached_rooms_id = -1;
+        uint32_t cached_room = 0;
+
+        auto lookup = [conn](const sql::QueryDef<std::string(int64_t)>& def, int64_t id) {
+            Query<std::string(int64_t)> query(conn, def);
+            return query.Bind(id).One().value_or(std::string());
+        };
+        auto flush = [&]() {
+            block.Finish(out);
+            ++stats.blocks;
+            return write();
+        };
+
+        try {
+            Stmt stmt(conn, sql::EXPORT_MESSAGES);
+            stmt.Bind(1, options.after_messages_id);
+            sqlite3_stmt* row = stmt.Get();
+            int64_t last_id = options.after_messages_id;
+            int64_t last_time = 0;
+            int rc;
+            while ((rc = sqlite3_step(row)) == SQLITE_ROW) {
+                int64_t id = sqlite3_column_int64(row, 0);
+                int64_t rooms_id = sqlite3_column_int64(row, 1);
+                int64_t users_id = sqlite3_column_int64(row, 2);
+                int64_t id_in_room = sqlite3_column_int64(row, 3);
+                int64_t unixtime = sqlite3_column_int64(row, 4);
+
+                if (rooms_id != cached_rooms_id) {
+                    auto [it, inserted] = room_codes.try_emplace(rooms_id, static_cast<uint32_t>(room_codes.size()));
+                    if (inserted) {
+                        block.AddRoom(lookup(sql::typed::EXPORT_ROOM_NAME, rooms_id));
+                        room_last_id.push_back(0);
+                    }
+                    cached_rooms_id = rooms_id;
+                    cached_room = it->second;
+                }
+                auto [login, inserted] = login_codes.try_emplace(users_id, static_cast<uint32_t>(login_codes.size()));
+                if (inserted) {
+                    block.AddLogin(lookup(sql::typed::EXPORT_USER_LOGIN, users_id));
+                }
+
+                block.Append(static_cast<uint64_t>(id - last_id), cached_room, login->second,
+                             id_in_room - room_last_id[cached_room], unixtime - last_time, stmt.GetColumnView(5));
+                last_id = id;
+                last_time = unixtime;
+                room_last_id[cached_room] = id_in_room;
+                ++stats.rows;
+                stats.text_bytes += sqlite3_column_bytes(row, 5);
+
+                if ((block.rows() >= options.block_rows || block.text_bytes() >= options.block_text_bytes) && !flush()) {
+                    return std::nullopt;
+                }
+            }
+            if (rc != SQLITE_DONE) {
+                DB_LOG_ERROR("ExportMessages", rc, {}, {}, sqlite3_errmsg(conn));
+                return std::nullopt;
+            }
+            stats.last_messages_id = last_id;
+        } catch (const std::runtime_error&) {
+            DB_LOG_ERROR("ExportMessages", sqlite3_errcode(conn), {}, {}, sqlite3_errmsg(conn));
+            return std::nullopt;
+        }
+
+        if (block.rows() > 0 && !flush()) {
+            return std::nullopt;
+        }
+        out.clear();
+        PutU32(out, 0);
+        if (!write()) {
+            return std::nullopt;
+        }
+        return stats;
+    }
+
+    MessageExportReader::MessageExportReader(std::function<size_t(char* buffer, size_t cap)> source)
+        : source_(std::move(source)) {}
+
+    bool MessageExportReader::ReadExact(char* buffer, size_t size) {
+        while (size > 0) {
+            size_t got = source_(buffer, size);
+            if (got == 0) {
+                return false;
+            }
+            buffer += got;
+            size -= got;
+        }
+        return true;
+    }
+
+    bool MessageExportReader::ReadHeader() {
+        char header[sizeof(kExportMagic) + 1];
+        if (!ReadExact(header, sizeof(header)) || std::memcmp(header, kExportMagic, sizeof(kExportMagic) - 1) != 0) {
+            return false;
+        }
+        uint16_t version = static_cast<uint8_t>(header[sizeof(kExportMagic) - 1])
+                           | static_cast<uint16_t>(static_cast<uint8_t>(header[sizeof(kExportMagic)]) << 8);
+        if (version != kExportVersion) {
+            return false;
+        }
+        uint64_t after = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            char byte;
+            if (!ReadExact(&byte, 1)) {
+                return false;
+            }
+            after |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0) {
+                last_messages_id_ = Unzigzag(after);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool MessageExportReader::Next() {
+        if (finished_ || failed_) {
+            return false;
+        }
+        if (!started_) {
+            started_ = true;
+            if (!ReadHeader()) {
+                failed_ = true;
+                return false;
+            }
+        }
+        unsigned char header[8];
+        if (!ReadExact(reinterpret_cast<char*>(header), 4)) {
+            failed_ = true;  // нет блока конца: файл обрезан
+            return false;
+        }
+        auto u32 = [&header](int at) {
+            return header[at] | header[at + 1] << 8 | header[at + 2] << 16 | static_cast<uint32_t>(header[at + 3]) << 24;
+        };
+        uint32_t body = u32(0);
+        if (body == 0) {
+            finished_ = true;
+            return false;
+        }
+        body_.resize(body);
+        if (!ReadExact(reinterpret_cast<char*>(header) + 4, 4) || !ReadExact(body_.data(), body)
+            || Checksum(body_.data(), body) != u32(4) || !DecodeBlock()) {
+            failed_ = true;
+            return false;
+        }
+        return true;
+    }
+
+    bool MessageExportReader::Next(MessageBatch& batch) {
+        if (!Next()) {
+            return false;
+        }
+        batch = MessageBatch();
+        batch.Reserve(size());
+        for (size_t i = 0; i < size(); ++i) {
+            batch.Append(message(i), unixtime_[i], logins_[login_[i]], rooms_[room_[i]], id_message_in_room_[i]);
+        }
+        batch.Seal();
+        return true;
+    }
+
+    bool MessageExportReader::DecodeBlock() {
+        const uint8_t* p = reinterpret_cast<const uint8_t*>(body_.data());
+        const uint8_t* end = p + body_.size();
+        uint64_t rows = 0;
+        // в каждом столбце не меньше байта на строку
+        if (!GetVarint(p, end, rows) || rows > body_.size()) {
+            return false;
+        }
+
+        auto read_strings = [&](std::vector<std::string>& dictionary) {
+            uint64_t count = 0;
+            if (!GetVarint(p, end, count) || count > static_cast<uint64_t>(end - p)) {
+                return false;
+            }
+            for (uint64_t i = 0; i < count; ++i) {
+                uint64_t length = 0;
+                if (!GetVarint(p, end, length) || length > static_cast<uint64_t>(end - p)) {
+                    return false;
+                }
+                dictionary.emplace_back(reinterpret_cast<const char*>(p), length);
+                p += length;
+            }
+            return true;
+        };
+        if (!read_strings(rooms_) || !read_strings(logins_)) {
+            return false;
+        }
+        room_last_id_.resize(rooms_.size(), 0);
+
+        // границы следующего столбца
+        auto column = [&](const uint8_t*& begin, const uint8_t*& column_end) {
+            uint64_t length = 0;
+            if (!GetVarint(p, end, length) || length > static_cast<uint64_t>(end - p)) {
+                return false;
+            }
+            begin = p;
+            column_end = p + length;
+            p = column_end;
+            return true;
+        };
+        // rows значений столбца через decode(значение, номер строки)
+        auto each = [&](auto&& decode) {
+            const uint8_t* q;
+            const uint8_t* q_end;
+            if (!column(q, q_end)) {
+                return false;
+            }
+            for (uint64_t i = 0; i < rows; ++i) {
+                uint64_t value;
+                if (!GetVarint(q, q_end, value) || !decode(value, i)) {
+                    return false;
+                }
+            }
+            return q == q_end;
+        };
+
+        messages_id_.resize(rows);
+        room_.resize(rows);
+        login_.resize(rows);
+        id_message_in_room_.resize(rows);
+        unixtime_.resize(rows);
+        text_offset_.resize(rows + 1);
+        text_offset_[0] = 0;
+
+        bool ok = each([this](uint64_t v, uint64_t i) {
+                      last_messages_id_ += static_cast<int64_t>(v);
+                      messages_id_[i] = last_messages_id_;
+                      return true;
+                  })
+                  && each([this](uint64_t v, uint64_t i) {
+                      room_[i] = static_cast<uint32_t>(v);
+                      return v < rooms_.size();
+                  })
+                  && each([this](uint64_t v, uint64_t i) {
+                      login_[i] = static_cast<uint32_t>(v);
+                      return v < logins_.size();
+                  })
+                  && each([this](uint64_t v, uint64_t i) {
+                      int64_t& last = room_last_id_[room_[i]];
+                      last += Unzigzag(v);
+                      id_message_in_room_[i] = last;
+                      return true;
+                  })
+                  && each([this](uint64_t v, uint64_t i) {
+                      last_unixtime_ += Unzigzag(v);
+                      unixtime_[i] = last_unixtime_;
+                      return true;
+                  })
+                  && each([this](uint64_t v, uint64_t i) {
+                      text_offset_[i + 1] = text_offset_[i] + v;
+                      return text_offset_[i + 1] >= text_offset_[i];
+                  });
+        if (!ok) {
+            return false;
+        }
+
+        const uint8_t* q;
+        const uint8_t* q_end;
+        uint64_t raw_size = 0;
+        if (!column(q, q_end) || !GetVarint(q, q_end, raw_size) || raw_size != text_offset_[rows]) {
+            return false;
+        }
+        text_.resize(raw_size);
+        return lz::Decompress(reinterpret_cast<const char*>(q), q_end - q, text_.data(), raw_size) && p == end;
+    }
+} // db
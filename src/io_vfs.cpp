@@ -0,0 +1,356 @@
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <sqlite3.h>
+
+#include "io_vfs.hpp"
+
+namespace db::io {
+    namespace {
+        constexpr const char* kVfsName = "libdb_io";
+
+        thread_local Account* current_account = nullptr;
+        thread_local Counters* current_counters = nullptr;
+
+        int64_t NowNs() {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+
+        // Файл прослойки; файл настоящего VFS лежит в той же памяти сразу за ним (szOsFile увеличен).
+        struct ShimFile {
+            sqlite3_file base;
+            sqlite3_file* real;
+        };
+
+        sqlite3_file* Real(sqlite3_file* file) {
+            return reinterpret_cast<ShimFile*>(file)->real;
+        }
+
+        sqlite3_vfs* RealVfs(sqlite3_vfs* vfs) {
+            return static_cast<sqlite3_vfs*>(vfs->pAppData);
+        }
+
+        // --- sqlite3_io_methods: учет в xRead/xWrite/xSync, остальное пересылается как есть ---
+        // Здесь же место для объединения записей и внедрения ошибок в тестах.
+
+        int ShimClose(sqlite3_file* file) {
+            sqlite3_file* real = Real(file);
+            int rc = real->pMethods ? real->pMethods->xClose(real) : SQLITE_OK;
+            file->pMethods = nullptr;
+            return rc;
+        }
+
+        int ShimRead(sqlite3_file* file, void* buffer, int amount, sqlite3_int64 offset) {
+            sqlite3_file* real = Real(file);
+            Counters* counters = current_counters;
+            if (!counters) {
+                return real->pMethods->xRead(real, buffer, amount, offset);
+            }
+            int64_t started = NowNs();
+            int rc = real->pMethods->xRead(real, buffer, amount, offset);
+            counters->read_ns.fetch_add(NowNs() - started, std::memory_order_relaxed);
+            counters->reads.fetch_add(1, std::memory_order_relaxed);
+            counters->read_bytes.fetch_add(static_cast<uint64_t>(amount), std::memory_order_relaxed);
+            return rc;
+        }
+
+        int ShimWrite(sqlite3_file* file, const void* data, int amount, sqlite3_int64 offset) {
+            sqlite3_file* real = Real(file);
+            Counters* counters = current_counters;
+            if (!counters) {
+                return real->pMethods->xWrite(real, data, amount, offset);
+            }
+            int64_t started = NowNs();
+            int rc = real->pMethods->xWrite(real, data, amount, offset);
+            counters->write_ns.fetch_add(NowNs() - started, std::memory_order_relaxed);
+            counters->writes.fetch_add(1, std::memory_order_relaxed);
+            counters->write_bytes.fetch_add(static_cast<uint64_t>(amount), std::memory_order_relaxed);
+            return rc;
+        }
+
+        int ShimTruncate(sqlite3_file* file, sqlite3_int64 size) {
+            sqlite3_file* real = Real(file);
+            return real->pMethods->xTruncate(real, size);
+        }
+
+        int ShimSync(sqlite3_file* file, int flags) {
+            sqlite3_file* real = Real(file);
+            Counters* counters = current_counters;
+            if (!counters) {
+                return real->pMethods->xSync(real, flags);
+            }
+            int64_t started = NowNs();
+            int rc = real->pMethods->xSync(real, flags);
+            counters->sync_ns.fetch_add(NowNs() - started, std::memory_order_relaxed);
+            counters->syncs.fetch_add(1, std::memory_order_relaxed);
+            return rc;
+        }
+
+        int ShimFileSize(sqlite3_file* file, sqlite3_int64* size) {
+            sqlite3_file* real = Real(file);
+            return real->pMethods->xFileSize(real, size);
+        }
+
+        int ShimLock(sqlite3_file* file, int lock) {
+            sqlite3_file* real = Real(file);
+            return real->pMethods->xLock(real, lock);
+        }
+
+        int ShimUnlock(sqlite3_file* file, int lock) {
+            sqlite3_file* real = Real(file);
+            return real->pMethods->xUnlock(real, lock);
+        }
+
+        int ShimCheckReservedLock(sqlite3_file* file, int* result) {
+            sqlite3_file* real = Real(file);
+            return real->pMethods->xCheckReservedLock(real, result);
+        }
+
+        int ShimFileControl(sqlite3_file* file, int op, void* arg) {
+            sqlite3_file* real = Real(file);
+            return real->pMethods->xFileControl(real, op, arg);
+        }
+
+        int ShimSectorSize(sqlite3_file* file) {
+            sqlite3_file* real = Real(file);
+            return real->pMethods->xSectorSize(real);
+        }
+
+        int ShimDeviceCharacteristics(sqlite3_file* file) {
+            sqlite3_file* real = Real(file);
+            return real->pMethods->xDeviceCharacteristics(real);
+        }
+
+        int ShimShmMap(sqlite3_file* file, int page, int page_size, int extend, void volatile** out) {
+            sqlite3_file* real = Real(file);
+            return real->pMethods->xShmMap(real, page, page_size, extend, out);
+        }
+
+        int ShimShmLock(sqlite3_file* file, int offset, int n, int flags) {
+            sqlite3_file* real = Real(file);
+            return real->pMethods->xShmLock(real, offset, n, flags);
+        }
+
+        void ShimShmBarrier(sqlite3_file* file) {
+            sqlite3_file* real = Real(file);
+            real->pMethods->xShmBarrier(real);
+        }
+
+        int ShimShmUnmap(sqlite3_file* file, int delete_flag) {
+            sqlite3_file* real = Real(file);
+            return real->pMethods->xShmUnmap(real, delete_flag);
+        }
+
+        // чтение через mmap (PRAGMA mmap_size) идет мимо xRead и в учет не попадает
+        int ShimFetch(sqlite3_file* file, sqlite3_int64 offset, int amount, void** out) {
+            sqlite3_file* real = Real(file);
+            return real->pMethods->xFetch(real, offset, amount, out);
+        }
+
+        int ShimUnfetch(sqlite3_file* file, sqlite3_int64 offset, void* page) {
+            sqlite3_file* real = Real(file);
+            return real->pMethods->xUnfetch(real, offset, page);
+        }
+
+        // Версия методов прослойки совпадает с версией методов настоящего файла: SQLite проверяет iVersion.
+        constexpr sqlite3_io_methods MakeMethods(int version) {
+            return sqlite3_io_methods{
+                version, ShimClose, ShimRead, ShimWrite, ShimTruncate, ShimSync, ShimFileSize, ShimLock, ShimUnlock,
+                ShimCheckReservedLock, ShimFileControl, ShimSectorSize, ShimDeviceCharacteristics,
+                ShimShmMap, ShimShmLock, ShimShmBarrier, ShimShmUnmap, ShimFetch, ShimUnfetch
+            };
+        }
+
+        const sqlite3_io_methods kMethods[] = { MakeMethods(1), MakeMethods(2), MakeMethods(3) };
+
+        // --- sqlite3_vfs: пересылка настоящему VFS (pAppData) ---
+
+        int VfsOpen(sqlite3_vfs* vfs, sqlite3_filename name, sqlite3_file* file, int flags, int* out_flags) {
+            ShimFile* shim = reinterpret_cast<ShimFile*>(file);
+            shim->real = reinterpret_cast<sqlite3_file*>(shim + 1);
+            shim->real->pMethods = nullptr;
+            int rc = RealVfs(vfs)->xOpen(RealVfs(vfs), name, shim->real, flags, out_flags);
+            if (shim->real->pMethods) {
+                int version = std::clamp(shim->real->pMethods->iVersion, 1, 3);
+                file->pMethods = &kMethods[version - 1];
+            } else {
+                file->pMethods = nullptr;
+            }
+            return rc;
+        }
+
+        int VfsDelete(sqlite3_vfs* vfs, const char* name, int sync_dir) {
+            return RealVfs(vfs)->xDelete(RealVfs(vfs), name, sync_dir);
+        }
+
+        int VfsAccess(sqlite3_vfs* vfs, const char* name, int flags, int* result) {
+            return RealVfs(vfs)->xAccess(RealVfs(vfs), name, flags, result);
+        }
+
+        int VfsFullPathname(sqlite3_vfs* vfs, const char* name, int size, char* out) {
+            return RealVfs(vfs)->xFullPathname(RealVfs(vfs), name, size, out);
+        }
+
+        void* VfsDlOpen(sqlite3_vfs* vfs, const char* name) {
+            return RealVfs(vfs)->xDlOpen(RealVfs(vfs), name);
+        }
+
+        void VfsDlError(sqlite3_vfs* vfs, int size, char* out) {
+            RealVfs(vfs)->xDlError(RealVfs(vfs), size, out);
+        }
+
+        void (*VfsDlSym(sqlite3_vfs* vfs, void* handle, const char* symbol))(void) {
+            return RealVfs(vfs)->xDlSym(RealVfs(vfs), handle, symbol);
+        }
+
+        void VfsDlClose(sqlite3_vfs* vfs, void* handle) {
+            RealVfs(vfs)->xDlClose(RealVfs(vfs), handle);
+        }
+
+        int VfsRandomness(sqlite3_vfs* vfs, int size, char* out) {
+            return RealVfs(vfs)->xRandomness(RealVfs(vfs), size, out);
+        }
+
+        int VfsSleep(sqlite3_vfs* vfs, int microseconds) {
+            return RealVfs(vfs)->xSleep(RealVfs(vfs), microseconds);
+        }
+
+        int VfsCurrentTime(sqlite3_vfs* vfs, double* out) {
+            return RealVfs(vfs)->xCurrentTime(RealVfs(vfs), out);
+        }
+
+        int VfsGetLastError(sqlite3_vfs* vfs, int size, char* out) {
+            return RealVfs(vfs)->xGetLastError ? RealVfs(vfs)->xGetLastError(RealVfs(vfs), size, out) : 0;
+        }
+
+        int VfsCurrentTimeInt64(sqlite3_vfs* vfs, sqlite3_int64* out) {
+            return RealVfs(vfs)->xCurrentTimeInt64(RealVfs(vfs), out);
+        }
+
+        int VfsSetSystemCall(sqlite3_vfs* vfs, const char* name, sqlite3_syscall_ptr call) {
+            return RealVfs(vfs)->xSetSystemCall(RealVfs(vfs), name, call);
+        }
+
+        sqlite3_syscall_ptr VfsGetSystemCall(sqlite3_vfs* vfs, const char* name) {
+            return RealVfs(vfs)->xGetSystemCall(RealVfs(vfs), name);
+        }
+
+        const char* VfsNextSystemCall(sqlite3_vfs* vfs, const char* name) {
+            return RealVfs(vfs)->xNextSystemCall(RealVfs(vfs), name);
+        }
+
+        void Add(IoCounters& to, const IoCounters& from) {
+            to.calls += from.calls;
+            to.reads += from.reads;
+            to.read_bytes += from.read_bytes;
+            to.read_ns += from.read_ns;
+            to.writes += from.writes;
+            to.write_bytes += from.write_bytes;
+            to.write_ns += from.write_ns;
+            to.syncs += from.syncs;
+            to.sync_ns += from.sync_ns;
+        }
+    } // namespace
+
+    Counters* Account::Get(std::string_view method) {
+        std::lock_guard lock(mutex_);
+        auto it = by_method_.find(method);
+        if (it == by_method_.end()) {
+            it = by_method_.emplace(std::string(method), std::make_unique<Counters>()).first;
+        }
+        return it->second.get();
+    }
+
+    IoStats Account::Snapshot() const {
+        IoStats stats;
+        std::lock_guard lock(mutex_);
+        for (const auto& [method, c] : by_method_) {
+            IoCounters counters;
+            counters.calls = c->calls.load(std::memory_order_relaxed);
+            counters.reads = c->reads.load(std::memory_order_relaxed);
+            counters.read_bytes = c->read_bytes.load(std::memory_order_relaxed);
+            counters.read_ns = c->read_ns.load(std::memory_order_relaxed);
+            counters.writes = c->writes.load(std::memory_order_relaxed);
+            counters.write_bytes = c->write_bytes.load(std::memory_order_relaxed);
+            counters.write_ns = c->write_ns.load(std::memory_order_relaxed);
+            counters.syncs = c->syncs.load(std::memory_order_relaxed);
+            counters.sync_ns = c->sync_ns.load(std::memory_order_relaxed);
+            Add(stats.total, counters);
+            stats.by_method.emplace(method, counters);
+        }
+        return stats;
+    }
+
+    // Счетчики обнуляются, а не удаляются: на них могут указывать активные Scope.
+    void Account::Reset() {
+        std::lock_guard lock(mutex_);
+        for (auto& [method, c] : by_method_) {
+            c->calls = 0;
+            c->reads = 0;
+            c->read_bytes = 0;
+            c->read_ns = 0;
+            c->writes = 0;
+            c->write_bytes = 0;
+            c->write_ns = 0;
+            c->syncs = 0;
+            c->sync_ns = 0;
+        }
+    }
+
+    const char* RegisterVfs() {
+        static sqlite3_vfs shim{};
+        static int rc = [] {
+            sqlite3_vfs* real = sqlite3_vfs_find(nullptr);
+            if (real == nullptr) {
+                return SQLITE_ERROR;
+            }
+            shim.iVersion = std::min(real->iVersion, 3);
+            shim.szOsFile = static_cast<int>(sizeof(ShimFile)) + real->szOsFile;
+            shim.mxPathname = real->mxPathname;
+            shim.zName = kVfsName;
+            shim.pAppData = real;
+            shim.xOpen = VfsOpen;
+            shim.xDelete = VfsDelete;
+            shim.xAccess = VfsAccess;
+            shim.xFullPathname = VfsFullPathname;
+            shim.xDlOpen = VfsDlOpen;
+            shim.xDlError = VfsDlError;
+            shim.xDlSym = VfsDlSym;
+            shim.xDlClose = VfsDlClose;
+            shim.xRandomness = VfsRandomness;
+            shim.xSleep = VfsSleep;
+            shim.xCurrentTime = VfsCurrentTime;
+            shim.xGetLastError = VfsGetLastError;
+            if (shim.iVersion >= 2) {
+                shim.xCurrentTimeInt64 = VfsCurrentTimeInt64;
+            }
+            if (shim.iVersion >= 3) {
+                shim.xSetSystemCall = VfsSetSystemCall;
+                shim.xGetSystemCall = VfsGetSystemCall;
+                shim.xNextSystemCall = VfsNextSystemCall;
+            }
+            return sqlite3_vfs_register(&shim, 0);
+        }();
+        return rc == SQLITE_OK ? kVfsName : nullptr;
+    }
+
+    Scope::Scope(Account* account, const char* method) {
+        if (account == nullptr || current_account == account) {
+            return;
+        }
+        previous_account_ = current_account;
+        previous_counters_ = current_counters;
+        current_account = account;
+        current_counters = account->Get(method);
+        current_counters->calls.fetch_add(1, std::memory_order_relaxed);
+        active_ = true;
+    }
+
+    Scope::~Scope() {
+        if (active_) {
+            current_account = previous_account_;
+            current_counters = previous_counters_;
+        }
+    }
+} // db::io
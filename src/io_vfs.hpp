@@ -0,0 +1,60 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+#include "io_stats.hpp"
+
+namespace db::io {
+    // Счетчики одного метода; пишутся прослойкой VFS без блокировок.
+    struct Counters {
+        std::atomic<uint64_t> calls{ 0 };
+        std::atomic<uint64_t> reads{ 0 };
+        std::atomic<uint64_t> read_bytes{ 0 };
+        std::atomic<int64_t> read_ns{ 0 };
+        std::atomic<uint64_t> writes{ 0 };
+        std::atomic<uint64_t> write_bytes{ 0 };
+        std::atomic<int64_t> write_ns{ 0 };
+        std::atomic<uint64_t> syncs{ 0 };
+        std::atomic<int64_t> sync_ns{ 0 };
+    };
+
+    // Учет одного подключения DB: счетчики по именам методов.
+    class Account {
+    public:
+        // под мьютексом, один раз на вызов метода DB; сами счетчики дальше без блокировки
+        Counters* Get(std::string_view method);
+        IoStats Snapshot() const;
+        void Reset();
+
+    private:
+        mutable std::mutex mutex_;
+        std::map<std::string, std::unique_ptr<Counters>, std::less<>> by_method_;
+    };
+
+    // Имя прослойки для sqlite3_open_v2; регистрируется один раз поверх VFS по умолчанию. nullptr - ошибка.
+    const char* RegisterVfs();
+
+    // Привязывает ввод-вывод текущего потока к методу DB на время вызова. Ввод-вывод SQLite выполняется
+    // в вызывающем потоке, поэтому достаточно thread_local. Вложенный вызов того же DB остается во внешнем.
+    class Scope {
+    public:
+        Scope(Account* account, const char* method);
+        ~Scope();
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    private:
+        Account* previous_account_ = nullptr;
+        Counters* previous_counters_ = nullptr;
+        bool active_ = false;
+    };
+} // db::io
+
+// Учет ввода-вывода метода DB по имени функции; при выключенном учете - одна проверка указателя.
+#define DB_IO_SCOPE() ::db::io::Scope io_scope_(io_.get(), __func__)
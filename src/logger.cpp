@@ -0,0 +1,355 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+#ifdef LIBDB_WITH_SPDLOG
+#include <spdlog/spdlog.h>
+#endif
+
+#include "logger.hpp"
+#include "time_utils.hpp"
+
+namespace db::log {
+    namespace {
+        constexpr size_t kRingSize = 1024;  // степень двойки
+        // Слотов ограничителя, по одному на (method, rc); степень двойки. Пар в библиотеке несколько десятков,
+        // при заполнении таблицы новые пары делят один общий слот.
+        constexpr size_t kRateSlots = 256;
+
+        template <size_t N>
+        void CopyField(char (&dst)[N], std::string_view src) {
+            size_t len = std::min(src.size(), N - 1);
+            std::memcpy(dst, src.data(), len);
+            dst[len] = '\0';
+        }
+
+        struct Entry {
+            Level level;
+            int64_t unixtime;
+            int rc;
+            uint32_t suppressed;
+            char method[48];
+            char room[64];
+            char login[64];
+            char text[256];
+        };
+
+        // Ограниченная очередь Вьюкова: производители не берут блокировок, потребитель один.
+        class Ring {
+        public:
+            Ring() {
+                for (size_t i = 0; i < kRingSize; ++i) {
+                    cells_[i].seq.store(i, std::memory_order_relaxed);
+                }
+            }
+
+            template <typename Fill>
+            bool TryPush(Fill&& fill) {
+                size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+                for (;;) {
+                    Cell& cell = cells_[pos & (kRingSize - 1)];
+                    size_t seq = cell.seq.load(std::memory_order_acquire);
+                    intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+                    if (diff == 0) {
+                        if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                            fill(cell.entry);
+                            cell.seq.store(pos + 1, std::memory_order_release);
+                            return true;
+                        }
+                    } else if (diff < 0) {
+                        return false;  // буфер заполнен
+                    } else {
+                        pos = enqueue_pos_.load(std::memory_order_relaxed);
+                    }
+                }
+            }
+
+            bool TryPop(Entry& out) {
+                Cell& cell = cells_[dequeue_pos_ & (kRingSize - 1)];
+                size_t seq = cell.seq.load(std::memory_order_acquire);
+                if (seq != dequeue_pos_ + 1) {
+                    return false;
+                }
+                out = cell.entry;
+                cell.seq.store(dequeue_pos_ + kRingSize, std::memory_order_release);
+                ++dequeue_pos_;
+                consumed_.store(dequeue_pos_, std::memory_order_release);
+                return true;
+            }
+
+            size_t Produced() const {
+                return enqueue_pos_.load(std::memory_order_acquire);
+            }
+
+            size_t Consumed() const {
+                return consumed_.load(std::memory_order_acquire);
+            }
+
+        private:
+            struct Cell {
+                std::atomic<size_t> seq;
+                Entry entry;
+            };
+
+            std::array<Cell, kRingSize> cells_;
+            alignas(64) std::atomic<size_t> enqueue_pos_{ 0 };
+            alignas(64) size_t dequeue_pos_ = 0;
+            std::atomic<size_t> consumed_{ 0 };
+        };
+
+        class DefaultSink : public Sink {
+        public:
+            void Write(const Record& r) override {
+#ifdef LIBDB_WITH_SPDLOG
+                spdlog::log(ToSpdlog(r.level), "[{}] rc={} room={} login={} suppressed={}: {}",
+                            r.method, r.rc, r.room, r.login, r.suppressed, r.text);
+#else
+                std::cerr << "[" << r.method << "] rc=" << r.rc;
+                if (!r.room.empty()) {
+                    std::cerr << " room=" << r.room;
+                }
+                if (!r.login.empty()) {
+                    std::cerr << " login=" << r.login;
+                }
+                if (r.suppressed != 0) {
+                    std::cerr << " suppressed=" << r.suppressed;
+                }
+                std::cerr << ": " << r.text << "\n";
+#endif
+            }
+
+            void Flush() override {
+#ifdef LIBDB_WITH_SPDLOG
+                spdlog::default_logger_raw()->flush();
+#else
+                std::cerr.flush();
+#endif
+            }
+
+        private:
+#ifdef LIBDB_WITH_SPDLOG
+            static spdlog::level::level_enum ToSpdlog(Level level) {
+                switch (level) {
+                case Level::kTrace: return spdlog::level::trace;
+                case Level::kDebug: return spdlog::level::debug;
+                case Level::kInfo:  return spdlog::level::info;
+                case Level::kWarn:  return spdlog::level::warn;
+                case Level::kError: return spdlog::level::err;
+                default:            return spdlog::level::off;
+                }
+            }
+#endif
+        };
+
+        class Logger {
+        public:
+            static Logger& Instance() {
+                static Logger logger;
+                return logger;
+            }
+
+            // После разрушения синглтона (статические деструкторы при выходе) записи молча отбрасываются.
+            static bool Destroyed() {
+                return destroyed_.load(std::memory_order_acquire);
+            }
+
+            void Push(Level level, std::string_view method, int rc,
+                      std::string_view room, std::string_view login, std::string_view text) {
+                int64_t now = utime::GetUnixTimeNs();
+                uint32_t suppressed = 0;
+                if (!Admit(method, rc, now, suppressed)) {
+                    return;
+                }
+                bool pushed = ring_.TryPush([&](Entry& e) {
+                    e.level = level;
+                    e.unixtime = now;
+                    e.rc = rc;
+                    e.suppressed = suppressed;
+                    CopyField(e.method, method);
+                    CopyField(e.room, room);
+                    CopyField(e.login, login);
+                    CopyField(e.text, text);
+                });
+                if (!pushed) {
+                    dropped_.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+
+            void SetSink(std::shared_ptr<Sink> sink) {
+                std::lock_guard lock(sink_mutex_);
+                sink_ = sink ? std::move(sink) : std::make_shared<DefaultSink>();
+            }
+
+            void SetRateLimit(std::chrono::milliseconds window, uint32_t burst) {
+                window_ns_.store(std::chrono::duration_cast<std::chrono::nanoseconds>(window).count(),
+                                 std::memory_order_relaxed);
+                burst_.store(burst, std::memory_order_relaxed);
+                auto reset = [](RateSlot& b) {
+                    b.window_start.store(0, std::memory_order_relaxed);
+                    b.count.store(0, std::memory_order_relaxed);
+                    b.suppressed.store(0, std::memory_order_relaxed);
+                };
+                for (auto& b : slots_) {
+                    reset(b);
+                }
+                reset(overflow_);
+            }
+
+            void Flush() {
+                size_t target = ring_.Produced();
+                std::unique_lock lock(wake_mutex_);
+                flush_requested_ = true;
+                wake_cv_.notify_one();
+                done_cv_.wait(lock, [&] { return ring_.Consumed() >= target || stop_; });
+                lock.unlock();
+                std::lock_guard sink_lock(sink_mutex_);
+                sink_->Flush();
+            }
+
+            uint64_t Dropped() const {
+                return dropped_.load(std::memory_order_relaxed);
+            }
+
+        private:
+            // Слот ключа (method, rc). Ключ записывается один раз: state 0 - пусто, 1 - ключ пишется, 2 - готов.
+            struct RateSlot {
+                std::atomic<int> state{ 0 };
+                int rc = 0;
+                char method[sizeof(Entry::method)] = {};
+                std::atomic<int64_t> window_start{ 0 };
+                std::atomic<uint32_t> count{ 0 };
+                std::atomic<uint32_t> suppressed{ 0 };
+            };
+
+            Logger() : sink_(std::make_shared<DefaultSink>()) {
+                worker_ = std::thread([this] { Run(); });
+            }
+
+            ~Logger() {
+                destroyed_.store(true, std::memory_order_release);
+                {
+                    std::lock_guard lock(wake_mutex_);
+                    stop_ = true;
+                }
+                wake_cv_.notify_one();
+                worker_.join();
+            }
+
+            bool Admit(std::string_view method, int rc, int64_t now, uint32_t& suppressed) {
+                uint32_t burst = burst_.load(std::memory_order_relaxed);
+                if (burst == 0) {
+                    return true;
+                }
+                RateSlot& b = FindSlot(method, rc);
+                int64_t start = b.window_start.load(std::memory_order_relaxed);
+                if (now - start >= window_ns_.load(std::memory_order_relaxed)
+                    && b.window_start.compare_exchange_strong(start, now, std::memory_order_relaxed)) {
+                    b.count.store(1, std::memory_order_relaxed);
+                    suppressed = b.suppressed.exchange(0, std::memory_order_relaxed);
+                    return true;
+                }
+                if (b.count.fetch_add(1, std::memory_order_relaxed) < burst) {
+                    return true;
+                }
+                b.suppressed.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+
+            // Открытая адресация с линейным пробированием; слоты не освобождаются, поэтому поиск без блокировок.
+            RateSlot& FindSlot(std::string_view method, int rc) {
+                method = method.substr(0, sizeof(Entry::method) - 1);  // как в Entry::method
+                size_t h = std::hash<std::string_view>{}(method) ^ (static_cast<size_t>(rc) * 0x9E3779B97F4A7C15ull);
+                for (size_t probe = 0; probe < kRateSlots; ++probe) {
+                    RateSlot& slot = slots_[(h + probe) & (kRateSlots - 1)];
+                    int state = slot.state.load(std::memory_order_acquire);
+                    if (state == 0 && slot.state.compare_exchange_strong(state, 1, std::memory_order_acquire)) {
+                        slot.rc = rc;
+                        CopyField(slot.method, method);
+                        slot.state.store(2, std::memory_order_release);
+                        return slot;
+                    }
+                    while (state != 2) {  // ключ пишет другой поток
+                        std::this_thread::yield();
+                        state = slot.state.load(std::memory_order_acquire);
+                    }
+                    if (slot.rc == rc && method == slot.method) {
+                        return slot;
+                    }
+                }
+                return overflow_;
+            }
+
+            void Run() {
+                Entry e;
+                for (;;) {
+                    bool any = false;
+                    {
+                        std::lock_guard lock(sink_mutex_);
+                        while (ring_.TryPop(e)) {
+                            any = true;
+                            sink_->Write({ e.level, e.unixtime, e.method, e.rc,
+                                           e.room, e.login, e.text, e.suppressed });
+                        }
+                    }
+                    std::unique_lock lock(wake_mutex_);
+                    done_cv_.notify_all();
+                    if (stop_ && ring_.Consumed() == ring_.Produced()) {
+                        return;
+                    }
+                    if (!any && !flush_requested_) {
+                        wake_cv_.wait_for(lock, std::chrono::milliseconds(5));
+                    }
+                    flush_requested_ = false;
+                }
+            }
+
+            static inline std::atomic<bool> destroyed_{ false };
+
+            Ring ring_;
+            std::array<RateSlot, kRateSlots> slots_;
+            RateSlot overflow_;  // пары, не поместившиеся в slots_
+            std::atomic<int64_t> window_ns_{ 1'000'000'000 };
+            std::atomic<uint32_t> burst_{ 10 };
+            std::atomic<uint64_t> dropped_{ 0 };
+
+            std::mutex sink_mutex_;
+            std::shared_ptr<Sink> sink_;
+
+            std::mutex wake_mutex_;
+            std::condition_variable wake_cv_;
+            std::condition_variable done_cv_;
+            bool flush_requested_ = false;
+            bool stop_ = false;
+            std::thread worker_;
+        };
+    } // namespace
+
+    void Push(Level level, std::string_view method, int rc,
+              std::string_view room, std::string_view login, std::string_view text) noexcept {
+        if (!Logger::Destroyed()) {
+            Logger::Instance().Push(level, method, rc, room, login, text);
+        }
+    }
+
+    void SetSink(std::shared_ptr<Sink> sink) {
+        Logger::Instance().SetSink(std::move(sink));
+    }
+
+    void SetRateLimit(std::chrono::milliseconds window, uint32_t burst) {
+        Logger::Instance().SetRateLimit(window, burst);
+    }
+
+    void Flush() {
+        Logger::Instance().Flush();
+    }
+
+    uint64_t GetDroppedCount() {
+        return Logger::Instance().Dropped();
+    }
+} // db::log
@@ -0,0 +1,33 @@
+#pragma once
+#include <string_view>
+
+#include "log.hpp"
+
+// Минимальный уровень, попадающий в сборку. Вызовы ниже уровня вырезаются компилятором
+// вместе с вычислением аргументов. Задается CMake-переменной LIBDB_LOG_ACTIVE_LEVEL.
+#ifndef LIBDB_LOG_ACTIVE_LEVEL
+#define LIBDB_LOG_ACTIVE_LEVEL 2
+#endif
+
+namespace db::log {
+    constexpr bool IsActive(Level level) {
+        return static_cast<int>(level) >= LIBDB_LOG_ACTIVE_LEVEL && level != Level::kOff;
+    }
+
+    // Неблокирующая постановка записи в кольцевой буфер; длинные строки обрезаются.
+    void Push(Level level, std::string_view method, int rc,
+              std::string_view room, std::string_view login, std::string_view text) noexcept;
+} // db::log
+
+#define DB_LOG(level, method, rc, room, login, text)                          \
+    do {                                                                      \
+        if constexpr (::db::log::IsActive(level)) {                           \
+            ::db::log::Push(level, method, rc, room, login, text);            \
+        }                                                                     \
+    } while (false)
+
+#define DB_LOG_ERROR(method, rc, room, login, text) \
+    DB_LOG(::db::log::Level::kError, method, rc, room, login, text)
+
+#define DB_LOG_WARN(method, rc, room, login, text) \
+    DB_LOG(::db::log::Level::kWarn, method, rc, room, login, text)
@@ -0,0 +1,148 @@
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "lz.hpp"
+
+namespace db::lz {
+    namespace {
+        constexpr size_t kMinMatch = 4;
+        constexpr size_t kMaxOffset = 65'535;
+        constexpr int kHashBits = 14;
+        // совпадение не начинается в последних байтах: хвост уходит литералами
+        constexpr size_t kTailLiterals = 8;
+
+        uint32_t Load32(const char* p) {
+            uint32_t value;
+            std::memcpy(&value, p, sizeof(value));
+            return value;
+        }
+
+        uint32_t Hash(uint32_t value) {
+            return (value * 2654435761u) >> (32 - kHashBits);
+        }
+
+        void PutLength(std::string& out, size_t length) {
+            for (; length >= 255; length -= 255) {
+                out.push_back(static_cast<char>(255));
+            }
+            out.push_back(static_cast<char>(length));
+        }
+
+        void PutSequence(std::string& out, const char* literals, size_t literal_length, size_t match_length, size_t offset) {
+            size_t match_code = match_length == 0 ? 0 : match_length - kMinMatch;
+            uint8_t token = static_cast<uint8_t>((literal_length < 15 ? literal_length : 15) << 4
+                                                 | (match_code < 15 ? match_code : 15));
+            out.push_back(static_cast<char>(token));
+            if (literal_length >= 15) {
+                PutLength(out, literal_length - 15);
+            }
+            out.append(literals, literal_length);
+            if (match_length == 0) {
+                return;
+            }
+            out.push_back(static_cast<char>(offset & 0xff));
+            out.push_back(static_cast<char>(offset >> 8));
+            if (match_code >= 15) {
+                PutLength(out, match_code - 15);
+            }
+        }
+
+        // false - длина выходит за конец входа
+        bool GetLength(const uint8_t*& ip, const uint8_t* end, size_t& length) {
+            uint8_t byte;
+            do {
+                if (ip == end) {
+                    return false;
+                }
+                byte = *ip++;
+                length += byte;
+            } while (byte == 255);
+            return true;
+        }
+    } // namespace
+
+    void Compress(std::string_view input, std::string& out) {
+        const char* base = input.data();
+        const size_t size = input.size();
+        out.reserve(out.size() + size + size / 255 + 16);
+        if (size <= kTailLiterals + kMinMatch) {
+            PutSequence(out, base, size, 0, 0);
+            return;
+        }
+        // позиция + 1; 0 - пусто
+        std::vector<uint32_t> table(size_t{ 1 } << kHashBits, 0);
+        const size_t match_limit = size - kTailLiterals;
+        size_t anchor = 0;
+        size_t pos = 0;
+        while (pos < match_limit) {
+            uint32_t value = Load32(base + pos);
+            uint32_t& slot = table[Hash(value)];
+            size_t candidate = slot;
+            slot = static_cast<uint32_t>(pos + 1);
+            if (candidate == 0 || pos - (candidate - 1) > kMaxOffset || Load32(base + candidate - 1) != value) {
+                ++pos;
+                continue;
+            }
+            size_t match = candidate - 1;
+            size_t length = kMinMatch;
+            while (pos + length < match_limit && base[match + length] == base[pos + length]) {
+                ++length;
+            }
+            PutSequence(out, base + anchor, pos - anchor, length, pos - match);
+            pos += length;
+            anchor = pos;
+            // позиция внутри совпадения: следующее повторение чаще всего начинается рядом
+            if (pos < match_limit) {
+                table[Hash(Load32(base + pos - 2))] = static_cast<uint32_t>(pos - 2 + 1);
+            }
+        }
+        PutSequence(out, base + anchor, size - anchor, 0, 0);
+    }
+
+    bool Decompress(const char* data, size_t size, char* out, size_t raw_size) {
+        const uint8_t* ip = reinterpret_cast<const uint8_t*>(data);
+        const uint8_t* end = ip + size;
+        size_t op = 0;
+        while (ip < end) {
+            uint8_t token = *ip++;
+            size_t literal_length = token >> 4;
+            if (literal_length == 15 && !GetLength(ip, end, literal_length)) {
+                return false;
+            }
+            if (literal_length > static_cast<size_t>(end - ip) || literal_length > raw_size - op) {
+                return false;
+            }
+            std::memcpy(out + op, ip, literal_length);
+            ip += literal_length;
+            op += literal_length;
+            if (ip == end) {
+                break;  // последняя последовательность
+            }
+            if (end - ip < 2) {
+                return false;
+            }
+            size_t offset = ip[0] | static_cast<size_t>(ip[1]) << 8;
+            ip += 2;
+            size_t match_length = token & 0x0f;
+            if (match_length == 15 && !GetLength(ip, end, match_length)) {
+                return false;
+            }
+            match_length += kMinMatch;
+            if (offset == 0 || offset > op || match_length > raw_size - op) {
+                return false;
+            }
+            // совпадение может перекрывать само себя (offset < length): копирование по байту
+            const char* match = out + op - offset;
+            if (offset >= match_length) {
+                std::memcpy(out + op, match, match_length);
+            } else {
+                for (size_t i = 0; i < match_length; ++i) {
+                    out[op + i] = match[i];
+                }
+            }
+            op += match_length;
+        }
+        return op == raw_size;
+    }
+} // db::lz
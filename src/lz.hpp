@@ -0,0 +1,15 @@
+#pragma once
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+// Сжатие блоков текста для экспорта (ExportMessages): LZ77 с одним проходом и хеш-таблицей, без внешних библиотек.
+// Последовательность: байт-токен (старшие 4 бита - длина литералов, младшие - длина совпадения - 4; 15 - продолжение
+// байтами по 255), литералы, смещение совпадения 2 байта LE. Последняя последовательность - только литералы.
+namespace db::lz {
+    // Дописывает сжатый input в конец out.
+    void Compress(std::string_view input, std::string& out);
+
+    // Распаковывает ровно raw_size байт в out; false - данные повреждены.
+    bool Decompress(const char* data, size_t size, char* out, size_t raw_size);
+} // db::lz
@@ -0,0 +1,204 @@
+#include <chrono>
+#include <optional>
+#include <sqlite3.h>
+#include <stdexcept>
+#include <string>
+
+#include "db.hpp"
+#include "io_vfs.hpp"
+#include "logger.hpp"
+#include "maintenance.hpp"
+#include "sql_queries.hpp"
+#include "stmt.hpp"
+
+namespace db {
+    namespace {
+        int64_t SteadyNowNs() {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+
+        constexpr int kAutoVacuumIncremental = 2;
+    } // namespace
+
+    int64_t PragmaInt(sqlite3* db, const char* pragma) {
+        Stmt stmt(db, pragma);
+        if (sqlite3_step(stmt.Get()) != SQLITE_ROW) {
+            return -1;
+        }
+        return sqlite3_column_int64(stmt.Get(), 0);
+    }
+
+    int64_t IncrementalVacuumSlice(sqlite3* db, int64_t pages) {
+        int64_t before = PragmaInt(db, "PRAGMA freelist_count;");
+        std::string sql = "PRAGMA incremental_vacuum(" + std::to_string(pages) + ");";
+        int rc = sqlite3_exec(db, sql.c_str(), nullptr, nullptr, nullptr);
+        if (rc != SQLITE_OK || before < 0) {
+            return -1;
+        }
+        int64_t after = PragmaInt(db, "PRAGMA freelist_count;");
+        return after < 0 ? -1 : before - after;
+    }
+
+    MaintenanceTask::MaintenanceTask(const std::string& db_file, const MaintenanceOptions& options,
+                                     const std::atomic<int64_t>& last_write_ns)
+        : db_file_(db_file), options_(options), last_write_ns_(last_write_ns) {}
+
+    MaintenanceTask::~MaintenanceTask() {
+        {
+            std::lock_guard lock(mutex_);
+            stop_ = true;
+        }
+        stop_cv_.notify_all();
+        if (worker_.joinable()) {
+            worker_.join();
+        }
+        if (conn_) {
+            sqlite3_close(conn_);
+        }
+    }
+
+    bool MaintenanceTask::Start() {
+        if (sqlite3_open_v2(db_file_.c_str(), &conn_, SQLITE_OPEN_READWRITE, nullptr) != SQLITE_OK) {
+            DB_LOG_ERROR("StartMaintenance", sqlite3_errcode(conn_), {}, {}, sqlite3_errmsg(conn_));
+            return false;
+        }
+        // занято рабочим подключением - срез пропускается до следующей проверки
+        sqlite3_busy_timeout(conn_, 10);
+        if (PragmaInt(conn_, "PRAGMA auto_vacuum;") != kAutoVacuumIncremental) {
+            DB_LOG_WARN("StartMaintenance", SQLITE_OK, {}, {}, "auto_vacuum is not INCREMENTAL, see MigrateToIncrementalVacuum");
+            return false;
+        }
+        worker_ = std::thread(&MaintenanceTask::Run, this);
+        return true;
+    }
+
+    bool MaintenanceTask::IsIdle() const {
+        int64_t idle_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(options_.idle_after).count();
+        return SteadyNowNs() - last_write_ns_.load(std::memory_order_relaxed) >= idle_ns;
+    }
+
+    // Пока подключение DB не пишет и не ждет блокировку записи, срезы идут с паузой slice_pause: запись, начавшаяся
+    // во время среза, ждет в обработчике занятости, отмечает активность и берет блокировку в паузе.
+    void MaintenanceTask::Run() {
+        std::unique_lock lock(mutex_);
+        try {
+            while (!stop_cv_.wait_for(lock, options_.check_interval, [this] { return stop_; })) {
+                lock.unlock();
+                while (IsIdle() && PragmaInt(conn_, "PRAGMA freelist_count;") >= options_.min_free_pages) {
+                    int64_t freed = IncrementalVacuumSlice(conn_, options_.pages_per_slice);
+                    if (freed <= 0) {
+                        break;
+                    }
+                    reclaimed_pages_.fetch_add(freed, std::memory_order_relaxed);
+                    slices_.fetch_add(1, std::memory_order_relaxed);
+                    std::unique_lock pause_lock(mutex_);
+                    if (stop_cv_.wait_for(pause_lock, options_.slice_pause, [this] { return stop_; })) {
+                        break;
+                    }
+                }
+                lock.lock();
+            }
+        } catch (const std::runtime_error&) {
+            // Stmt не подготовился (например, файл поврежден или заменен): задача останавливается до StopMaintenance
+            DB_LOG_ERROR("Maintenance", sqlite3_errcode(conn_), {}, {}, sqlite3_errmsg(conn_));
+        }
+    }
+
+    void DB::MarkWrite() {
+        last_write_ns_.store(SteadyNowNs(), std::memory_order_relaxed);
+    }
+
+    bool DB::StartMaintenance(const MaintenanceOptions& options) {
+        if (!db_ || maintenance_) {
+            return maintenance_ != nullptr;
+        }
+        const char* file = sqlite3_db_filename(db_, "main");
+        if (file == nullptr || *file == '\0') {
+            DB_LOG_WARN("StartMaintenance", SQLITE_MISUSE, {}, {}, "maintenance needs a file database");
+            return false;
+        }
+        auto task = std::make_unique<MaintenanceTask>(file, options, last_write_ns_);
+        if (!task->Start()) {
+            return false;
+        }
+        maintenance_ = std::move(task);
+        HoldBackgroundWait();
+        return true;
+    }
+
+    void DB::StopMaintenance() {
+        if (maintenance_) {
+            maintenance_.reset();
+            ReleaseBackgroundWait();
+        }
+    }
+
+    int64_t DB::IncrementalVacuum(int64_t pages) {
+        DB_IO_SCOPE();
+        int64_t freed = IncrementalVacuumSlice(db_, pages);
+        if (freed < 0) {
+            DB_LOG_ERROR("IncrementalVacuum", sqlite3_errcode(db_), {}, {}, sqlite3_errmsg(db_));
+        }
+        return freed;
+    }
+
+    // VACUUM переписывает файл целиком, но только один раз: дальше свободные страницы возвращаются срезами.
+    bool DB::MigrateToIncrementalVacuum() {
+        DB_IO_SCOPE();
+        if (PragmaInt(db_, "PRAGMA auto_vacuum;") == kAutoVacuumIncremental) {
+            return true;
+        }
+        char* errmsg = nullptr;
+        int rc = sqlite3_exec(db_, "PRAGMA auto_vacuum = INCREMENTAL; VACUUM;", nullptr, nullptr, &errmsg);
+        if (rc != SQLITE_OK) {
+            DB_LOG_ERROR("MigrateToIncrementalVacuum", rc, {}, {}, errmsg);
+            sqlite3_free(errmsg);
+            return false;
+        }
+        return PragmaInt(db_, "PRAGMA auto_vacuum;") == kAutoVacuumIncremental;
+    }
+
+    SpaceStats DB::GetSpaceStats() {
+        DB_IO_SCOPE();
+        SpaceStats stats{};
+        stats.incremental = PragmaInt(db_, "PRAGMA auto_vacuum;") == kAutoVacuumIncremental;
+        stats.page_size = PragmaInt(db_, "PRAGMA page_size;");
+        stats.page_count = PragmaInt(db_, "PRAGMA page_count;");
+        stats.free_pages = PragmaInt(db_, "PRAGMA freelist_count;");
+        stats.reclaimed_pages = maintenance_ ? maintenance_->ReclaimedPages() : 0;
+        stats.slices = maintenance_ ? maintenance_->Slices() : 0;
+        return stats;
+    }
+
+    // Обходит все страницы таблицы (dbstat): для отчетов и решения о полном VACUUM, не для рабочего пути.
+    double DB::GetFragmentation(const std::string& table) {
+        DB_IO_SCOPE();
+        std::optional<Stmt> stmt;
+        try {
+            stmt.emplace(db_, sql::TABLE_LEAF_PAGES);
+        } catch (const std::runtime_error&) {
+            // SQLite собран без SQLITE_ENABLE_DBSTAT_VTAB
+            DB_LOG_WARN("GetFragmentation", sqlite3_errcode(db_), {}, {}, sqlite3_errmsg(db_));
+            return -1.0;
+        }
+        stmt->BindStatic(1, std::string_view(table));
+        int64_t previous = -1;
+        int64_t transitions = 0;
+        int64_t jumps = 0;
+        int rc;
+        while ((rc = sqlite3_step(stmt->Get())) == SQLITE_ROW) {
+            int64_t page = sqlite3_column_int64(stmt->Get(), 0);
+            if (previous >= 0) {
+                ++transitions;
+                jumps += page != previous + 1 ? 1 : 0;
+            }
+            previous = page;
+        }
+        if (rc != SQLITE_DONE) {
+            DB_LOG_ERROR("GetFragmentation", rc, {}, {}, sqlite3_errmsg(db_));
+            return -1.0;
+        }
+        return transitions == 0 ? 0.0 : static_cast<double>(jumps) / static_cast<double>(transitions);
+    }
+} // db
@@ -0,0 +1,56 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <sqlite3.h>
+#include <string>
+#include <thread>
+
+#include "db.hpp"
+
+namespace db {
+    // Фоновая очистка свободных страниц на собственном подключении к файлу DB.
+    // Рабочее подключение не блокируется: срезы incremental_vacuum короткие и выполняются только в простое.
+    class MaintenanceTask {
+    public:
+        MaintenanceTask(const std::string& db_file, const MaintenanceOptions& options,
+                        const std::atomic<int64_t>& last_write_ns);
+        ~MaintenanceTask();
+
+        MaintenanceTask(const MaintenanceTask&) = delete;
+        MaintenanceTask& operator=(const MaintenanceTask&) = delete;
+
+        bool Start();
+
+        int64_t ReclaimedPages() const {
+            return reclaimed_pages_.load(std::memory_order_relaxed);
+        }
+
+        int64_t Slices() const {
+            return slices_.load(std::memory_order_relaxed);
+        }
+
+    private:
+        void Run();
+        bool IsIdle() const;
+
+        std::string db_file_;
+        MaintenanceOptions options_;
+        const std::atomic<int64_t>& last_write_ns_;
+        sqlite3* conn_ = nullptr;
+
+        std::mutex mutex_;
+        std::condition_variable stop_cv_;
+        bool stop_ = false;
+        std::thread worker_;
+
+        std::atomic<int64_t> reclaimed_pages_{ 0 };
+        std::atomic<int64_t> slices_{ 0 };
+    };
+
+    // PRAGMA с одним целым результатом; -1 при ошибке.
+    int64_t PragmaInt(sqlite3* db, const char* pragma);
+    // Срез incremental_vacuum; возвращает число освобожденных страниц, -1 при ошибке.
+    int64_t IncrementalVacuumSlice(sqlite3* db, int64_t pages);
+} // db
@@ -0,0 +1,253 @@
+#include <sqlite3.h>
+#include <string>
+#include <utility>
+
+#include "db.hpp"
+#include "io_vfs.hpp"
+#include "logger.hpp"
+#include "read_snapshot.hpp"
+#include "sql_queries.hpp"
+
+namespace db {
+    namespace {
+        // больше свободных подключений не держим: остальные закрываются при возврате
+        constexpr size_t kMaxIdleReaders = 4;
+    } // namespace
+
+    bool DB::OpenReader() {
+        const char* vfs = io_ ? io::RegisterVfs() : nullptr;
+        // только чтение: без схемы, PRAGMA записи и хуков ленты изменений; файл уже создан рабочим подключением
+        if (sqlite3_open_v2(db_filename_.c_str(), &db_, SQLITE_OPEN_READONLY, vfs) != SQLITE_OK) {
+            return false;
+        }
+        if (options_.busy_timeout.count() > 0) {
+            sqlite3_busy_handler(db_, &DB::BusyHandler, this);
+        }
+        if (options_.cache_size_kib > 0) {
+            std::string pragma = "PRAGMA cache_size = -" + std::to_string(options_.cache_size_kib) + ";";
+            sqlite3_exec(db_, pragma.c_str(), nullptr, nullptr, nullptr);
+        }
+        if (options_.mmap_size > 0) {
+            std::string pragma = "PRAGMA mmap_size = " + std::to_string(options_.mmap_size) + ";";
+            sqlite3_exec(db_, pragma.c_str(), nullptr, nullptr, nullptr);
+        }
+        return true;
+    }
+
+    std::unique_ptr<DB> DB::TakeReader() {
+        {
+            std::lock_guard lock(readers_mutex_);
+            if (!readers_.empty()) {
+                auto reader = std::move(readers_.back());
+                readers_.pop_back();
+                return reader;
+            }
+        }
+        const char* file = db_ ? sqlite3_db_filename(db_, "main") : nullptr;
+        if (file == nullptr || *file == '\0') {
+            DB_LOG_WARN("ReadSnapshot", SQLITE_MISUSE, {}, {}, "dedicated snapshot needs a file database");
+            return nullptr;
+        }
+        // те же настройки кэша и ожидания; память (eph) - только у рабочего подключения
+        DBOptions options = options_;
+        options.ephemeral_rooms = false;
+        auto reader = std::make_unique<DB>(file, options);
+        if (!reader->OpenReader()) {
+            DB_LOG_ERROR("ReadSnapshot", reader->db_ ? sqlite3_errcode(reader->db_) : SQLITE_CANTOPEN, {}, {},
+                         "cannot open reader connection");
+            return nullptr;
+        }
+        return reader;
+    }
+
+    void DB::ReturnReader(std::unique_ptr<DB> reader) {
+        std::lock_guard lock(readers_mutex_);
+        // после CloseDB пул не пополняется: подключение закрывается здесь
+        if (readers_open_ && readers_.size() < kMaxIdleReaders) {
+            readers_.push_back(std::move(reader));
+        }
+    }
+
+    ReadSnapshot::ReadSnapshot(DB& db, bool dedicated) : owner_(db) {
+        if (!owner_.db_) {
+            return;
+        }
+        if (dedicated) {
+            reader_ = owner_.TakeReader();
+            if (!reader_) {
+                return;
+            }
+            db_ = reader_.get();
+        } else {
+            db_ = &owner_;
+        }
+        if (db_->InTransaction()) {
+            active_ = true;  // читает в уже открытой транзакции, ее состояние и есть снимок
+            return;
+        }
+        // Рабочее подключение на время снимка только читает: запись из читающей транзакции после чужой фиксации
+        // получила бы SQLITE_BUSY_SNAPSHOT. Записи через DB получают SQLITE_READONLY до Release.
+        if (!reader_) {
+            sqlite3_exec(db_->db_, "PRAGMA query_only = ON;", nullptr, nullptr, nullptr);
+        }
+        int rc = sqlite3_exec(db_->db_, sql::READ_SNAPSHOT_BEGIN, nullptr, nullptr, nullptr);
+        if (rc != SQLITE_OK) {
+            DB_LOG_ERROR("ReadSnapshot", rc, {}, {}, sqlite3_errmsg(db_->db_));
+            sqlite3_exec(db_->db_, "ROLLBACK;", nullptr, nullptr, nullptr);
+            if (!reader_) {
+                sqlite3_exec(db_->db_, "PRAGMA query_only = OFF;", nullptr, nullptr, nullptr);
+            }
+            return;
+        }
+        began_ = true;
+        active_ = true;
+    }
+
+    ReadSnapshot::~ReadSnapshot() {
+        Release();
+    }
+
+    void ReadSnapshot::Release() {
+        if (db_ == nullptr) {
+            return;
+        }
+        if (began_) {
+            // транзакция только читала: завершить ее можно и откатом
+            if (sqlite3_exec(db_->db_, "COMMIT;", nullptr, nullptr, nullptr) != SQLITE_OK) {
+                DB_LOG_ERROR("ReadSnapshot::Release", sqlite3_errcode(db_->db_), {}, {}, sqlite3_errmsg(db_->db_));
+                sqlite3_exec(db_->db_, "ROLLBACK;", nullptr, nullptr, nullptr);
+            }
+            if (!reader_) {
+                sqlite3_exec(db_->db_, "PRAGMA query_only = OFF;", nullptr, nullptr, nullptr);
+            }
+        }
+        if (reader_) {
+            owner_.ReturnReader(std::move(reader_));
+        }
+        db_ = nullptr;
+        began_ = false;
+        active_ = false;
+    }
+
+    bool ReadSnapshot::IsUser(const std::string& user_login) {
+        return active_ && db_->IsUser(user_login);
+    }
+
+    bool ReadSnapshot::IsAliveUser(const std::string& user_login) {
+        return active_ && db_->IsAliveUser(user_login);
+    }
+
+    std::optional<User> ReadSnapshot::GetUserData(const std::string& user_login) {
+        return active_ ? db_->GetUserData(user_login) : std::nullopt;
+    }
+
+    std::vector<std::optional<User>> ReadSnapshot::GetUsersData(const std::vector<std::string>& logins) {
+        return active_ ? db_->GetUsersData(logins) : std::vector<std::optional<User>>(logins.size());
+    }
+
+    std::vector<bool> ReadSnapshot::AreAliveUsers(const std::vector<std::string>& logins) {
+        return active_ ? db_->AreAliveUsers(logins) : std::vector<bool>(logins.size(), false);
+    }
+
+    std::vector<User> ReadSnapshot::GetAllUsers() {
+        return active_ ? db_->GetAllUsers() : std::vector<User>();
+    }
+
+    std::vector<User> ReadSnapshot::GetActiveUsers() {
+        return active_ ? db_->GetActiveUsers() : std::vector<User>();
+    }
+
+    std::vector<User> ReadSnapshot::GetDeletedUsers() {
+        return active_ ? db_->GetDeletedUsers() : std::vector<User>();
+    }
+
+    UserBatch ReadSnapshot::GetAllUsersBatch() {
+        return active_ ? db_->GetAllUsersBatch() : UserBatch();
+    }
+
+    UserBatch ReadSnapshot::GetActiveUsersBatch() {
+        return active_ ? db_->GetActiveUsersBatch() : UserBatch();
+    }
+
+    std::vector<std::string> ReadSnapshot::GetUserRooms(const std::string& user_login) {
+        return active_ ? db_->GetUserRooms(user_login) : std::vector<std::string>();
+    }
+
+    std::unordered_map<std::string, std::unordered_set<std::string>> ReadSnapshot::GetAllRoomWithRegisteredUsers() {
+        return active_ ? db_->GetAllRoomWithRegisteredUsers()
+                       : std::unordered_map<std::string, std::unordered_set<std::string>>();
+    }
+
+    bool ReadSnapshot::IsRoom(const std::string& room) {
+        return active_ && db_->IsRoom(room);
+    }
+
+    std::vector<std::string> ReadSnapshot::GetRooms() {
+        return active_ ? db_->GetRooms() : std::vector<std::string>();
+    }
+
+    std::vector<User> ReadSnapshot::GetRoomActiveUsers(const std::string& room) {
+        return active_ ? db_->GetRoomActiveUsers(room) : std::vector<User>();
+    }
+
+    std::vector<std::vector<User>> ReadSnapshot::GetRoomsActiveUsers(const std::vector<std::string>& rooms) {
+        return active_ ? db_->GetRoomsActiveUsers(rooms) : std::vector<std::vector<User>>(rooms.size());
+    }
+
+    std::vector<Message> ReadSnapshot::GetRangeMessagesRoom(const std::string& room, int64_t id_message_begin,
+                                                           int64_t id_message_end) {
+        return active_ ? db_->GetRangeMessagesRoom(room, id_message_begin, id_message_end) : std::vector<Message>();
+    }
+
+    MessageBatch ReadSnapshot::GetRangeMessagesRoomBatch(const std::string& room, int64_t id_message_begin,
+                                                         int64_t id_message_end) {
+        return active_ ? db_->GetRangeMessagesRoomBatch(room, id_message_begin, id_message_end) : MessageBatch();
+    }
+
+    int ReadSnapshot::GetCountRoomMessages(const std::string& room) {
+        return active_ ? db_->GetCountRoomMessages(room) : -1;
+    }
+
+    std::optional<RoomStats> ReadSnapshot::GetRoomStats(const std::string& room) {
+        return active_ ? db_->GetRoomStats(room) : std::nullopt;
+    }
+
+    std::vector<RoomStats> ReadSnapshot::GetAllRoomStats() {
+        return active_ ? db_->GetAllRoomStats() : std::vector<RoomStats>();
+    }
+
+    std::vector<RoomStats> ReadSnapshot::GetRoomStatsByActivity(int64_t limit) {
+        return active_ ? db_->GetRoomStatsByActivity(limit) : std::vector<RoomStats>();
+    }
+
+    std::vector<Message> ReadSnapshot::GetMessagesByTime(const std::string& room, int64_t t_begin_ns, int64_t t_end_ns,
+                                                        int64_t limit) {
+        return active_ ? db_->GetMessagesByTime(room, t_begin_ns, t_end_ns, limit) : std::vector<Message>();
+    }
+
+    std::vector<Message> ReadSnapshot::GetUserMessagesByTime(const std::string& user_login, int64_t t_begin_ns,
+                                                            int64_t t_end_ns, int64_t limit) {
+        return active_ ? db_->GetUserMessagesByTime(user_login, t_begin_ns, t_end_ns, limit) : std::vector<Message>();
+    }
+
+    std::optional<int64_t> ReadSnapshot::GetFirstMessageIdAtOrAfter(const std::string& room, int64_t t_ns) {
+        return active_ ? db_->GetFirstMessageIdAtOrAfter(room, t_ns) : std::nullopt;
+    }
+
+    std::vector<Attachment> ReadSnapshot::GetMessageAttachments(const std::string& room, int64_t id_message_in_room) {
+        return active_ ? db_->GetMessageAttachments(room, id_message_in_room) : std::vector<Attachment>();
+    }
+
+    std::vector<ChangeRecord> ReadSnapshot::GetChanges(int64_t after_position, int64_t limit) {
+        return active_ ? db_->GetChanges(after_position, limit) : std::vector<ChangeRecord>();
+    }
+
+    int64_t ReadSnapshot::GetChangeLogPosition() {
+        return active_ ? db_->GetChangeLogPosition() : 0;
+    }
+
+    std::optional<ExportStats> ReadSnapshot::ExportMessages(const std::function<bool(const char* data, size_t size)>& sink,
+                                                            const ExportOptions& options) {
+        return active_ ? db_->ExportMessages(sink, options) : std::nullopt;
+    }
+} // db
@@ -1,20 +1,117 @@
 #pragma once
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "db.hpp"
 
 namespace sql {
 
-    static const char* CHANGE_USER_NAME = R"sql(
+    // Число параметров '?' в тексте запроса без учета строковых литералов и комментариев.
+    // Нумерованные '?N' (один параметр в нескольких местах запроса) считаются по наибольшему номеру.
+    constexpr int CountParams(const char* sql) {
+        int count = 0;
+        int max_numbered = 0;
+        for (const char* p = sql; *p != '\0'; ++p) {
+            if (*p == '\'' || *p == '"') {
+                char quote = *p++;
+                while (*p != '\0' && *p != quote) {
+                    ++p;
+                }
+                if (*p == '\0') {
+                    break;
+                }
+            } else if (p[0] == '-' && p[1] == '-') {
+                while (*p != '\0' && *p != '\n') {
+                    ++p;
+                }
+                if (*p == '\0') {
+                    break;
+                }
+            } else if (p[0] == '/' && p[1] == '*') {
+                p += 2;
+                while (*p != '\0' && !(p[0] == '*' && p[1] == '/')) {
+                    ++p;
+                }
+                if (*p == '\0') {
+                    break;
+                }
+                ++p;
+            } else if (*p == '?' && p[1] >= '0' && p[1] <= '9') {
+                int number = 0;
+                while (p[1] >= '0' && p[1] <= '9') {
+                    number = number * 10 + (*++p - '0');
+                }
+                max_numbered = number > max_numbered ? number : max_numbered;
+            } else if (*p == '?') {
+                ++count;
+            }
+        }
+        return count > max_numbered ? count : max_numbered;
+    }
+
+    // Запрос с типом результата и параметров: Row(Args...).
+    // Несовпадение числа параметров с текстом запроса - ошибка компиляции (throw в constexpr-инициализации).
+    template <typename Signature>
+    struct QueryDef;
+
+    template <typename Row, typename... Args>
+    struct QueryDef<Row(Args...)> {
+        constexpr explicit QueryDef(const char* text) : sql(text) {
+            if (CountParams(text) != static_cast<int>(sizeof...(Args))) {
+                throw std::logic_error("SQL parameter count does not match QueryDef signature");
+            }
+        }
+
+        const char* sql;
+    };
+
+    static constexpr const char* GET_VERSION_DB = R"sql(
+        SELECT value FROM metadata WHERE key = 'schema_version';
+    )sql";
+
+    static constexpr const char* CREATE_ROOM = R"sql(
+        INSERT OR IGNORE INTO rooms (room, unixtime) VALUES (?, ?);
+    )sql";
+
+    static constexpr const char* DELETE_ROOM = R"sql(
+        DELETE FROM rooms WHERE room = ?;
+    )sql";
+
+    static constexpr const char* IS_ROOM = R"sql(
+        SELECT EXISTS (SELECT 1 FROM rooms WHERE room = ?);
+    )sql";
+
+    static constexpr const char* GET_ROOMS = R"sql(
+        SELECT room FROM rooms;
+    )sql";
+
+    static constexpr const char* SET_USER_FOR_DELETE = R"sql(
+        UPDATE users SET is_deleted = 1 WHERE login = ?;
+    )sql";
+
+    static constexpr const char* IS_USER = R"sql(
+        SELECT EXISTS (SELECT 1 FROM users WHERE login = ?);
+    )sql";
+
+    static constexpr const char* IS_ALIVE_USER = R"sql(
+        SELECT EXISTS (SELECT 1 FROM users WHERE login = ? AND is_deleted = false);
+    )sql";
+
+    static constexpr const char* CHANGE_USER_NAME = R"sql(
         UPDATE users
             SET name = ?
             WHERE login = ?;
     )sql";
 
-    static const char* CHANGE_ROOM_NAME = R"sql(
+    static constexpr const char* CHANGE_ROOM_NAME = R"sql(
         UPDATE rooms
             SET room = ?
             WHERE room = ?;
     )sql";
 
-    static const char* GET_USER_DATA = R"sql(
+    static constexpr const char* GET_USER_DATA = R"sql(
         SELECT 
             u.login, 
             u.name, 
@@ -27,7 +124,7 @@ namespace sql {
         WHERE u.login = ?;
     )sql";
 
-    static const char* GET_ALL_USERS = R"sql(
+    static constexpr const char* GET_ALL_USERS = R"sql(
         SELECT 
             u.login, 
             u.name, 
@@ -39,7 +136,7 @@ namespace sql {
         JOIN roles AS r ON u.roles_id = r.roles_id;
     )sql";
 
-    static const char* GET_ACTIVE_USERS = R"sql(
+    static constexpr const char* GET_ACTIVE_USERS = R"sql(
         SELECT 
             u.login, 
             u.name, 
@@ -52,7 +149,7 @@ namespace sql {
         WHERE u.is_deleted = false;
     )sql";
 
-    static const char* GET_DELETED_USERS = R"sql(
+    static constexpr const char* GET_DELETED_USERS = R"sql(
         SELECT 
             u.login, 
             u.name, 
@@ -62,10 +159,10 @@ namespace sql {
             u.unixtime 
         FROM users as u
         JOIN roles AS r ON u.roles_id = r.roles_id
-        WHERE u.is_deleted = true;
+        WHERE u.is_deleted = 1; -- совпадает с условием частичного индекса idx_users_deleted
     )sql";
 
-    static const char* GET_ROOM_ACTIVE_USERS = R"sql(
+    static constexpr const char* GET_ROOM_ACTIVE_USERS = R"sql(
     SELECT
         u.login,
         u.name,
@@ -81,7 +178,46 @@ namespace sql {
         AND u.is_deleted = 0;  --Только активные пользователи
     )sql";
 
-    static const char* GET_USER_ROOMS = R"sql(
+    // Пакетные запросы: параметр - JSON-массив строк, j.key - номер элемента для выравнивания результата по входу.
+    static constexpr const char* GET_USERS_DATA = R"sql(
+        SELECT
+            j.key,
+            u.login,
+            u.name,
+            u.password_hash,
+            r.role,
+            u.is_deleted,
+            u.unixtime
+        FROM json_each(?) AS j
+        JOIN users AS u ON u.login = j.value
+        JOIN roles AS r ON u.roles_id = r.roles_id;
+    )sql";
+
+    static constexpr const char* ARE_ALIVE_USERS = R"sql(
+        SELECT j.key
+        FROM json_each(?) AS j
+        JOIN users AS u ON u.login = j.value
+        WHERE u.is_deleted = 0;
+    )sql";
+
+    static constexpr const char* GET_ROOMS_ACTIVE_USERS = R"sql(
+        SELECT
+            j.key,
+            u.login,
+            u.name,
+            u.password_hash,
+            r.role,
+            u.is_deleted,
+            u.unixtime
+        FROM json_each(?) AS j
+        JOIN rooms AS rm       ON rm.room = j.value
+        JOIN user_rooms AS ur  ON ur.rooms_id = rm.rooms_id
+        JOIN users AS u        ON u.users_id = ur.users_id
+        JOIN roles AS r        ON u.roles_id = r.roles_id
+        WHERE u.is_deleted = 0;
+    )sql";
+
+    static constexpr const char* GET_USER_ROOMS = R"sql(
     SELECT
         r.room
         FROM rooms AS r
@@ -90,7 +226,7 @@ namespace sql {
         WHERE u.login = ?;
     )sql";
 
-    static const char* GET_ALL_PAIR_ROOMS_AND_USERS = R"sql(
+    static constexpr const char* GET_ALL_PAIR_ROOMS_AND_USERS = R"sql(
     SELECT
         r.room,
         u.login
@@ -99,12 +235,12 @@ namespace sql {
         JOIN users AS u ON ur.users_id = u.users_id;
     )sql";
 
-    static const char* CREATE_USER = R"sql(
+    static constexpr const char* CREATE_USER = R"sql(
         INSERT OR IGNORE INTO users(login, name, password_hash, roles_id, is_deleted, unixtime)
             VALUES(? , ? , ? , (SELECT roles_id FROM roles WHERE role = ? ), ?, ? );
     )sql";
 
-    static const char* DELETE_USER = R"sql(
+    static constexpr const char* DELETE_USER = R"sql(
         DELETE FROM users AS u
         WHERE u.login = ?
         AND NOT EXISTS (
@@ -114,7 +250,7 @@ namespace sql {
         );
     )sql";
 
-    static const char* DELETE_DELETED_USER_WITHOUT_ROOM = R"sql(
+    static constexpr const char* DELETE_DELETED_USER_WITHOUT_ROOM = R"sql(
         DELETE FROM users
             WHERE is_deleted = 1
             AND NOT EXISTS(
@@ -124,7 +260,7 @@ namespace sql {
             );
     )sql";
 
-    static const char* ROOM_USERS_SQL = R"sql(
+    static constexpr const char* ROOM_USERS_SQL = R"sql(
         SELECT
             u.login,
             u.name,
@@ -138,7 +274,7 @@ namespace sql {
         WHERE r.room = ?;
     )sql";
 
-    static const char* ADD_USER_TO_ROOM = R"sql(
+    static constexpr const char* ADD_USER_TO_ROOM = R"sql(
         INSERT OR IGNORE INTO user_rooms (users_id, rooms_id)
         VALUES (
             (SELECT users_id FROM users WHERE login = ?),
@@ -146,13 +282,13 @@ namespace sql {
         );
     )sql";
 
-    static const char* DELETE_USER_FROM_ROOM = R"sql(
+    static constexpr const char* DELETE_USER_FROM_ROOM = R"sql(
         DELETE FROM user_rooms
         WHERE users_id = (SELECT users_id FROM users WHERE login = ?)
             AND rooms_id = (SELECT rooms_id FROM rooms WHERE room = ?);
     )sql";
 
-    static const char* GET_RANGE_MESSAGES_ROOM = R"sql(
+    static constexpr const char* GET_RANGE_MESSAGES_ROOM = R"sql(
         SELECT 
             m.message,
             u.login       AS user_login,
@@ -168,14 +304,82 @@ namespace sql {
         ORDER BY m.id_message_in_room DESC;
     )sql";
 
-    static const char* GET_COUNT_ROOM_MESSAGES = R"sql(
-        SELECT COUNT(messages_id)
+    // счетчик из room_stats; для несуществующей комнаты 0, как у COUNT
+    static constexpr const char* GET_COUNT_ROOM_MESSAGES = R"sql(
+        SELECT COALESCE((
+            SELECT s.message_count
+            FROM room_stats AS s
+            JOIN rooms AS r   ON s.rooms_id = r.rooms_id
+            WHERE r.room = ?), 0);
+    )sql";
+
+    static constexpr const char* GET_ROOM_STATS = R"sql(
+        SELECT r.room, s.message_count, s.last_message_id, s.last_activity
+        FROM room_stats AS s
+        JOIN rooms AS r   ON s.rooms_id = r.rooms_id
+        WHERE r.room = ?;
+    )sql";
+
+    static constexpr const char* GET_ALL_ROOM_STATS = R"sql(
+        SELECT r.room, s.message_count, s.last_message_id, s.last_activity
+        FROM room_stats AS s
+        JOIN rooms AS r   ON s.rooms_id = r.rooms_id;
+    )sql";
+
+    // обход idx_room_stats_activity с начала, без сортировки
+    static constexpr const char* GET_ROOM_STATS_BY_ACTIVITY = R"sql(
+        SELECT r.room, s.message_count, s.last_message_id, s.last_activity
+        FROM room_stats AS s
+        JOIN rooms AS r   ON s.rooms_id = r.rooms_id
+        ORDER BY s.last_activity DESC
+        LIMIT ?;
+    )sql";
+
+    static constexpr const char* GET_MESSAGES_BY_TIME = R"sql(
+        SELECT 
+            m.message,
+            u.login       AS user_login,
+            r.room        AS room_name,
+            m.unixtime,
+            m.id_message_in_room
         FROM messages AS m
+        JOIN users AS u   ON m.users_id = u.users_id
         JOIN rooms AS r   ON m.rooms_id = r.rooms_id
-        WHERE r.room = ?;
+        WHERE r.room = ?
+          AND m.unixtime >= ?
+          AND m.unixtime <= ?
+        ORDER BY m.unixtime
+        LIMIT ?;
+    )sql";
+
+    static constexpr const char* GET_USER_MESSAGES_BY_TIME = R"sql(
+        SELECT 
+            m.message,
+            u.login       AS user_login,
+            r.room        AS room_name,
+            m.unixtime,
+            m.id_message_in_room
+        FROM messages AS m
+        JOIN users AS u   ON m.users_id = u.users_id
+        JOIN rooms AS r   ON m.rooms_id = r.rooms_id
+        WHERE u.login = ?
+          AND m.unixtime >= ?
+          AND m.unixtime <= ?
+        ORDER BY m.unixtime
+        LIMIT ?;
+    )sql";
+
+    static constexpr const char* GET_FIRST_MESSAGE_ID_AT_OR_AFTER = R"sql(
+        SELECT m.id_message_in_room
+        FROM messages AS m
+        JOIN rooms AS r   ON m.rooms_id = r.rooms_id
+        WHERE r.room = ?
+          AND m.unixtime >= ?
+        ORDER BY m.unixtime
+        LIMIT 1;
     )sql";
 
-    static const char* INSERT_MESSAGE_TO_DB = R"sql(
+    static constexpr const char* INSERT_MESSAGE_TO_DB = R"sql(
         INSERT INTO messages(
             message,
             unixtime,
@@ -193,7 +397,510 @@ namespace sql {
             );
     )sql";
 
-    static const char* INIT_SQL = R"sql(
+    // zeroblob резервирует место без выделения памяти; содержимое пишется через sqlite3_blob_write.
+    static constexpr const char* CREATE_ATTACHMENT = R"sql(
+        INSERT INTO attachments(messages_id, name, size, data)
+            VALUES(
+                (SELECT m.messages_id
+                 FROM messages AS m
+                 JOIN rooms AS r ON m.rooms_id = r.rooms_id
+                 WHERE r.room = ? AND m.id_message_in_room = ?),
+                ?, ?, zeroblob(?)
+            );
+    )sql";
+
+    // Порядок создания дает idx_attachments_message (messages_id, rowid); ORDER BY потребовал бы временной сортировки.
+    static constexpr const char* GET_MESSAGE_ATTACHMENTS = R"sql(
+        SELECT a.attachments_id, a.name, a.size
+        FROM attachments AS a
+        JOIN messages AS m ON a.messages_id = m.messages_id
+        JOIN rooms AS r    ON m.rooms_id = r.rooms_id
+        WHERE r.room = ?
+          AND m.id_message_in_room = ?;
+    )sql";
+
+    static constexpr const char* DELETE_ATTACHMENT = R"sql(
+        DELETE FROM attachments WHERE attachments_id = ?;
+    )sql";
+
+    // Лента изменений: триггеры пишут в change_log (INIT_SQL) в той же транзакции, что и само изменение.
+    // entity: 0 - messages, 1 - users, 2 - rooms, 3 - user_rooms; op: 0 - insert, 1 - update, 2 - delete.
+    static constexpr const char* CHANGE_FEED_SQL = R"sql(
+        CREATE TRIGGER IF NOT EXISTS trg_cdc_messages_insert AFTER INSERT ON messages BEGIN
+            INSERT INTO change_log(entity, op, row_id, room, login, id_message_in_room) VALUES (0, 0, NEW.messages_id,
+                (SELECT room FROM rooms WHERE rooms_id = NEW.rooms_id),
+                (SELECT login FROM users WHERE users_id = NEW.users_id), NEW.id_message_in_room);
+        END;
+        CREATE TRIGGER IF NOT EXISTS trg_cdc_messages_update AFTER UPDATE ON messages BEGIN
+            INSERT INTO change_log(entity, op, row_id, room, login, id_message_in_room) VALUES (0, 1, NEW.messages_id,
+                (SELECT room FROM rooms WHERE rooms_id = NEW.rooms_id),
+                (SELECT login FROM users WHERE users_id = NEW.users_id), NEW.id_message_in_room);
+        END;
+        CREATE TRIGGER IF NOT EXISTS trg_cdc_messages_delete AFTER DELETE ON messages BEGIN
+            INSERT INTO change_log(entity, op, row_id, room, login, id_message_in_room) VALUES (0, 2, OLD.messages_id,
+                (SELECT room FROM rooms WHERE rooms_id = OLD.rooms_id),
+                (SELECT login FROM users WHERE users_id = OLD.users_id), OLD.id_message_in_room);
+        END;
+
+        CREATE TRIGGER IF NOT EXISTS trg_cdc_users_insert AFTER INSERT ON users BEGIN
+            INSERT INTO change_log(entity, op, row_id, login) VALUES (1, 0, NEW.users_id, NEW.login);
+        END;
+        CREATE TRIGGER IF NOT EXISTS trg_cdc_users_update AFTER UPDATE ON users BEGIN
+            INSERT INTO change_log(entity, op, row_id, login) VALUES (1, 1, NEW.users_id, NEW.login);
+        END;
+        CREATE TRIGGER IF NOT EXISTS trg_cdc_users_delete AFTER DELETE ON users BEGIN
+            INSERT INTO change_log(entity, op, row_id, login) VALUES (1, 2, OLD.users_id, OLD.login);
+        END;
+
+        CREATE TRIGGER IF NOT EXISTS trg_cdc_rooms_insert AFTER INSERT ON rooms BEGIN
+            INSERT INTO change_log(entity, op, row_id, room) VALUES (2, 0, NEW.rooms_id, NEW.room);
+        END;
+        CREATE TRIGGER IF NOT EXISTS trg_cdc_rooms_update AFTER UPDATE ON rooms BEGIN
+            INSERT INTO change_log(entity, op, row_id, room) VALUES (2, 1, NEW.rooms_id, NEW.room);
+        END;
+        CREATE TRIGGER IF NOT EXISTS trg_cdc_rooms_delete AFTER DELETE ON rooms BEGIN
+            INSERT INTO change_log(entity, op, row_id, room) VALUES (2, 2, OLD.rooms_id, OLD.room);
+        END;
+
+        CREATE TRIGGER IF NOT EXISTS trg_cdc_user_rooms_insert AFTER INSERT ON user_rooms BEGIN
+            INSERT INTO change_log(entity, op, row_id, room, login) VALUES (3, 0, NEW.user_rooms_id,
+                (SELECT room FROM rooms WHERE rooms_id = NEW.rooms_id),
+                (SELECT login FROM users WHERE users_id = NEW.users_id));
+        END;
+        CREATE TRIGGER IF NOT EXISTS trg_cdc_user_rooms_delete AFTER DELETE ON user_rooms BEGIN
+            INSERT INTO change_log(entity, op, row_id, room, login) VALUES (3, 2, OLD.user_rooms_id,
+                (SELECT room FROM rooms WHERE rooms_id = OLD.rooms_id),
+                (SELECT login FROM users WHERE users_id = OLD.users_id));
+        END;
+    )sql";
+
+    static constexpr const char* GET_CHANGES = R"sql(
+        SELECT position, entity, op, row_id, room, login, id_message_in_room
+        FROM change_log
+        WHERE position > ?
+        ORDER BY position
+        LIMIT ?;
+    )sql";
+
+    static constexpr const char* GET_CHANGE_LOG_POSITION = R"sql(
+        SELECT COALESCE(MAX(position), 0) FROM change_log;
+    )sql";
+
+    static constexpr const char* TRIM_CHANGE_LOG = R"sql(
+        DELETE FROM change_log WHERE position <= ?;
+    )sql";
+
+    // Эфемерные комнаты (DBOptions::ephemeral_rooms): сообщения в БД в памяти eph, подключенной к тому же
+    // соединению. rooms_id и users_id - ключи основной БД; внешние ключи между БД невозможны, поэтому
+    // перенос в файл берет только строки с существующими пользователем и комнатой.
+    static constexpr const char* EPHEMERAL_INIT_SQL = R"sql(
+        CREATE TABLE IF NOT EXISTS eph.rooms (
+            rooms_id INTEGER PRIMARY KEY,
+            persist INTEGER NOT NULL,  -- 1 - переносится в файл снимками, 0 - удаляется по истечении ttl_ns
+            ttl_ns INTEGER NOT NULL
+        );
+        -- eph_id - порядок вставки: снимок переносит сообщения в файл в том же порядке
+        CREATE TABLE IF NOT EXISTS eph.messages (
+            eph_id INTEGER PRIMARY KEY,
+            message TEXT NOT NULL,
+            unixtime INTEGER NOT NULL,
+            users_id INTEGER NOT NULL,
+            rooms_id INTEGER NOT NULL,
+            date TEXT NOT NULL,
+            time TEXT NOT NULL,
+            id_message_in_room INTEGER NOT NULL
+        );
+        CREATE INDEX IF NOT EXISTS eph.idx_eph_room_number_message ON messages(rooms_id, id_message_in_room DESC);
+        CREATE INDEX IF NOT EXISTS eph.idx_eph_room_time ON messages(rooms_id, unixtime, id_message_in_room);
+        CREATE INDEX IF NOT EXISTS eph.idx_eph_user_time ON messages(users_id, unixtime);
+    )sql";
+
+    // Параметры: persist, ttl_ns, room. Для несуществующей комнаты строк не вставляет.
+    static constexpr const char* EPHEMERAL_SET_ROOM = R"sql(
+        INSERT INTO eph.rooms(rooms_id, persist, ttl_ns)
+            SELECT rooms_id, ?, ? FROM main.rooms WHERE room = ?
+        ON CONFLICT(rooms_id) DO UPDATE SET persist = excluded.persist, ttl_ns = excluded.ttl_ns;
+    )sql";
+
+    static constexpr const char* EPHEMERAL_DELETE_ROOM = R"sql(
+        DELETE FROM eph.rooms WHERE rooms_id = (SELECT rooms_id FROM main.rooms WHERE room = ?);
+    )sql";
+
+    static constexpr const char* EPHEMERAL_DELETE_ROOM_MESSAGES = R"sql(
+        DELETE FROM eph.messages WHERE rooms_id = (SELECT rooms_id FROM main.rooms WHERE room = ?);
+    )sql";
+
+    static constexpr const char* EPHEMERAL_INSERT_MESSAGE = R"sql(
+        INSERT INTO eph.messages(
+            message,
+            unixtime,
+            users_id,
+            rooms_id,
+            date,
+            time,
+            id_message_in_room
+        )
+            VALUES(
+                ?, ?,
+                (SELECT users_id FROM main.users WHERE login = ?),
+                (SELECT rooms_id FROM main.rooms WHERE room = ?),
+                ?, ?, ?
+            );
+    )sql";
+
+    // Все сообщения комнаты в файл: комната перестает быть эфемерной (SetRoomDurable).
+    static constexpr const char* EPHEMERAL_PERSIST_ROOM = R"sql(
+        INSERT INTO main.messages(message, unixtime, users_id, rooms_id, date, time, id_message_in_room)
+            SELECT m.message, m.unixtime, m.users_id, m.rooms_id, m.date, m.time, m.id_message_in_room
+            FROM eph.messages AS m
+            JOIN main.users AS u   ON m.users_id = u.users_id
+            JOIN main.rooms AS r   ON m.rooms_id = r.rooms_id
+            WHERE r.room = ?
+            ORDER BY m.id_message_in_room;
+    )sql";
+
+    // Наименьший и наибольший eph_id сообщений переносимых комнат (0, 0 - пусто): граница среза переноса и признак,
+    // что срез не последний. Строки комнат с ttl в окно не входят: их удаляет только EPHEMERAL_EXPIRE.
+    static constexpr const char* EPHEMERAL_ID_RANGE = R"sql(
+        SELECT COALESCE(MIN(m.eph_id), 0), COALESCE(MAX(m.eph_id), 0)
+        FROM eph.rooms AS t
+        JOIN eph.messages AS m   ON m.rooms_id = t.rooms_id
+        WHERE t.persist = 1;
+    )sql";
+
+    static constexpr const char* EPHEMERAL_PERSIST = R"sql(
+        INSERT INTO main.messages(message, unixtime, users_id, rooms_id, date, time, id_message_in_room)
+            SELECT m.message, m.unixtime, m.users_id, m.rooms_id, m.date, m.time, m.id_message_in_room
+            FROM eph.messages AS m
+            JOIN eph.rooms AS t    ON m.rooms_id = t.rooms_id
+            JOIN main.users AS u   ON m.users_id = u.users_id
+            JOIN main.rooms AS r   ON m.rooms_id = r.rooms_id
+            WHERE t.persist = 1
+              AND m.eph_id <= ?
+            ORDER BY m.eph_id;
+    )sql";
+
+    // вместе с перенесенными удаляются и строки удаленных пользователей и комнат, которые перенос пропустил
+    static constexpr const char* EPHEMERAL_DELETE_PERSISTED = R"sql(
+        DELETE FROM eph.messages
+        WHERE eph_id <= ?
+          AND rooms_id IN (SELECT rooms_id FROM eph.rooms WHERE persist = 1);
+    )sql";
+
+    // Параметр - текущее время, нс; возраст сообщения - по его unixtime.
+    static constexpr const char* EPHEMERAL_EXPIRE = R"sql(
+        DELETE FROM eph.messages
+        WHERE eph_id IN (
+            SELECT m.eph_id
+            FROM eph.rooms AS t
+            JOIN eph.messages AS m   ON m.rooms_id = t.rooms_id AND m.unixtime < ? - t.ttl_ns
+            WHERE t.persist = 0);
+    )sql";
+
+    static constexpr const char* EPHEMERAL_COUNT_MESSAGES = R"sql(
+        SELECT COUNT(*) FROM eph.messages;
+    )sql";
+
+    // Чтение эфемерной комнаты: файл и память одним запросом. Обе ветви идут по индексам в нужном порядке,
+    // UNION ALL с ORDER BY сливает их без сортировки (MERGE).
+    static constexpr const char* GET_RANGE_MESSAGES_ROOM_TIERED = R"sql(
+        SELECT 
+            m.message,
+            u.login       AS user_login,
+            r.room        AS room_name,
+            m.unixtime,
+            m.id_message_in_room
+        FROM main.messages AS m
+        JOIN main.users AS u   ON m.users_id = u.users_id
+        JOIN main.rooms AS r   ON m.rooms_id = r.rooms_id
+        WHERE r.room = ?1
+          AND m.id_message_in_room <= ?2
+          AND m.id_message_in_room >= ?3
+        UNION ALL
+        SELECT m.message, u.login, r.room, m.unixtime, m.id_message_in_room
+        FROM eph.messages AS m
+        JOIN main.users AS u   ON m.users_id = u.users_id
+        JOIN main.rooms AS r   ON m.rooms_id = r.rooms_id
+        WHERE r.room = ?1
+          AND m.id_message_in_room <= ?2
+          AND m.id_message_in_room >= ?3
+        ORDER BY 5 DESC;
+    )sql";
+
+    static constexpr const char* GET_MESSAGES_BY_TIME_TIERED = R"sql(
+        SELECT 
+            m.message,
+            u.login       AS user_login,
+            r.room        AS room_name,
+            m.unixtime,
+            m.id_message_in_room
+        FROM main.messages AS m
+        JOIN main.users AS u   ON m.users_id = u.users_id
+        JOIN main.rooms AS r   ON m.rooms_id = r.rooms_id
+        WHERE r.room = ?1
+          AND m.unixtime >= ?2
+          AND m.unixtime <= ?3
+        UNION ALL
+        SELECT m.message, u.login, r.room, m.unixtime, m.id_message_in_room
+        FROM eph.messages AS m
+        JOIN main.users AS u   ON m.users_id = u.users_id
+        JOIN main.rooms AS r   ON m.rooms_id = r.rooms_id
+        WHERE r.room = ?1
+          AND m.unixtime >= ?2
+          AND m.unixtime <= ?3
+        ORDER BY 4
+        LIMIT ?4;
+    )sql";
+
+    static constexpr const char* GET_USER_MESSAGES_BY_TIME_TIERED = R"sql(
+        SELECT 
+            m.message,
+            u.login       AS user_login,
+            r.room        AS room_name,
+            m.unixtime,
+            m.id_message_in_room
+        FROM main.messages AS m
+        JOIN main.users AS u   ON m.users_id = u.users_id
+        JOIN main.rooms AS r   ON m.rooms_id = r.rooms_id
+        WHERE u.login = ?1
+          AND m.unixtime >= ?2
+          AND m.unixtime <= ?3
+        UNION ALL
+        SELECT m.message, u.login, r.room, m.unixtime, m.id_message_in_room
+        FROM eph.messages AS m
+        JOIN main.users AS u   ON m.users_id = u.users_id
+        JOIN main.rooms AS r   ON m.rooms_id = r.rooms_id
+        WHERE u.login = ?1
+          AND m.unixtime >= ?2
+          AND m.unixtime <= ?3
+        ORDER BY 4
+        LIMIT ?4;
+    )sql";
+
+    static constexpr const char* GET_FIRST_MESSAGE_ID_AT_OR_AFTER_TIERED = R"sql(
+        SELECT id FROM (
+            SELECT m.id_message_in_room AS id, m.unixtime
+            FROM main.messages AS m
+            JOIN main.rooms AS r   ON m.rooms_id = r.rooms_id
+            WHERE r.room = ?1
+              AND m.unixtime >= ?2
+            UNION ALL
+            SELECT m.id_message_in_room, m.unixtime
+            FROM eph.messages AS m
+            JOIN main.rooms AS r   ON m.rooms_id = r.rooms_id
+            WHERE r.room = ?1
+              AND m.unixtime >= ?2
+            ORDER BY 2
+            LIMIT 1);
+    )sql";
+
+    static constexpr const char* GET_COUNT_ROOM_MESSAGES_TIERED = R"sql(
+        SELECT COALESCE((
+            SELECT s.message_count
+            FROM main.room_stats AS s
+            JOIN main.rooms AS r   ON s.rooms_id = r.rooms_id
+            WHERE r.room = ?1), 0)
+            + (SELECT COUNT(*) FROM eph.messages
+               WHERE rooms_id = (SELECT rooms_id FROM main.rooms WHERE room = ?1));
+    )sql";
+
+    // сводка room_stats плюс сообщения в памяти; last_message_id = -1 - сообщений нет нигде
+    static constexpr const char* GET_ROOM_STATS_TIERED = R"sql(
+        SELECT r.room,
+               s.message_count + (SELECT COUNT(*) FROM eph.messages AS e WHERE e.rooms_id = r.rooms_id),
+               MAX(COALESCE(s.last_message_id, -1),
+                   COALESCE((SELECT MAX(e.id_message_in_room) FROM eph.messages AS e WHERE e.rooms_id = r.rooms_id), -1)),
+               MAX(s.last_activity,
+                   COALESCE((SELECT MAX(e.unixtime) FROM eph.messages AS e WHERE e.rooms_id = r.rooms_id), s.last_activity))
+        FROM main.room_stats AS s
+        JOIN main.rooms AS r   ON s.rooms_id = r.rooms_id
+        WHERE r.room = ?;
+    )sql";
+
+    // Выгрузка (ExportMessages): сообщения в порядке вставки, без соединений - комнаты и логины через словари.
+    // Читается через Stmt, без typed: текст сообщения берется без копирования (GetColumnView).
+    static constexpr const char* EXPORT_MESSAGES = R"sql(
+        SELECT messages_id, rooms_id, users_id, id_message_in_room, unixtime, message
+        FROM messages
+        WHERE messages_id > ?
+        ORDER BY messages_id;
+    )sql";
+
+    static constexpr const char* EXPORT_ROOM_NAME = R"sql(
+        SELECT room FROM rooms WHERE rooms_id = ?;
+    )sql";
+
+    static constexpr const char* EXPORT_USER_LOGIN = R"sql(
+        SELECT login FROM users WHERE users_id = ?;
+    )sql";
+
+    // ReadSnapshot: BEGIN DEFERRED начинает читающую транзакцию только при первом чтении - снимок фиксируется сразу.
+    static constexpr const char* READ_SNAPSHOT_BEGIN = R"sql(
+        BEGIN;
+        SELECT 1 FROM sqlite_schema LIMIT 1;
+    )sql";
+
+    // Листовые страницы таблицы в логическом порядке (виртуальная таблица dbstat), для оценки фрагментации.
+    // Обслуживание, не рабочий путь: в ALL_QUERIES не входит.
+    static constexpr const char* TABLE_LEAF_PAGES = R"sql(
+        SELECT pageno FROM dbstat WHERE name = ? AND pagetype = 'leaf' ORDER BY path;
+    )sql";
+
+    // Прогрев кэша (DB::StartWarmup), не рабочий путь: в ALL_QUERIES не входит.
+    // Индексы таблицы и их первый столбец, для обхода индекса целиком. Частичные пропускаются: их обход требует условия индекса.
+    static constexpr const char* WARMUP_TABLE_INDEXES = R"sql(
+        SELECT il.name, ii.name
+        FROM pragma_index_list(?) AS il
+        JOIN pragma_index_info(il.name) AS ii   ON ii.seqno = 0
+        WHERE il.partial = 0;
+    )sql";
+
+    // Типизированные запросы рабочего пути (см. Query в stmt.hpp).
+    namespace typed {
+        static constexpr QueryDef<std::string()> GET_VERSION_DB{ sql::GET_VERSION_DB };
+        static constexpr QueryDef<void(std::string_view, int64_t)> CREATE_ROOM{ sql::CREATE_ROOM };
+        static constexpr QueryDef<void(std::string_view)> DELETE_ROOM{ sql::DELETE_ROOM };
+        static constexpr QueryDef<bool(std::string_view)> IS_ROOM{ sql::IS_ROOM };
+        static constexpr QueryDef<std::string()> GET_ROOMS{ sql::GET_ROOMS };
+        static constexpr QueryDef<void(std::string_view)> SET_USER_FOR_DELETE{ sql::SET_USER_FOR_DELETE };
+        static constexpr QueryDef<bool(std::string_view)> IS_USER{ sql::IS_USER };
+        static constexpr QueryDef<bool(std::string_view)> IS_ALIVE_USER{ sql::IS_ALIVE_USER };
+        static constexpr QueryDef<void(std::string_view, std::string_view)> CHANGE_USER_NAME{ sql::CHANGE_USER_NAME };
+        static constexpr QueryDef<void(std::string_view, std::string_view)> CHANGE_ROOM_NAME{ sql::CHANGE_ROOM_NAME };
+        static constexpr QueryDef<db::User(std::string_view)> GET_USER_DATA{ sql::GET_USER_DATA };
+        static constexpr QueryDef<db::User()> GET_ALL_USERS{ sql::GET_ALL_USERS };
+        static constexpr QueryDef<db::User()> GET_ACTIVE_USERS{ sql::GET_ACTIVE_USERS };
+        static constexpr QueryDef<db::User()> GET_DELETED_USERS{ sql::GET_DELETED_USERS };
+        static constexpr QueryDef<db::User(std::string_view)> GET_ROOM_ACTIVE_USERS{ sql::GET_ROOM_ACTIVE_USERS };
+        static constexpr QueryDef<std::pair<int64_t, db::User>(std::string_view)> GET_USERS_DATA{ sql::GET_USERS_DATA };
+        static constexpr QueryDef<int64_t(std::string_view)> ARE_ALIVE_USERS{ sql::ARE_ALIVE_USERS };
+        static constexpr QueryDef<std::pair<int64_t, db::User>(std::string_view)> GET_ROOMS_ACTIVE_USERS{ sql::GET_ROOMS_ACTIVE_USERS };
+        static constexpr QueryDef<std::string(std::string_view)> GET_USER_ROOMS{ sql::GET_USER_ROOMS };
+        static constexpr QueryDef<std::pair<std::string, std::string>()> GET_ALL_PAIR_ROOMS_AND_USERS{ sql::GET_ALL_PAIR_ROOMS_AND_USERS };
+        static constexpr QueryDef<void(std::string_view, std::string_view, std::string_view, std::string_view, bool, int64_t)>
+            CREATE_USER{ sql::CREATE_USER };
+        static constexpr QueryDef<void(std::string_view)> DELETE_USER{ sql::DELETE_USER };
+        static constexpr QueryDef<void()> DELETE_DELETED_USER_WITHOUT_ROOM{ sql::DELETE_DELETED_USER_WITHOUT_ROOM };
+        static constexpr QueryDef<void(std::string_view, std::string_view)> ADD_USER_TO_ROOM{ sql::ADD_USER_TO_ROOM };
+        static constexpr QueryDef<void(std::string_view, std::string_view)> DELETE_USER_FROM_ROOM{ sql::DELETE_USER_FROM_ROOM };
+        static constexpr QueryDef<db::Message(std::string_view, int64_t, int64_t)> GET_RANGE_MESSAGES_ROOM{ sql::GET_RANGE_MESSAGES_ROOM };
+        static constexpr QueryDef<int64_t(std::string_view)> GET_COUNT_ROOM_MESSAGES{ sql::GET_COUNT_ROOM_MESSAGES };
+        static constexpr QueryDef<db::RoomStats(std::string_view)> GET_ROOM_STATS{ sql::GET_ROOM_STATS };
+        static constexpr QueryDef<db::RoomStats()> GET_ALL_ROOM_STATS{ sql::GET_ALL_ROOM_STATS };
+        static constexpr QueryDef<db::RoomStats(int64_t)> GET_ROOM_STATS_BY_ACTIVITY{ sql::GET_ROOM_STATS_BY_ACTIVITY };
+        static constexpr QueryDef<db::Message(std::string_view, int64_t, int64_t, int64_t)>
+            GET_MESSAGES_BY_TIME{ sql::GET_MESSAGES_BY_TIME };
+        static constexpr QueryDef<db::Message(std::string_view, int64_t, int64_t, int64_t)>
+            GET_USER_MESSAGES_BY_TIME{ sql::GET_USER_MESSAGES_BY_TIME };
+        static constexpr QueryDef<int64_t(std::string_view, int64_t)>
+            GET_FIRST_MESSAGE_ID_AT_OR_AFTER{ sql::GET_FIRST_MESSAGE_ID_AT_OR_AFTER };
+        static constexpr QueryDef<void(std::string_view, int64_t, std::string_view, std::string_view,
+                                       std::string_view, std::string_view, int64_t)>
+            INSERT_MESSAGE_TO_DB{ sql::INSERT_MESSAGE_TO_DB };
+        static constexpr QueryDef<void(std::string_view, int64_t, std::string_view, int64_t, int64_t)>
+            CREATE_ATTACHMENT{ sql::CREATE_ATTACHMENT };
+        static constexpr QueryDef<db::Attachment(std::string_view, int64_t)> GET_MESSAGE_ATTACHMENTS{ sql::GET_MESSAGE_ATTACHMENTS };
+        static constexpr QueryDef<void(int64_t)> DELETE_ATTACHMENT{ sql::DELETE_ATTACHMENT };
+        static constexpr QueryDef<db::ChangeRecord(int64_t, int64_t)> GET_CHANGES{ sql::GET_CHANGES };
+        static constexpr QueryDef<int64_t()> GET_CHANGE_LOG_POSITION{ sql::GET_CHANGE_LOG_POSITION };
+        static constexpr QueryDef<void(int64_t)> TRIM_CHANGE_LOG{ sql::TRIM_CHANGE_LOG };
+        static constexpr QueryDef<void(bool, int64_t, std::string_view)> EPHEMERAL_SET_ROOM{ sql::EPHEMERAL_SET_ROOM };
+        static constexpr QueryDef<void(std::string_view)> EPHEMERAL_DELETE_ROOM{ sql::EPHEMERAL_DELETE_ROOM };
+        static constexpr QueryDef<void(std::string_view)> EPHEMERAL_DELETE_ROOM_MESSAGES{ sql::EPHEMERAL_DELETE_ROOM_MESSAGES };
+        static constexpr QueryDef<void(std::string_view, int64_t, std::string_view, std::string_view,
+                                       std::string_view, std::string_view, int64_t)>
+            EPHEMERAL_INSERT_MESSAGE{ sql::EPHEMERAL_INSERT_MESSAGE };
+        static constexpr QueryDef<void(std::string_view)> EPHEMERAL_PERSIST_ROOM{ sql::EPHEMERAL_PERSIST_ROOM };
+        static constexpr QueryDef<std::pair<int64_t, int64_t>()> EPHEMERAL_ID_RANGE{ sql::EPHEMERAL_ID_RANGE };
+        static constexpr QueryDef<void(int64_t)> EPHEMERAL_PERSIST{ sql::EPHEMERAL_PERSIST };
+        static constexpr QueryDef<void(int64_t)> EPHEMERAL_DELETE_PERSISTED{ sql::EPHEMERAL_DELETE_PERSISTED };
+        static constexpr QueryDef<void(int64_t)> EPHEMERAL_EXPIRE{ sql::EPHEMERAL_EXPIRE };
+        static constexpr QueryDef<int64_t()> EPHEMERAL_COUNT_MESSAGES{ sql::EPHEMERAL_COUNT_MESSAGES };
+        static constexpr QueryDef<db::Message(std::string_view, int64_t, int64_t)>
+            GET_RANGE_MESSAGES_ROOM_TIERED{ sql::GET_RANGE_MESSAGES_ROOM_TIERED };
+        static constexpr QueryDef<db::Message(std::string_view, int64_t, int64_t, int64_t)>
+            GET_MESSAGES_BY_TIME_TIERED{ sql::GET_MESSAGES_BY_TIME_TIERED };
+        static constexpr QueryDef<db::Message(std::string_view, int64_t, int64_t, int64_t)>
+            GET_USER_MESSAGES_BY_TIME_TIERED{ sql::GET_USER_MESSAGES_BY_TIME_TIERED };
+        static constexpr QueryDef<int64_t(std::string_view, int64_t)>
+            GET_FIRST_MESSAGE_ID_AT_OR_AFTER_TIERED{ sql::GET_FIRST_MESSAGE_ID_AT_OR_AFTER_TIERED };
+        static constexpr QueryDef<int64_t(std::string_view)> GET_COUNT_ROOM_MESSAGES_TIERED{ sql::GET_COUNT_ROOM_MESSAGES_TIERED };
+        static constexpr QueryDef<db::RoomStats(std::string_view)> GET_ROOM_STATS_TIERED{ sql::GET_ROOM_STATS_TIERED };
+        static constexpr QueryDef<std::string(int64_t)> EXPORT_ROOM_NAME{ sql::EXPORT_ROOM_NAME };
+        static constexpr QueryDef<std::string(int64_t)> EXPORT_USER_LOGIN{ sql::EXPORT_USER_LOGIN };
+    } // typed
+
+    struct NamedQuery {
+        const char* name;
+        const char* sql;
+    };
+
+    // Все запросы рабочего пути; по этому списку test/query_plan_test.cpp проверяет планы выполнения.
+    // Новый запрос нужно добавить сюда. Запросы к eph проверяются с подключенной EPHEMERAL_INIT_SQL.
+    static const NamedQuery ALL_QUERIES[] = {
+        { "GET_VERSION_DB", GET_VERSION_DB },
+        { "CREATE_ROOM", CREATE_ROOM },
+        { "DELETE_ROOM", DELETE_ROOM },
+        { "IS_ROOM", IS_ROOM },
+        { "GET_ROOMS", GET_ROOMS },
+        { "SET_USER_FOR_DELETE", SET_USER_FOR_DELETE },
+        { "IS_USER", IS_USER },
+        { "IS_ALIVE_USER", IS_ALIVE_USER },
+        { "CHANGE_USER_NAME", CHANGE_USER_NAME },
+        { "CHANGE_ROOM_NAME", CHANGE_ROOM_NAME },
+        { "GET_USER_DATA", GET_USER_DATA },
+        { "GET_ALL_USERS", GET_ALL_USERS },
+        { "GET_ACTIVE_USERS", GET_ACTIVE_USERS },
+        { "GET_DELETED_USERS", GET_DELETED_USERS },
+        { "GET_ROOM_ACTIVE_USERS", GET_ROOM_ACTIVE_USERS },
+        { "GET_USERS_DATA", GET_USERS_DATA },
+        { "ARE_ALIVE_USERS", ARE_ALIVE_USERS },
+        { "GET_ROOMS_ACTIVE_USERS", GET_ROOMS_ACTIVE_USERS },
+        { "GET_USER_ROOMS", GET_USER_ROOMS },
+        { "GET_ALL_PAIR_ROOMS_AND_USERS", GET_ALL_PAIR_ROOMS_AND_USERS },
+        { "CREATE_USER", CREATE_USER },
+        { "DELETE_USER", DELETE_USER },
+        { "DELETE_DELETED_USER_WITHOUT_ROOM", DELETE_DELETED_USER_WITHOUT_ROOM },
+        { "ROOM_USERS_SQL", ROOM_USERS_SQL },
+        { "ADD_USER_TO_ROOM", ADD_USER_TO_ROOM },
+        { "DELETE_USER_FROM_ROOM", DELETE_USER_FROM_ROOM },
+        { "GET_RANGE_MESSAGES_ROOM", GET_RANGE_MESSAGES_ROOM },
+        { "GET_COUNT_ROOM_MESSAGES", GET_COUNT_ROOM_MESSAGES },
+        { "GET_ROOM_STATS", GET_ROOM_STATS },
+        { "GET_ALL_ROOM_STATS", GET_ALL_ROOM_STATS },
+        { "GET_ROOM_STATS_BY_ACTIVITY", GET_ROOM_STATS_BY_ACTIVITY },
+        { "GET_MESSAGES_BY_TIME", GET_MESSAGES_BY_TIME },
+        { "GET_USER_MESSAGES_BY_TIME", GET_USER_MESSAGES_BY_TIME },
+        { "GET_FIRST_MESSAGE_ID_AT_OR_AFTER", GET_FIRST_MESSAGE_ID_AT_OR_AFTER },
+        { "INSERT_MESSAGE_TO_DB", INSERT_MESSAGE_TO_DB },
+        { "CREATE_ATTACHMENT", CREATE_ATTACHMENT },
+        { "GET_MESSAGE_ATTACHMENTS", GET_MESSAGE_ATTACHMENTS },
+        { "DELETE_ATTACHMENT", DELETE_ATTACHMENT },
+        { "GET_CHANGES", GET_CHANGES },
+        { "GET_CHANGE_LOG_POSITION", GET_CHANGE_LOG_POSITION },
+        { "TRIM_CHANGE_LOG", TRIM_CHANGE_LOG },
+        { "EPHEMERAL_SET_ROOM", EPHEMERAL_SET_ROOM },
+        { "EPHEMERAL_DELETE_ROOM", EPHEMERAL_DELETE_ROOM },
+        { "EPHEMERAL_DELETE_ROOM_MESSAGES", EPHEMERAL_DELETE_ROOM_MESSAGES },
+        { "EPHEMERAL_INSERT_MESSAGE", EPHEMERAL_INSERT_MESSAGE },
+        { "EPHEMERAL_PERSIST_ROOM", EPHEMERAL_PERSIST_ROOM },
+        { "EPHEMERAL_ID_RANGE", EPHEMERAL_ID_RANGE },
+        { "EPHEMERAL_PERSIST", EPHEMERAL_PERSIST },
+        { "EPHEMERAL_DELETE_PERSISTED", EPHEMERAL_DELETE_PERSISTED },
+        { "EPHEMERAL_EXPIRE", EPHEMERAL_EXPIRE },
+        { "EPHEMERAL_COUNT_MESSAGES", EPHEMERAL_COUNT_MESSAGES },
+        { "GET_RANGE_MESSAGES_ROOM_TIERED", GET_RANGE_MESSAGES_ROOM_TIERED },
+        { "GET_MESSAGES_BY_TIME_TIERED", GET_MESSAGES_BY_TIME_TIERED },
+        { "GET_USER_MESSAGES_BY_TIME_TIERED", GET_USER_MESSAGES_BY_TIME_TIERED },
+        { "GET_FIRST_MESSAGE_ID_AT_OR_AFTER_TIERED", GET_FIRST_MESSAGE_ID_AT_OR_AFTER_TIERED },
+        { "GET_COUNT_ROOM_MESSAGES_TIERED", GET_COUNT_ROOM_MESSAGES_TIERED },
+        { "GET_ROOM_STATS_TIERED", GET_ROOM_STATS_TIERED },
+        { "EXPORT_MESSAGES", EXPORT_MESSAGES },
+        { "EXPORT_ROOM_NAME", EXPORT_ROOM_NAME },
+        { "EXPORT_USER_LOGIN", EXPORT_USER_LOGIN },
+    };
+
+    static constexpr const char* INIT_SQL = R"sql(
         CREATE TABLE IF NOT EXISTS metadata (
             key TEXT PRIMARY KEY, 
             value TEXT
@@ -223,6 +930,8 @@ namespace sql {
             unixtime INTEGER NOT NULL
         );
         CREATE INDEX IF NOT EXISTS idx_users_login ON users(login);
+        -- помеченных на удаление мало: частичный индекс вместо полного просмотра users при очистке
+        CREATE INDEX IF NOT EXISTS idx_users_deleted ON users(users_id) WHERE is_deleted = 1;
 
         CREATE TABLE IF NOT EXISTS messages (
             messages_id INTEGER PRIMARY KEY AUTOINCREMENT,
@@ -236,6 +945,10 @@ namespace sql {
         );
         CREATE INDEX IF NOT EXISTS idx_messages_room_user ON messages(rooms_id, users_id);
         CREATE INDEX IF NOT EXISTS idx_room_number_message ON messages(rooms_id, id_message_in_room DESC);
+        -- выборка по времени; id_message_in_room в индексе делает перевод времени в номер сообщения покрывающим
+        CREATE INDEX IF NOT EXISTS idx_messages_room_time ON messages(rooms_id, unixtime, id_message_in_room);
+        -- история пользователя по времени; заодно проверка внешнего ключа при удалении пользователя
+        CREATE INDEX IF NOT EXISTS idx_messages_user_time ON messages(users_id, unixtime);
         
         CREATE TABLE IF NOT EXISTS user_rooms (
             user_rooms_id INTEGER PRIMARY KEY AUTOINCREMENT,
@@ -243,6 +956,71 @@ namespace sql {
             rooms_id INTEGER NOT NULL REFERENCES rooms(rooms_id) ON DELETE CASCADE,
             UNIQUE(users_id, rooms_id)
         );
+        -- состав комнаты и каскадное удаление по rooms_id: UNIQUE(users_id, rooms_id) по rooms_id не ищет
+        CREATE INDEX IF NOT EXISTS idx_user_rooms_room_user ON user_rooms(rooms_id, users_id);
+
+        -- data последним столбцом: name и size читаются без обхода страниц переполнения с содержимым
+        CREATE TABLE IF NOT EXISTS attachments (
+            attachments_id INTEGER PRIMARY KEY AUTOINCREMENT,
+            messages_id INTEGER NOT NULL REFERENCES messages(messages_id) ON DELETE CASCADE,
+            name TEXT NOT NULL,
+            size INTEGER NOT NULL,
+            data BLOB NOT NULL
+        );
+        CREATE INDEX IF NOT EXISTS idx_attachments_message ON attachments(messages_id);
+
+        -- Журнал ленты изменений; пишут в него триггеры CHANGE_FEED_SQL (EnableChangeFeed), без них он пуст.
+        CREATE TABLE IF NOT EXISTS change_log (
+            position INTEGER PRIMARY KEY AUTOINCREMENT,
+            entity INTEGER NOT NULL,
+            op INTEGER NOT NULL,
+            row_id INTEGER NOT NULL,
+            room TEXT,
+            login TEXT,
+            id_message_in_room INTEGER
+        );
+
+        -- Сводка по комнате, ведется триггерами в транзакции записи сообщения.
+        -- last_message_id - наибольший id_message_in_room (NULL - сообщений нет),
+        -- last_activity - время последнего сообщения или создания комнаты; удаление сообщений его не уменьшает.
+        CREATE TABLE IF NOT EXISTS room_stats (
+            rooms_id INTEGER PRIMARY KEY REFERENCES rooms(rooms_id) ON DELETE CASCADE,
+            message_count INTEGER NOT NULL DEFAULT 0,
+            last_message_id INTEGER,
+            last_activity INTEGER NOT NULL
+        );
+        CREATE INDEX IF NOT EXISTS idx_room_stats_activity ON room_stats(last_activity DESC);
+
+        CREATE TRIGGER IF NOT EXISTS trg_room_stats_room_insert AFTER INSERT ON rooms BEGIN
+            INSERT OR IGNORE INTO room_stats(rooms_id, message_count, last_message_id, last_activity)
+                VALUES (NEW.rooms_id, 0, NULL, NEW.unixtime);
+        END;
+        CREATE TRIGGER IF NOT EXISTS trg_room_stats_message_insert AFTER INSERT ON messages BEGIN
+            UPDATE room_stats SET
+                message_count = message_count + 1,
+                last_message_id = CASE WHEN last_message_id IS NULL OR NEW.id_message_in_room > last_message_id
+                                       THEN NEW.id_message_in_room ELSE last_message_id END,
+                last_activity = MAX(last_activity, NEW.unixtime)
+            WHERE rooms_id = NEW.rooms_id;
+        END;
+        -- пересчет по idx_room_number_message только при удалении последнего сообщения
+        CREATE TRIGGER IF NOT EXISTS trg_room_stats_message_delete AFTER DELETE ON messages BEGIN
+            UPDATE room_stats SET
+                message_count = message_count - 1,
+                last_message_id = CASE WHEN OLD.id_message_in_room = last_message_id
+                                       THEN (SELECT MAX(id_message_in_room) FROM messages WHERE rooms_id = OLD.rooms_id)
+                                       ELSE last_message_id END
+            WHERE rooms_id = OLD.rooms_id;
+        END;
+
+        -- файлы, созданные до room_stats: сводка строится один раз для комнат без строки
+        INSERT INTO room_stats(rooms_id, message_count, last_message_id, last_activity)
+            SELECT r.rooms_id,
+                   (SELECT COUNT(*) FROM messages WHERE rooms_id = r.rooms_id),
+                   (SELECT MAX(id_message_in_room) FROM messages WHERE rooms_id = r.rooms_id),
+                   MAX(r.unixtime, COALESCE((SELECT MAX(unixtime) FROM messages WHERE rooms_id = r.rooms_id), r.unixtime))
+            FROM rooms AS r
+            WHERE NOT EXISTS (SELECT 1 FROM room_stats WHERE rooms_id = r.rooms_id);
     )sql";
 
 } // sql
\ No newline at end of file
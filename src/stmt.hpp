@@ -1,6 +1,14 @@
 #pragma once
+#include <optional>
 #include <sqlite3.h>
 #include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "db.hpp"
+#include "sql_queries.hpp"
 
 class Stmt {
 public:
@@ -30,8 +38,13 @@ public:
         return *this;
     }
 
-    void Bind(int index, std::string param) {
-        sqlite3_bind_text(stmt_, index, param.c_str(), -1, SQLITE_TRANSIENT);
+    void Bind(int index, const std::string& param) {
+        sqlite3_bind_text(stmt_, index, param.c_str(), static_cast<int>(param.size()), SQLITE_TRANSIENT);
+    }
+
+    // Без копирования: строка должна жить до окончания шагов по запросу.
+    void BindStatic(int index, std::string_view param) {
+        sqlite3_bind_text(stmt_, index, param.data(), static_cast<int>(param.size()), SQLITE_STATIC);
     }
 
     void Bind(int index, bool value) {
@@ -42,9 +55,23 @@ public:
         sqlite3_bind_int64(stmt_, index, value);
     }
 
+    void BindStatic(int index, bool value) {
+        Bind(index, value);
+    }
+
+    void BindStatic(int index, int64_t value) {
+        Bind(index, value);
+    }
+
     std::string GetColumnText(int col) {
         const char* text = reinterpret_cast<const char*>(sqlite3_column_text(stmt_, col));
-        return text ? text : "";
+        return text ? std::string(text, sqlite3_column_bytes(stmt_, col)) : std::string();
+    }
+
+    // Представление действительно до следующего шага по запросу.
+    std::string_view GetColumnView(int col) {
+        const char* text = reinterpret_cast<const char*>(sqlite3_column_text(stmt_, col));
+        return text ? std::string_view(text, sqlite3_column_bytes(stmt_, col)) : std::string_view();
     }
 
     sqlite3_stmt* Get() const {
@@ -54,3 +81,210 @@ public:
 private:
     sqlite3_stmt* stmt_ = nullptr;
 };
+
+// Потоковый доступ к значению BLOB (sqlite3_blob_*): чтение и запись частями без загрузки значения в память.
+// Открытый Blob считается активным запросом: закрыть до COMMIT/RELEASE своей транзакции.
+class Blob {
+public:
+    Blob(sqlite3* db, const char* table, const char* column, int64_t rowid, bool writable) {
+        rc_ = sqlite3_blob_open(db, "main", table, column, rowid, writable ? 1 : 0, &blob_);
+    }
+
+    ~Blob() {
+        if (blob_)
+            sqlite3_blob_close(blob_);
+    }
+
+    Blob(const Blob&) = delete;
+    Blob& operator=(const Blob&) = delete;
+
+    bool IsOpen() const {
+        return blob_ != nullptr;
+    }
+
+    int64_t Size() const {
+        return blob_ ? sqlite3_blob_bytes(blob_) : 0;
+    }
+
+    bool Read(char* buffer, int size, int offset) {
+        rc_ = sqlite3_blob_read(blob_, buffer, size, offset);
+        return rc_ == SQLITE_OK;
+    }
+
+    bool Write(const char* data, int size, int offset) {
+        rc_ = sqlite3_blob_write(blob_, data, size, offset);
+        return rc_ == SQLITE_OK;
+    }
+
+    int Rc() const {
+        return rc_;
+    }
+
+private:
+    sqlite3_blob* blob_ = nullptr;
+    int rc_ = SQLITE_OK;
+};
+
+// Чтение строки результата в тип Row: порядок столбцов задается запросом.
+template <typename Row>
+struct RowReader;
+
+template <>
+struct RowReader<std::string> {
+    static std::string Read(Stmt& stmt) {
+        return stmt.GetColumnText(0);
+    }
+};
+
+template <>
+struct RowReader<int64_t> {
+    static int64_t Read(Stmt& stmt) {
+        return sqlite3_column_int64(stmt.Get(), 0);
+    }
+};
+
+template <>
+struct RowReader<bool> {
+    static bool Read(Stmt& stmt) {
+        return sqlite3_column_int(stmt.Get(), 0) != 0;
+    }
+};
+
+template <>
+struct RowReader<std::pair<std::string, std::string>> {
+    static std::pair<std::string, std::string> Read(Stmt& stmt) {
+        return { stmt.GetColumnText(0), stmt.GetColumnText(1) };
+    }
+};
+
+template <>
+struct RowReader<std::pair<int64_t, int64_t>> {
+    static std::pair<int64_t, int64_t> Read(Stmt& stmt) {
+        return { sqlite3_column_int64(stmt.Get(), 0), sqlite3_column_int64(stmt.Get(), 1) };
+    }
+};
+
+// login, name, password_hash, role, is_deleted, unixtime; first - номер столбца login
+template <>
+struct RowReader<db::User> {
+    static db::User Read(Stmt& stmt, int first = 0) {
+        return db::User{ stmt.GetColumnText(first), stmt.GetColumnText(first + 1), stmt.GetColumnText(first + 2),
+                         stmt.GetColumnText(first + 3), sqlite3_column_int(stmt.Get(), first + 4) != 0,
+                         sqlite3_column_int64(stmt.Get(), first + 5) };
+    }
+};
+
+// Результат пакетного запроса: номер входного значения (json_each.key), затем столбцы User.
+template <>
+struct RowReader<std::pair<int64_t, db::User>> {
+    static std::pair<int64_t, db::User> Read(Stmt& stmt) {
+        return { sqlite3_column_int64(stmt.Get(), 0), RowReader<db::User>::Read(stmt, 1) };
+    }
+};
+
+// message, user_login, room, unixtime, id_message_in_room
+template <>
+struct RowReader<db::Message> {
+    static db::Message Read(Stmt& stmt) {
+        std::string message = stmt.GetColumnText(0);
+        std::string login = stmt.GetColumnText(1);
+        std::string room = stmt.GetColumnText(2);
+        return db::Message{ std::move(message), sqlite3_column_int64(stmt.Get(), 3),
+                            std::move(login), std::move(room), sqlite3_column_int64(stmt.Get(), 4) };
+    }
+};
+
+// position, entity, op, row_id, room, login, id_message_in_room
+template <>
+struct RowReader<db::ChangeRecord> {
+    static db::ChangeRecord Read(Stmt& stmt) {
+        return db::ChangeRecord{ sqlite3_column_int64(stmt.Get(), 0),
+                                 static_cast<db::ChangeEntity>(sqlite3_column_int(stmt.Get(), 1)),
+                                 static_cast<db::ChangeOp>(sqlite3_column_int(stmt.Get(), 2)),
+                                 sqlite3_column_int64(stmt.Get(), 3),
+                                 stmt.GetColumnText(4), stmt.GetColumnText(5),
+                                 sqlite3_column_int64(stmt.Get(), 6) };
+    }
+};
+
+// room, message_count, last_message_id, last_activity
+template <>
+struct RowReader<db::RoomStats> {
+    static db::RoomStats Read(Stmt& stmt) {
+        int64_t last_message_id = sqlite3_column_type(stmt.Get(), 2) == SQLITE_NULL ? -1 : sqlite3_column_int64(stmt.Get(), 2);
+        return db::RoomStats{ stmt.GetColumnText(0), sqlite3_column_int64(stmt.Get(), 1), last_message_id,
+                              sqlite3_column_int64(stmt.Get(), 3) };
+    }
+};
+
+// attachments_id, name, size
+template <>
+struct RowReader<db::Attachment> {
+    static db::Attachment Read(Stmt& stmt) {
+        return db::Attachment{ sqlite3_column_int64(stmt.Get(), 0), stmt.GetColumnText(1), sqlite3_column_int64(stmt.Get(), 2) };
+    }
+};
+
+// Типизированная обертка над Stmt для sql::QueryDef<Row(Args...)>.
+// Аргументы привязываются без копирования (SQLITE_STATIC): вызывающий держит их до One/All/Exec.
+template <typename Signature>
+class Query;
+
+template <typename Row, typename... Args>
+class Query<Row(Args...)> {
+public:
+    Query(sqlite3* db, const sql::QueryDef<Row(Args...)>& def) : stmt_(db, def.sql) {}
+
+    Query& Bind(Args... args) {
+        int index = 1;
+        (stmt_.BindStatic(index++, args), ...);
+        return *this;
+    }
+
+    // Первая строка результата; nullopt, если строк нет или произошла ошибка (см. Rc).
+    // Методы чтения - шаблоны, чтобы Query<void(...)> инстанцировался без optional<void>.
+    template <typename R = Row>
+    std::optional<R> One() {
+        rc_ = sqlite3_step(stmt_.Get());
+        if (rc_ != SQLITE_ROW) {
+            return std::nullopt;
+        }
+        return RowReader<R>::Read(stmt_);
+    }
+
+    // Все строки результата; при ошибке возвращает прочитанное до нее, Rc() != SQLITE_DONE.
+    template <typename R = Row>
+    std::vector<R> All() {
+        std::vector<R> rows;
+        ForEach([&rows](R&& row) { rows.push_back(std::move(row)); });
+        return rows;
+    }
+
+    template <typename Fn>
+    void ForEach(Fn&& fn) {
+        while ((rc_ = sqlite3_step(stmt_.Get())) == SQLITE_ROW) {
+            fn(RowReader<Row>::Read(stmt_));
+        }
+    }
+
+    // Без материализации Row: fn получает Stmt текущей строки (см. Stmt::GetColumnView).
+    template <typename Fn>
+    void ForEachRow(Fn&& fn) {
+        while ((rc_ = sqlite3_step(stmt_.Get())) == SQLITE_ROW) {
+            fn(stmt_);
+        }
+    }
+
+    bool Exec() {
+        rc_ = sqlite3_step(stmt_.Get());
+        return rc_ == SQLITE_DONE;
+    }
+
+    int Rc() const {
+        return rc_;
+    }
+
+private:
+    Stmt stmt_;
+    int rc_ = SQLITE_OK;
+};
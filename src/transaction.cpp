@@ -0,0 +1,125 @@
+#include <sqlite3.h>
+
+#include "db.hpp"
+#include "io_vfs.hpp"
+#include "logger.hpp"
+#include "transaction.hpp"
+
+namespace db {
+    namespace {
+        bool Exec(sqlite3* db, const std::string& sql, const char* method) {
+            int rc = sqlite3_exec(db, sql.c_str(), nullptr, nullptr, nullptr);
+            if (rc != SQLITE_OK) {
+                DB_LOG_ERROR(method, rc, {}, {}, sqlite3_errmsg(db));
+                return false;
+            }
+            return true;
+        }
+    } // namespace
+
+    // Имена точек сохранения по глубине вложенности: объекты RAII закрываются в обратном порядке.
+    std::string DB::PushSavepoint() {
+        return "sp" + std::to_string(++savepoint_depth_);
+    }
+
+    void DB::PopSavepoint() {
+        --savepoint_depth_;
+    }
+
+    bool DB::InTransaction() const {
+        return db_ && sqlite3_get_autocommit(db_) == 0;
+    }
+
+    Transaction::Transaction(DB& db) : db_(db) {
+        if (!db_.InTransaction()) {
+            active_ = Exec(db_.db_, "BEGIN IMMEDIATE;", "Transaction");
+            return;
+        }
+        savepoint_ = db_.PushSavepoint();
+        active_ = Exec(db_.db_, "SAVEPOINT " + savepoint_ + ";", "Transaction");
+        if (!active_) {
+            db_.PopSavepoint();
+        }
+    }
+
+    Transaction::~Transaction() {
+        if (active_) {
+            Rollback();
+        }
+    }
+
+    bool Transaction::Commit() {
+        if (!active_) {
+            return false;
+        }
+        if (!savepoint_.empty()) {
+            if (!Exec(db_.db_, "RELEASE " + savepoint_ + ";", "Transaction::Commit")) {
+                return false;
+            }
+            active_ = false;
+            db_.PopSavepoint();
+            return true;
+        }
+        // запись WAL и sync - при фиксации; внутри метода DB учитываются в нем
+        io::Scope io_scope(db_.io_.get(), "Transaction::Commit");
+        // при ошибке COMMIT транзакция остается открытой и откатывается деструктором
+        if (!Exec(db_.db_, "COMMIT;", "Transaction::Commit")) {
+            return false;
+        }
+        active_ = false;
+        db_.DispatchChanges();
+        return true;
+    }
+
+    // Ошибки отката не журналируются: после SQLITE_FULL, SQLITE_IOERR и т.п. SQLite мог уже откатить транзакцию сам.
+    void Transaction::Rollback() {
+        if (!active_) {
+            return;
+        }
+        active_ = false;
+        if (!savepoint_.empty()) {
+            std::string sql = "ROLLBACK TO " + savepoint_ + "; RELEASE " + savepoint_ + ";";
+            sqlite3_exec(db_.db_, sql.c_str(), nullptr, nullptr, nullptr);
+            db_.PopSavepoint();
+            return;
+        }
+        sqlite3_exec(db_.db_, "ROLLBACK;", nullptr, nullptr, nullptr);
+    }
+
+    Savepoint::Savepoint(DB& db) : db_(db), name_(db.PushSavepoint()) {
+        active_ = Exec(db_.db_, "SAVEPOINT " + name_ + ";", "Savepoint");
+        if (!active_) {
+            db_.PopSavepoint();
+        }
+    }
+
+    Savepoint::~Savepoint() {
+        if (active_) {
+            Rollback();
+        }
+    }
+
+    bool Savepoint::Release() {
+        if (!active_) {
+            return false;
+        }
+        if (!Exec(db_.db_, "RELEASE " + name_ + ";", "Savepoint::Release")) {
+            return false;
+        }
+        active_ = false;
+        db_.PopSavepoint();
+        // внешний SAVEPOINT сам был транзакцией: RELEASE ее фиксирует
+        db_.DispatchChanges();
+        return true;
+    }
+
+    void Savepoint::Rollback() {
+        if (!active_) {
+            return;
+        }
+        active_ = false;
+        std::string sql = "ROLLBACK TO " + name_ + "; RELEASE " + name_ + ";";
+        sqlite3_exec(db_.db_, sql.c_str(), nullptr, nullptr, nullptr);
+        db_.PopSavepoint();
+    }
+} // db
@@ -0,0 +1,167 @@
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "db.hpp"
+#include "logger.hpp"
+#include "sql_queries.hpp"
+#include "stmt.hpp"
+#include "warmup.hpp"
+
+namespace db {
+    namespace {
+        // Порядок прогрева: справочники, которые читает почти каждый запрос, затем их индексы.
+        constexpr const char* kWarmupTables[] = { "users", "rooms" };
+    } // namespace
+
+    WarmupTask::WarmupTask(const std::string& db_file, const WarmupOptions& options, int64_t mmap_size)
+        : db_file_(db_file), options_(options), mmap_size_(mmap_size) {}
+
+    WarmupTask::~WarmupTask() {
+        stop_ = true;
+        if (conn_) {
+            // прерывает выполняемый шаг; следующий не начнется по stop_
+            sqlite3_interrupt(conn_);
+        }
+        if (worker_.joinable()) {
+            worker_.join();
+        }
+        if (conn_) {
+            sqlite3_close(conn_);
+        }
+    }
+
+    bool WarmupTask::Start() {
+        if (sqlite3_open_v2(db_file_.c_str(), &conn_, SQLITE_OPEN_READONLY, nullptr) != SQLITE_OK) {
+            DB_LOG_ERROR("StartWarmup", sqlite3_errcode(conn_), {}, {}, sqlite3_errmsg(conn_));
+            return false;
+        }
+        // страницы читаются так же, как их прочитает рабочее подключение: через mmap или read()
+        if (mmap_size_ > 0) {
+            std::string pragma = "PRAGMA mmap_size = " + std::to_string(mmap_size_) + ";";
+            sqlite3_exec(conn_, pragma.c_str(), nullptr, nullptr, nullptr);
+        }
+        running_ = true;
+        worker_ = std::thread(&WarmupTask::Run, this);
+        return true;
+    }
+
+    WarmupProgress WarmupTask::Progress() const {
+        return { running_.load(), done_.load(), steps_done_.load(), steps_total_.load(), rows_.load() };
+    }
+
+    void WarmupTask::Step() {
+        ++steps_done_;
+        if (options_.on_progress) {
+            options_.on_progress(Progress());
+        }
+    }
+
+    bool WarmupTask::ScanAll(const std::string& sql) {
+        if (stop_) {
+            return false;
+        }
+        Stmt stmt(conn_, sql.c_str());
+        int rc;
+        int64_t rows = 0;
+        while ((rc = sqlite3_step(stmt.Get())) == SQLITE_ROW) {
+            ++rows;
+        }
+        rows_ += rows;
+        return rc == SQLITE_DONE;
+    }
+
+    // Хвост idx_room_number_message и строки сообщений, как их читает GetRangeMessagesRoom.
+    bool WarmupTask::ScanRoomTail(const RoomStats& room) {
+        if (stop_) {
+            return false;
+        }
+        int64_t rows = 0;
+        Query<Message(std::string_view, int64_t, int64_t)> query(conn_, sql::typed::GET_RANGE_MESSAGES_ROOM);
+        query.Bind(room.room, room.last_message_id, room.last_message_id - options_.tail_messages + 1)
+            .ForEachRow([&rows](Stmt&) { ++rows; });
+        rows_ += rows;
+        return query.Rc() == SQLITE_DONE;
+    }
+
+    std::vector<std::string> WarmupTask::ListScans() {
+        std::vector<std::string> scans;
+        for (const char* table : kWarmupTables) {
+            scans.push_back(std::string("SELECT * FROM ") + table + ";");
+            Stmt stmt(conn_, sql::WARMUP_TABLE_INDEXES);
+            stmt.BindStatic(1, std::string_view(table));
+            while (sqlite3_step(stmt.Get()) == SQLITE_ROW) {
+                std::string index = stmt.GetColumnText(0);
+                std::string column = stmt.GetColumnText(1);
+                scans.push_back("SELECT \"" + column + "\" FROM " + table + " INDEXED BY \"" + index +
+                                "\" ORDER BY \"" + column + "\";");
+            }
+        }
+        return scans;
+    }
+
+    void WarmupTask::Run() {
+        bool ok = true;
+        try {
+            std::vector<std::string> scans = ListScans();
+            Query<RoomStats(int64_t)> hot(conn_, sql::typed::GET_ROOM_STATS_BY_ACTIVITY);
+            std::vector<RoomStats> rooms = hot.Bind(options_.hot_rooms).All();
+            steps_total_ = static_cast<int64_t>(scans.size() + rooms.size());
+
+            for (size_t i = 0; ok && i < scans.size(); ++i) {
+                if ((ok = ScanAll(scans[i]))) {
+                    Step();
+                }
+            }
+            for (size_t i = 0; ok && i < rooms.size(); ++i) {
+                if (rooms[i].last_message_id < 0 || (ok = ScanRoomTail(rooms[i]))) {
+                    Step();
+                }
+            }
+        } catch (const std::runtime_error&) {
+            ok = false;
+        }
+        if (!ok && !stop_) {
+            DB_LOG_WARN("StartWarmup", sqlite3_errcode(conn_), {}, {}, sqlite3_errmsg(conn_));
+        }
+        done_ = ok;
+        // последний вызов on_progress - до сброса running_: кто дождался !running, видит и его
+        if (options_.on_progress) {
+            WarmupProgress progress = Progress();
+            progress.running = false;
+            options_.on_progress(progress);
+        }
+        running_ = false;
+    }
+
+    bool DB::StartWarmup(const WarmupOptions& options) {
+        if (!db_) {
+            return false;
+        }
+        if (warmup_ && warmup_->Progress().running) {
+            return true;
+        }
+        const char* file = sqlite3_db_filename(db_, "main");
+        if (file == nullptr || *file == '\0') {
+            DB_LOG_WARN("StartWarmup", SQLITE_MISUSE, {}, {}, "warmup needs a file database");
+            return false;
+        }
+        warmup_.reset();
+        auto task = std::make_unique<WarmupTask>(file, options, options_.mmap_size);
+        if (!task->Start()) {
+            return false;
+        }
+        warmup_ = std::move(task);
+        return true;
+    }
+
+    void DB::StopWarmup() {
+        warmup_.reset();
+    }
+
+    WarmupProgress DB::GetWarmupProgress() const {
+        return warmup_ ? warmup_->Progress() : WarmupProgress{};
+    }
+} // db
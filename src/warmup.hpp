@@ -0,0 +1,46 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <sqlite3.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "db.hpp"
+
+namespace db {
+    // Прогрев на собственном подключении только для чтения: один проход и завершение потока.
+    class WarmupTask {
+    public:
+        WarmupTask(const std::string& db_file, const WarmupOptions& options, int64_t mmap_size);
+        ~WarmupTask();
+
+        WarmupTask(const WarmupTask&) = delete;
+        WarmupTask& operator=(const WarmupTask&) = delete;
+
+        bool Start();
+        WarmupProgress Progress() const;
+
+    private:
+        void Run();
+        // users и rooms целиком, затем каждый их индекс от начала до конца
+        std::vector<std::string> ListScans();
+        void Step();
+        // шагает по запросу до конца, считая строки; false - ошибка или остановка
+        bool ScanAll(const std::string& sql);
+        bool ScanRoomTail(const RoomStats& room);
+
+        std::string db_file_;
+        WarmupOptions options_;
+        int64_t mmap_size_;
+        sqlite3* conn_ = nullptr;
+        std::thread worker_;
+
+        std::atomic<bool> stop_{ false };
+        std::atomic<bool> running_{ false };
+        std::atomic<bool> done_{ false };
+        std::atomic<int64_t> steps_done_{ 0 };
+        std::atomic<int64_t> steps_total_{ 0 };
+        std::atomic<int64_t> rows_{ 0 };
+    };
+} // db
@@ -0,0 +1,125 @@
+#include <catch2/catch_test_macros.hpp>
+#include <cstdio>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "db.hpp"
+#include "sql_queries.hpp"
+#include "time_utils.hpp"
+
+// Проверка планов выполнения всех запросов из sql_queries.hpp на заполненной БД.
+// Падает, если запрос полностью сканирует таблицу (SCAN без индекса или по полному индексу)
+// или строит временное B-дерево для сортировки/группировки. Осознанные полные выборки перечислены ниже.
+
+namespace {
+    const char* kPlanDbFile = "query_plan_test.db";
+
+    // Запросы, которые по смыслу читают всю таблицу: разрешенные строки плана.
+    const std::map<std::string, std::set<std::string>> kAllowedScans = {
+        { "GET_ROOMS",                    { "SCAN rooms", "SCAN rooms USING COVERING INDEX idx_rooms_room" } },
+        { "GET_ALL_USERS",                { "SCAN u" } },
+        { "GET_ACTIVE_USERS",             { "SCAN u" } },
+        { "GET_ALL_PAIR_ROOMS_AND_USERS", { "SCAN ur" } },
+        { "GET_ALL_ROOM_STATS",           { "SCAN s", "SCAN r USING COVERING INDEX idx_rooms_room" } },
+        // ORDER BY ... LIMIT: обход индекса с начала, останавливается после limit строк
+        { "GET_ROOM_STATS_BY_ACTIVITY",   { "SCAN s USING INDEX idx_room_stats_activity" } },
+        // eph.rooms - список эфемерных комнат, единицы строк
+        { "EPHEMERAL_DELETE_PERSISTED",   { "SCAN eph.rooms" } },
+        { "EPHEMERAL_EXPIRE",             { "SCAN t" } },
+        { "EPHEMERAL_ID_RANGE",           { "SCAN t" } },
+        // слияние ветвей с LIMIT 1: внешний SELECT обходит одну строку
+        { "GET_FIRST_MESSAGE_ID_AT_OR_AFTER_TIERED", { "SCAN (subquery-2)" } },
+        { "EPHEMERAL_COUNT_MESSAGES",     { "SCAN messages USING COVERING INDEX idx_eph_user_time" } },
+    };
+
+    void FillDB(db::DB& db) {
+        int64_t now = utime::GetUnixTimeNs();
+        for (int r = 0; r < 20; ++r) {
+            db.CreateRoom("room" + std::to_string(r), now);
+        }
+        for (int u = 0; u < 300; ++u) {
+            std::string login = "user" + std::to_string(u);
+            db.CreateUser({ login, "Name", "hash", "user", false, now });
+            db.AddUserToRoom(login, "room" + std::to_string(u % 20));
+            db.AddUserToRoom(login, "room" + std::to_string((u * 7) % 20));
+        }
+        for (int i = 0; i < 5000; ++i) {
+            db.InsertMessageToDB({ "text", now + i, "user" + std::to_string(i % 300), "room" + std::to_string(i % 20), i / 20 });
+        }
+        db.DeleteUser("user299");  // мягкое удаление: в таблице есть строки с is_deleted = 1
+    }
+
+    std::vector<std::string> ExplainQueryPlan(sqlite3* conn, const char* sql) {
+        std::vector<std::string> details;
+        std::string eqp = std::string("EXPLAIN QUERY PLAN ") + sql;
+        sqlite3_stmt* stmt = nullptr;
+        REQUIRE(sqlite3_prepare_v2(conn, eqp.c_str(), -1, &stmt, nullptr) == SQLITE_OK);
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            details.emplace_back(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3)));
+        }
+        sqlite3_finalize(stmt);
+        return details;
+    }
+
+    bool IsPartialIndexScan(sqlite3* conn, const std::string& detail) {
+        auto pos = detail.find("INDEX ");
+        if (pos == std::string::npos) {
+            return false;
+        }
+        std::string index = detail.substr(pos + 6);
+        index = index.substr(0, index.find(' '));
+        sqlite3_stmt* stmt = nullptr;
+        sqlite3_prepare_v2(conn, "SELECT partial FROM pragma_index_list(?) WHERE name = ?;", -1, &stmt, nullptr);
+        bool partial = false;
+        for (const char* table : { "users", "messages", "user_rooms", "rooms" }) {
+            sqlite3_bind_text(stmt, 1, table, -1, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 2, index.c_str(), -1, SQLITE_TRANSIENT);
+            if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_int(stmt, 0) != 0) {
+                partial = true;
+            }
+            sqlite3_reset(stmt);
+        }
+        sqlite3_finalize(stmt);
+        return partial;
+    }
+} // namespace
+
+TEST_CASE("Query plans use indexes") {
+    std::remove(kPlanDbFile);
+    {
+        db::DB db(kPlanDbFile);
+        REQUIRE(db.OpenDB());
+        REQUIRE(db.EnableChangeFeed());
+        FillDB(db);
+    }
+
+    sqlite3* conn = nullptr;
+    REQUIRE(sqlite3_open(kPlanDbFile, &conn) == SQLITE_OK);
+    REQUIRE(sqlite3_exec(conn, "ATTACH DATABASE ':memory:' AS eph;", nullptr, nullptr, nullptr) == SQLITE_OK);
+    REQUIRE(sqlite3_exec(conn, sql::EPHEMERAL_INIT_SQL, nullptr, nullptr, nullptr) == SQLITE_OK);
+
+    for (const auto& query : sql::ALL_QUERIES) {
+        auto details = ExplainQueryPlan(conn, query.sql);
+        auto allowed = kAllowedScans.find(query.name);
+        for (const auto& detail : details) {
+            INFO(query.name << ": " << detail);
+            CHECK(detail.find("USE TEMP B-TREE") == std::string::npos);
+            if (detail.rfind("SCAN ", 0) != 0) {
+                continue;
+            }
+            if (detail == "SCAN CONSTANT ROW" || detail.find("VIRTUAL TABLE") != std::string::npos
+                || IsPartialIndexScan(conn, detail)) {
+                continue;
+            }
+            bool is_allowed = allowed != kAllowedScans.end() && allowed->second.count(detail) != 0;
+            CHECK(is_allowed);
+        }
+    }
+
+    sqlite3_close(conn);
+    std::remove(kPlanDbFile);
+    std::remove((std::string(kPlanDbFile) + "-wal").c_str());
+    std::remove((std::string(kPlanDbFile) + "-shm").c_str());
+}
@@ -1,12 +1,66 @@
 #define CATCH_CONFIG_MAIN  
 #include <catch2/catch_test_macros.hpp>
-#include <iostream>
-#include <sstream>
-#include <streambuf>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <limits>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include "db.hpp"
+#include "log.hpp"
+#include "read_snapshot.hpp"
 #include "time_utils.hpp"
 
+namespace {
+    // Копирует записи журнала, чтобы проверять их после Flush.
+    struct CaptureSink : db::log::Sink {
+        struct Copy {
+            std::string method;
+            int rc;
+            std::string room;
+            std::string login;
+            std::string text;
+            uint32_t suppressed;
+        };
+
+        void Write(const db::log::Record& r) override {
+            records.push_back({ std::string(r.method), r.rc, std::string(r.room),
+                                std::string(r.login), std::string(r.text), r.suppressed });
+        }
+
+        std::vector<Copy> records;
+    };
+
+    // Файл БД теста вместе с -wal и -shm: удаляется до теста и после него, в том числе когда REQUIRE прерывает
+    // секцию. Объявляется раньше подключений к нему, чтобы те закрылись до удаления.
+    struct TempDbFile {
+        explicit TempDbFile(std::string path) : path(std::move(path)) {
+            Remove();
+        }
+        ~TempDbFile() {
+            Remove();
+        }
+        TempDbFile(const TempDbFile&) = delete;
+        TempDbFile& operator=(const TempDbFile&) = delete;
+
+        void Remove() const {
+            for (const char* suffix : { "", "-wal", "-shm" }) {
+                std::remove((path + suffix).c_str());
+            }
+        }
+
+        const std::string path;
+    };
+} // namespace
+
 TEST_CASE("DB initialization") {
     db::DB db(":memory:");
     REQUIRE(db.OpenDB() == true);
@@ -48,16 +102,69 @@ TEST_CASE("User management 1") {
        auto user_info = db.GetUserData("test_login");
        REQUIRE(user_info->name == "Test User");
        {
-           std::streambuf* buf(std::cerr.rdbuf());
-           std::stringstream output;
-           std::cerr.rdbuf(output.rdbuf());
+           auto sink = std::make_shared<CaptureSink>();
+           db::log::SetSink(sink);
            auto user_info_not_exist = db.GetUserData("test");
-           REQUIRE(output.str() == "[GetUserData] SQL error or unexpected result (101): no more rows available\n");
-           std::cerr.rdbuf(buf);
+           db::log::Flush();
+           db::log::SetSink(nullptr);
            REQUIRE(user_info_not_exist == std::nullopt);
+           REQUIRE(sink->records.size() == 1);
+           REQUIRE(sink->records[0].method == "GetUserData");
+           REQUIRE(sink->records[0].rc == SQLITE_DONE);
+           REQUIRE(sink->records[0].login == "test");
+           REQUIRE(sink->records[0].text == "no more rows available");
        }
    }
 }
+TEST_CASE("Logging") {
+    db::DB db(":memory:");
+    db.OpenDB();
+
+    SECTION("Repeated errors are rate limited") {
+        auto sink = std::make_shared<CaptureSink>();
+        db::log::SetSink(sink);
+        db::log::SetRateLimit(std::chrono::milliseconds(500), 3);
+        for (int i = 0; i < 10; ++i) {
+            db.IsRoom("room");                 // без ошибок, в журнал не пишет
+            db.GetCountRoomMessages("room");   // COUNT всегда возвращает строку
+            db.GetUserData("missing_" + std::to_string(i));
+        }
+        db::log::Flush();
+        size_t first_window = sink->records.size();
+
+        // следующее окно: первая запись несет число отброшенных в прошлом
+        std::this_thread::sleep_for(std::chrono::milliseconds(600));
+        db.GetUserData("missing_next");
+        db::log::Flush();
+        db::log::SetRateLimit(std::chrono::seconds(1), 10);
+        db::log::SetSink(nullptr);
+        REQUIRE(first_window == 3);
+        REQUIRE(sink->records.size() == 4);
+        REQUIRE(sink->records[0].suppressed == 0);
+        REQUIRE(sink->records[3].suppressed == 7);
+        for (const auto& r : sink->records) {
+            REQUIRE(r.method == "GetUserData");
+        }
+    }
+
+    SECTION("Each method and code has its own limit") {
+        auto sink = std::make_shared<CaptureSink>();
+        db::log::SetSink(sink);
+        db::log::SetRateLimit(std::chrono::seconds(10), 3);
+        db.CreateRoom("room", 0);
+        for (int i = 0; i < 10; ++i) {
+            db.GetUserData("missing_" + std::to_string(i));
+            db.SetRoomEphemeral("room");  // DBOptions::ephemeral_rooms выключен: SQLITE_MISUSE
+        }
+        db::log::Flush();
+        db::log::SetRateLimit(std::chrono::seconds(1), 10);
+        db::log::SetSink(nullptr);
+        REQUIRE(sink->records.size() == 6);
+        size_t user_data = std::count_if(sink->records.begin(), sink->records.end(),
+                                         [](const CaptureSink::Copy& r) { return r.method == "GetUserData"; });
+        REQUIRE(user_data == 3);
+    }
+}
 
 TEST_CASE("Room management 1") {
     db::DB db(":memory:");
@@ -338,3 +445,1298 @@ TEST_CASE("Operations with non-existent entities") {
         REQUIRE(db.GetCountRoomMessages("non_existent_room") == 0); 
     }
 }
+TEST_CASE("Text values round trip") {
+    db::DB db(":memory:");
+    db.OpenDB();
+    db::User user{ "пользователь", "Имя", "hash", "user", false, utime::GetUnixTimeNs() };
+    db.CreateUser(user);
+    db.CreateRoom("комната", utime::GetUnixTimeNs());
+
+    SECTION("Unicode and embedded zero are stored as is") {
+        std::string text("line1\nстрока 2\0tail", 25);
+        REQUIRE(db.InsertMessageToDB({ text, utime::GetUnixTimeNs(), "пользователь", "комната", 1 }));
+        auto messages = db.GetRangeMessagesRoom("комната", 1, 1);
+        REQUIRE(messages.size() == 1);
+        REQUIRE(messages[0].message == text);
+        REQUIRE(messages[0].user_login == "пользователь");
+        REQUIRE(db.GetUserData("пользователь")->name == "Имя");
+    }
+}
+TEST_CASE("Columnar batches") {
+    db::DB db(":memory:");
+    db.OpenDB();
+    db.CreateRoom("general", utime::GetUnixTimeNs());
+    db.CreateUser({ "user1", "Name1", "hash1", "user", false, 1 });
+    db.CreateUser({ "user2", "Name2", "hash2", "admin", false, 2 });
+    for (int i = 0; i < 100; ++i) {
+        db.InsertMessageToDB({ "text" + std::to_string(i), 1000 + i, i % 2 ? "user1" : "user2", "general", i });
+    }
+
+    SECTION("Message batch matches vector result") {
+        auto messages = db.GetRangeMessagesRoom("general", 99, 0);
+        auto batch = db.GetRangeMessagesRoomBatch("general", 99, 0);
+        REQUIRE(batch.size() == messages.size());
+        size_t i = 0;
+        for (const auto& m : batch) {
+            REQUIRE(m.message == messages[i].message);
+            REQUIRE(m.user_login == messages[i].user_login);
+            REQUIRE(m.room == messages[i].room);
+            REQUIRE(m.unixtime == messages[i].unixtime);
+            REQUIRE(m.id_message_in_room == messages[i].id_message_in_room);
+            ++i;
+        }
+        // логины и комната хранятся один раз: 100 текстов + "user1" + "user2" + "general"
+        size_t texts = 0;
+        for (const auto& m : messages) {
+            texts += m.message.size();
+        }
+        REQUIRE(batch.arena().Bytes() == texts + 5 + 5 + 7);
+    }
+
+    SECTION("Wide ranges do not overflow the reserve") {
+        const int64_t max = std::numeric_limits<int64_t>::max();
+        const int64_t min = std::numeric_limits<int64_t>::min();
+        REQUIRE(db.GetRangeMessagesRoomBatch("general", max, 0).size() == 100);
+        REQUIRE(db.GetRangeMessagesRoomBatch("general", 0, min).size() == 1);
+        REQUIRE(db.GetRangeMessagesRoomBatch("general", max, min).size() == 100);
+        REQUIRE(db.GetRangeMessagesRoomBatch("no_such_room", max, 0).size() == 0);
+    }
+
+    SECTION("User batch matches vector result") {
+        auto users = db.GetAllUsers();
+        auto batch = db.GetAllUsersBatch();
+        REQUIRE(batch.size() == 2);
+        for (size_t i = 0; i < users.size(); ++i) {
+            REQUIRE(batch.login(i) == users[i].login);
+            REQUIRE(batch.name(i) == users[i].name);
+            REQUIRE(batch.password_hash(i) == users[i].password_hash);
+            REQUIRE(batch.role(i) == users[i].role);
+            REQUIRE(batch.unixtime(i) == users[i].unixtime);
+        }
+    }
+}
+TEST_CASE("Messages by time") {
+    db::DB db(":memory:");
+    db.OpenDB();
+    db.CreateRoom("general", 0);
+    db.CreateRoom("other", 0);
+    db.CreateUser({ "user1", "Name1", "hash", "user", false, 0 });
+    db.CreateUser({ "user2", "Name2", "hash", "user", false, 0 });
+    for (int i = 0; i < 50; ++i) {
+        db.InsertMessageToDB({ "m" + std::to_string(i), 1000 + i * 10, i % 2 ? "user1" : "user2", "general", i });
+        db.InsertMessageToDB({ "o" + std::to_string(i), 1000 + i * 10, "user1", "other", i });
+    }
+
+    SECTION("Room messages in a time range, ascending, limited") {
+        auto messages = db.GetMessagesByTime("general", 1100, 1200, 100);
+        REQUIRE(messages.size() == 11);
+        REQUIRE(messages.front().id_message_in_room == 10);
+        REQUIRE(messages.back().id_message_in_room == 20);
+        REQUIRE(messages.front().room == "general");
+
+        auto limited = db.GetMessagesByTime("general", 1100, 1200, 3);
+        REQUIRE(limited.size() == 3);
+        REQUIRE(limited[2].id_message_in_room == 12);
+    }
+
+    SECTION("User messages in a time range across rooms") {
+        auto messages = db.GetUserMessagesByTime("user1", 1000, 1030, 100);
+        // user1: general - нечетные номера (1, 3), other - все (0..3)
+        REQUIRE(messages.size() == 6);
+        for (size_t i = 1; i < messages.size(); ++i) {
+            REQUIRE(messages[i - 1].unixtime <= messages[i].unixtime);
+        }
+        REQUIRE(db.GetUserMessagesByTime("user2", 2000, 3000, 100).empty());
+    }
+
+    SECTION("Timestamp to message id") {
+        REQUIRE(db.GetFirstMessageIdAtOrAfter("general", 0) == 0);
+        REQUIRE(db.GetFirstMessageIdAtOrAfter("general", 1105) == 11);
+        REQUIRE(db.GetFirstMessageIdAtOrAfter("general", 1110) == 11);
+        REQUIRE(db.GetFirstMessageIdAtOrAfter("general", 999999) == std::nullopt);
+        REQUIRE(db.GetFirstMessageIdAtOrAfter("non_existent_room", 0) == std::nullopt);
+    }
+}
+TEST_CASE("Change feed") {
+    struct Collector : db::ChangeSubscriber {
+        void OnChange(const db::ChangeRecord& record) override {
+            records.push_back(record);
+        }
+        std::vector<db::ChangeRecord> records;
+    };
+
+    db::DB db(":memory:");
+    db.OpenDB();
+    REQUIRE(db.EnableChangeFeed());
+    db.CreateRoom("general", 0);
+    db.CreateUser({ "user1", "Name", "hash", "user", false, 0 });
+
+    SECTION("Committed changes are delivered in order") {
+        auto collector = std::make_shared<Collector>();
+        db.Subscribe(collector);
+        REQUIRE(collector->records.empty());
+
+        db.AddUserToRoom("user1", "general");
+        db.InsertMessageToDB({ "Hello", 1, "user1", "general", 7 });
+        db.ChangeUserName("user1", "New Name");
+
+        REQUIRE(collector->records.size() == 3);
+        REQUIRE(collector->records[0].entity == db::ChangeEntity::kMembership);
+        REQUIRE(collector->records[0].op == db::ChangeOp::kInsert);
+        REQUIRE(collector->records[0].room == "general");
+        REQUIRE(collector->records[0].login == "user1");
+        REQUIRE(collector->records[1].entity == db::ChangeEntity::kMessage);
+        REQUIRE(collector->records[1].id_message_in_room == 7);
+        REQUIRE(collector->records[2].entity == db::ChangeEntity::kUser);
+        REQUIRE(collector->records[2].op == db::ChangeOp::kUpdate);
+        for (size_t i = 1; i < collector->records.size(); ++i) {
+            REQUIRE(collector->records[i - 1].position < collector->records[i].position);
+        }
+        REQUIRE(db.GetChangeLogPosition() == collector->records.back().position);
+    }
+
+    SECTION("Resume from position replays the log") {
+        int64_t position = db.GetChangeLogPosition();
+        db.InsertMessageToDB({ "Hello", 1, "user1", "general", 1 });
+        db.InsertMessageToDB({ "World", 2, "user1", "general", 2 });
+
+        auto collector = std::make_shared<Collector>();
+        db.Subscribe(collector, position);
+        REQUIRE(collector->records.size() == 2);
+        REQUIRE(collector->records[1].id_message_in_room == 2);
+
+        db.Unsubscribe(collector);
+        db.InsertMessageToDB({ "!", 3, "user1", "general", 3 });
+        REQUIRE(collector->records.size() == 2);
+
+        REQUIRE(db.GetChanges(position, 100).size() == 3);
+        REQUIRE(db.TrimChangeLog(db.GetChangeLogPosition() - 1));
+        REQUIRE(db.GetChanges(0, 100).size() == 1);
+    }
+
+    SECTION("Room delete cascades into the feed") {
+        db.InsertMessageToDB({ "Hello", 1, "user1", "general", 1 });
+        auto collector = std::make_shared<Collector>();
+        db.Subscribe(collector);
+        db.DeleteRoom("general");
+        REQUIRE(collector->records.size() == 2);
+        REQUIRE(collector->records[0].entity == db::ChangeEntity::kMessage);
+        REQUIRE(collector->records[0].op == db::ChangeOp::kDelete);
+        REQUIRE(collector->records[1].entity == db::ChangeEntity::kRoom);
+        REQUIRE(collector->records[1].room == "general");
+    }
+
+    SECTION("Subscriber added from OnChange replays from its position") {
+        int64_t position = db.GetChangeLogPosition();
+        auto late = std::make_shared<Collector>();
+        struct Recruiter : db::ChangeSubscriber {
+            void OnChange(const db::ChangeRecord& record) override {
+                if (!done) {
+                    done = true;
+                    db.Subscribe(late, start);
+                }
+                records.push_back(record);
+            }
+            db::DB& db;
+            std::shared_ptr<Collector> late;
+            int64_t start;
+            bool done = false;
+            std::vector<db::ChangeRecord> records;
+
+            Recruiter(db::DB& db, std::shared_ptr<Collector> late, int64_t start) : db(db), late(std::move(late)), start(start) {}
+        };
+        auto recruiter = std::make_shared<Recruiter>(db, late, position);
+        db.Subscribe(recruiter);
+        // одна транзакция: все три записи в одной пачке доставки
+        {
+            db::Transaction tx(db);
+            db.InsertMessageToDB({ "a", 1, "user1", "general", 1 });
+            db.InsertMessageToDB({ "b", 2, "user1", "general", 2 });
+            db.InsertMessageToDB({ "c", 3, "user1", "general", 3 });
+            REQUIRE(tx.Commit());
+        }
+        REQUIRE(recruiter->records.size() == 3);
+        REQUIRE(late->records.size() == 3);
+        for (size_t i = 0; i < 3; ++i) {
+            REQUIRE(late->records[i].position == recruiter->records[i].position);
+        }
+    }
+
+    SECTION("Without EnableChangeFeed the log is empty") {
+        db::DB plain(":memory:");
+        REQUIRE(plain.OpenDB());
+        REQUIRE(plain.GetChangeLogPosition() == 0);
+        REQUIRE(plain.GetChanges(0, 100).empty());
+        REQUIRE(plain.TrimChangeLog(10));
+
+        auto collector = std::make_shared<Collector>();
+        plain.Subscribe(collector);
+        REQUIRE(plain.CreateRoom("general", 0));
+        plain.PollChangeFeed();
+        REQUIRE(collector->records.empty());
+        {
+            db::ReadSnapshot snapshot(plain);
+            REQUIRE(snapshot.GetChangeLogPosition() == 0);
+            REQUIRE(snapshot.GetChanges(0, 100).empty());
+        }
+
+        REQUIRE(plain.EnableChangeFeed());
+        REQUIRE(plain.CreateRoom("later", 0));
+        REQUIRE(collector->records.size() == 1);
+        REQUIRE(collector->records[0].room == "later");
+    }
+}
+TEST_CASE("Attachments") {
+    db::DB db(":memory:");
+    db.OpenDB();
+    db.CreateRoom("general", 0);
+    db.CreateUser({ "user1", "Name", "hash", "user", false, 0 });
+    db.InsertMessageToDB({ "see attachment", 1, "user1", "general", 1 });
+
+    // 1 МиБ + хвост, подается кусками некратного размеру блока размера
+    const int64_t size = (1 << 20) + 12345;
+    auto pattern = [](int64_t i) { return static_cast<char>((i * 131 + 7) & 0xff); };
+    int64_t fed = 0;
+    auto source = [&](char* buffer, size_t cap) {
+        size_t n = std::min<size_t>(cap, 10000);
+        n = static_cast<size_t>(std::min<int64_t>(static_cast<int64_t>(n), size - fed));
+        for (size_t i = 0; i < n; ++i) {
+            buffer[i] = pattern(fed + static_cast<int64_t>(i));
+        }
+        fed += static_cast<int64_t>(n);
+        return n;
+    };
+
+    SECTION("Stream in and out in chunks") {
+        auto id = db.InsertAttachment("general", 1, "dump.bin", size, source);
+        REQUIRE(id.has_value());
+
+        auto attachments = db.GetMessageAttachments("general", 1);
+        REQUIRE(attachments.size() == 1);
+        REQUIRE(attachments[0].id == *id);
+        REQUIRE(attachments[0].name == "dump.bin");
+        REQUIRE(attachments[0].size == size);
+
+        int64_t read = 0;
+        bool match = true;
+        size_t max_chunk = 0;
+        REQUIRE(db.StreamAttachment(*id, [&](const char* data, size_t n) {
+            max_chunk = std::max(max_chunk, n);
+            for (size_t i = 0; i < n; ++i) {
+                match = match && data[i] == pattern(read + static_cast<int64_t>(i));
+            }
+            read += static_cast<int64_t>(n);
+            return true;
+        }));
+        REQUIRE(read == size);
+        REQUIRE(match);
+        REQUIRE(max_chunk <= db::DB::kAttachmentChunkSize);
+    }
+
+    SECTION("Random access read and overwrite") {
+        auto id = db.InsertAttachment("general", 1, "dump.bin", size, source);
+        REQUIRE(id.has_value());
+
+        char buffer[16];
+        REQUIRE(db.ReadAttachment(*id, 1000, buffer, sizeof(buffer)) == 16);
+        REQUIRE(buffer[0] == pattern(1000));
+        REQUIRE(db.ReadAttachment(*id, size - 4, buffer, sizeof(buffer)) == 4);
+
+        REQUIRE(db.WriteAttachment(*id, 1000, "abc", 3));
+        REQUIRE(db.ReadAttachment(*id, 1000, buffer, 3) == 3);
+        REQUIRE(std::string(buffer, 3) == "abc");
+        REQUIRE(db.WriteAttachment(*id, size - 2, "abc", 3) == false);
+    }
+
+    SECTION("Failed insert leaves nothing behind") {
+        REQUIRE(db.InsertAttachment("general", 1, "short.bin", size + 1, source) == std::nullopt);
+        REQUIRE(db.InsertAttachment("general", 42, "orphan.bin", 3, [](char* buffer, size_t) { buffer[0] = 'x'; return size_t{ 1 }; })
+                == std::nullopt);
+        REQUIRE(db.GetMessageAttachments("general", 1).empty());
+    }
+
+    SECTION("Deleted explicitly or with the room") {
+        auto a = db.InsertAttachment("general", 1, "a", 1, [](char* buffer, size_t) { buffer[0] = 'a'; return size_t{ 1 }; });
+        auto b = db.InsertAttachment("general", 1, "b", 1, [](char* buffer, size_t) { buffer[0] = 'b'; return size_t{ 1 }; });
+        REQUIRE(db.DeleteAttachment(*a));
+        REQUIRE(db.GetMessageAttachments("general", 1).size() == 1);
+
+        REQUIRE(db.DeleteRoom("general"));
+        char c;
+        REQUIRE(db.ReadAttachment(*b, 0, &c, 1) == -1);
+    }
+}
+TEST_CASE("Room statistics") {
+    db::DB db(":memory:");
+    db.OpenDB();
+    db.CreateRoom("quiet", 100);
+    db.CreateRoom("busy", 200);
+    db.CreateRoom("empty", 300);
+    db.CreateUser({ "user1", "Name", "hash", "user", false, 0 });
+    for (int i = 0; i < 5; ++i) {
+        db.InsertMessageToDB({ "m", 1000 + i, "user1", "busy", i });
+    }
+    db.InsertMessageToDB({ "m", 500, "user1", "quiet", 0 });
+
+    SECTION("Maintained on insert") {
+        auto busy = db.GetRoomStats("busy");
+        REQUIRE(busy.has_value());
+        REQUIRE(busy->message_count == 5);
+        REQUIRE(busy->last_message_id == 4);
+        REQUIRE(busy->last_activity == 1004);
+        REQUIRE(db.GetCountRoomMessages("busy") == 5);
+
+        auto empty = db.GetRoomStats("empty");
+        REQUIRE(empty->message_count == 0);
+        REQUIRE(empty->last_message_id == -1);
+        REQUIRE(empty->last_activity == 300);
+
+        REQUIRE(db.GetRoomStats("non_existent_room") == std::nullopt);
+        REQUIRE(db.GetAllRoomStats().size() == 3);
+    }
+
+    SECTION("Ordered by last activity") {
+        auto rooms = db.GetRoomStatsByActivity(10);
+        REQUIRE(rooms.size() == 3);
+        REQUIRE(rooms[0].room == "busy");
+        REQUIRE(rooms[1].room == "quiet");
+        REQUIRE(rooms[2].room == "empty");
+        REQUIRE(db.GetRoomStatsByActivity(1).size() == 1);
+    }
+
+    SECTION("Follows room rename and delete") {
+        REQUIRE(db.ChangeRoomName("busy", "renamed"));
+        REQUIRE(db.GetRoomStats("renamed")->message_count == 5);
+        REQUIRE(db.DeleteRoom("renamed"));
+        REQUIRE(db.GetRoomStats("renamed") == std::nullopt);
+        REQUIRE(db.GetAllRoomStats().size() == 2);
+    }
+}
+TEST_CASE("Room statistics are built for existing files") {
+    const TempDbFile file("room_stats_migration_test.db");
+    {
+        db::DB db(file.path);
+        db.OpenDB();
+        db.CreateRoom("general", 100);
+        db.CreateUser({ "user1", "Name", "hash", "user", false, 0 });
+        db.InsertMessageToDB({ "a", 1000, "user1", "general", 0 });
+        db.InsertMessageToDB({ "b", 2000, "user1", "general", 1 });
+    }
+    {
+        // файл в том виде, в каком его оставила версия без room_stats
+        sqlite3* conn = nullptr;
+        sqlite3_open(file.path.c_str(), &conn);
+        sqlite3_exec(conn, "DROP TABLE room_stats;", nullptr, nullptr, nullptr);
+        sqlite3_close(conn);
+    }
+    db::DB db(file.path);
+    REQUIRE(db.OpenDB());
+    auto stats = db.GetRoomStats("general");
+    REQUIRE(stats.has_value());
+    REQUIRE(stats->message_count == 2);
+    REQUIRE(stats->last_message_id == 1);
+    REQUIRE(stats->last_activity == 2000);
+    db.CloseDB();
+}
+TEST_CASE("Transactions") {
+    db::DB db(":memory:");
+    db.OpenDB();
+    db.CreateUser({ "user1", "Name", "hash", "user", false, 0 });
+
+    SECTION("Commit groups several calls") {
+        {
+            db::Transaction tx(db);
+            REQUIRE(tx);
+            REQUIRE(db.InTransaction());
+            REQUIRE(db.CreateRoom("general", 0));
+            REQUIRE(db.AddUserToRoom("user1", "general"));
+            REQUIRE(db.InsertMessageToDB({ "Welcome", 1, "user1", "general", 0 }));
+            REQUIRE(db.InTransaction());
+            REQUIRE(tx.Commit());
+        }
+        REQUIRE(db.InTransaction() == false);
+        REQUIRE(db.GetCountRoomMessages("general") == 1);
+    }
+
+    SECTION("Rolled back without Commit") {
+        {
+            db::Transaction tx(db);
+            db.CreateRoom("general", 0);
+            db.DeleteUser("user1");
+        }
+        REQUIRE(db.InTransaction() == false);
+        REQUIRE(db.IsRoom("general") == false);
+        REQUIRE(db.IsUser("user1"));
+    }
+
+    SECTION("Nested transaction and savepoint roll back only their part") {
+        db::Transaction tx(db);
+        db.CreateRoom("kept", 0);
+        {
+            db::Savepoint sp(db);
+            REQUIRE(sp);
+            db.CreateRoom("dropped", 0);
+            sp.Rollback();
+        }
+        {
+            db::Transaction nested(db);
+            REQUIRE(nested);
+            db.CreateRoom("nested", 0);
+            REQUIRE(nested.Commit());
+            REQUIRE(db.InTransaction());
+        }
+        REQUIRE(tx.Commit());
+        REQUIRE(db.IsRoom("kept"));
+        REQUIRE(db.IsRoom("nested"));
+        REQUIRE(db.IsRoom("dropped") == false);
+    }
+
+    SECTION("Change feed is delivered after the outer commit") {
+        struct Counter : db::ChangeSubscriber {
+            void OnChange(const db::ChangeRecord&) override {
+                ++count;
+            }
+            int count = 0;
+        };
+        REQUIRE(db.EnableChangeFeed());
+        auto counter = std::make_shared<Counter>();
+        db.Subscribe(counter);
+
+        db::Transaction tx(db);
+        db.CreateRoom("general", 0);
+        db.AddUserToRoom("user1", "general");
+        REQUIRE(counter->count == 0);
+        REQUIRE(tx.Commit());
+        REQUIRE(counter->count == 2);
+    }
+}
+TEST_CASE("Immediate transactions exclude other writers") {
+    const TempDbFile file("transaction_test.db");
+    db::DB first(file.path);
+    db::DB second(file.path);
+    REQUIRE(first.OpenDB());
+    REQUIRE(second.OpenDB());
+
+    db::Transaction tx(first);
+    REQUIRE(tx);
+    first.CreateRoom("general", 0);
+    {
+        // блокировка записи взята при BEGIN IMMEDIATE, второй писатель узнает об этом сразу
+        db::Transaction other(second);
+        REQUIRE(!other);
+    }
+    REQUIRE(second.IsRoom("general") == false);
+    REQUIRE(tx.Commit());
+    REQUIRE(second.IsRoom("general"));
+
+    first.CloseDB();
+    second.CloseDB();
+}
+TEST_CASE("Busy handling between connections") {
+    const TempDbFile file("busy_test.db");
+    db::DB holder(file.path);
+    REQUIRE(holder.OpenDB());
+
+    db::DBOptions options = db::DBOptions::MultiProcess();
+    options.busy_timeout = std::chrono::milliseconds(50);
+    options.busy_retries = 1;
+    db::DB waiter(file.path, options);
+    REQUIRE(waiter.OpenDB());
+
+    SECTION("Idempotent write is retried, then reports SQLITE_BUSY") {
+        db::Transaction tx(holder);
+        REQUIRE(tx);
+        REQUIRE(waiter.CreateRoom("general", 0) == false);
+        auto stats = waiter.GetContentionStats();
+        REQUIRE(stats.busy_events == 2);
+        REQUIRE(stats.busy_timeouts == 2);
+        REQUIRE(stats.retries == 1);
+        // считается только сон в обработчике, без работы SQLite между вызовами: чуть меньше 2 x busy_timeout
+        REQUIRE(stats.wait_ns >= 90'000'000);
+    }
+
+    SECTION("Waits for the lock to be released") {
+        db::Transaction tx(holder);
+        REQUIRE(tx);
+        holder.CreateRoom("general", 0);
+        std::thread release([&tx] {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            tx.Commit();
+        });
+        REQUIRE(waiter.CreateRoom("other", 0));
+        release.join();
+        REQUIRE(waiter.GetContentionStats().busy_events == 1);
+        REQUIRE(waiter.GetContentionStats().busy_timeouts == 0);
+        REQUIRE(waiter.IsRoom("general"));
+        REQUIRE(waiter.IsRoom("other"));
+    }
+
+    holder.CloseDB();
+    waiter.CloseDB();
+}
+TEST_CASE("Incremental vacuum") {
+    const TempDbFile file("vacuum_test.db");
+
+    auto fill_and_drop_room = [](db::DB& db) {
+        db.CreateRoom("big", 0);
+        db.CreateUser({ "user1", "Name", "hash", "user", false, 0 });
+        db::Transaction tx(db);
+        for (int i = 0; i < 3000; ++i) {
+            db.InsertMessageToDB({ std::string(200, 'x'), i, "user1", "big", i });
+        }
+        tx.Commit();
+        db.DeleteRoom("big");
+    };
+
+    SECTION("New files reclaim freed pages in slices") {
+        db::DB db(file.path);
+        REQUIRE(db.OpenDB());
+        REQUIRE(db.GetSpaceStats().incremental);
+        fill_and_drop_room(db);
+
+        auto before = db.GetSpaceStats();
+        REQUIRE(before.free_pages > 100);
+        REQUIRE(db.IncrementalVacuum(50) == 50);
+        auto after = db.GetSpaceStats();
+        REQUIRE(after.free_pages == before.free_pages - 50);
+        REQUIRE(after.page_count == before.page_count - 50);
+
+        double fragmentation = db.GetFragmentation("messages");
+        REQUIRE(fragmentation >= 0.0);
+        REQUIRE(fragmentation <= 1.0);
+    }
+
+    SECTION("Background task reclaims while idle") {
+        db::DB db(file.path);
+        REQUIRE(db.OpenDB());
+        fill_and_drop_room(db);
+
+        db::MaintenanceOptions options;
+        options.check_interval = std::chrono::milliseconds(10);
+        options.idle_after = std::chrono::milliseconds(0);
+        options.pages_per_slice = 32;
+        options.min_free_pages = 1;
+        REQUIRE(db.StartMaintenance(options));
+        // запись во время срезов ждет паузы между ними, а не получает SQLITE_BUSY
+        for (int i = 0; i < 20; ++i) {
+            REQUIRE(db.CreateRoom("during_" + std::to_string(i), 0));
+        }
+        REQUIRE(db.GetContentionStats().busy_timeouts == 0);
+        for (int i = 0; i < 200 && db.GetSpaceStats().free_pages > 0; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        auto stats = db.GetSpaceStats();
+        REQUIRE(stats.free_pages == 0);
+        REQUIRE(stats.reclaimed_pages > 0);
+        REQUIRE(stats.slices > 1);
+        db.StopMaintenance();
+        REQUIRE(db.IsUser("user1"));
+    }
+
+    SECTION("Existing files are migrated once") {
+        {
+            sqlite3* conn = nullptr;
+            sqlite3_open(file.path.c_str(), &conn);
+            sqlite3_exec(conn, "PRAGMA auto_vacuum = NONE; CREATE TABLE legacy(x);", nullptr, nullptr, nullptr);
+            sqlite3_close(conn);
+        }
+        db::DB db(file.path);
+        REQUIRE(db.OpenDB());
+        REQUIRE(db.GetSpaceStats().incremental == false);
+        REQUIRE(db.StartMaintenance() == false);
+        REQUIRE(db.MigrateToIncrementalVacuum());
+        REQUIRE(db.GetSpaceStats().incremental);
+        fill_and_drop_room(db);
+        REQUIRE(db.IncrementalVacuum(10) == 10);
+    }
+
+    SECTION("Busy wait only while the task runs") {
+        db::DB db(file.path);
+        REQUIRE(db.OpenDB());
+        sqlite3* holder = nullptr;
+        sqlite3_open(file.path.c_str(), &holder);
+        REQUIRE(sqlite3_exec(holder, "BEGIN IMMEDIATE;", nullptr, nullptr, nullptr) == SQLITE_OK);
+
+        // DBOptions по умолчанию: SQLITE_BUSY сразу, без обработчика
+        REQUIRE_FALSE(db.CreateRoom("r1", 0));
+        REQUIRE(db.GetContentionStats().busy_events == 0);
+
+        db::MaintenanceOptions options;
+        options.check_interval = std::chrono::hours(1);
+        REQUIRE(db.StartMaintenance(options));
+        REQUIRE_FALSE(db.CreateRoom("r2", 0));
+        auto stats = db.GetContentionStats();
+        REQUIRE(stats.busy_events == 1);
+        REQUIRE(stats.busy_timeouts == 1);
+        REQUIRE(stats.wait_ns >= 900'000'000);
+
+        db.StopMaintenance();
+        REQUIRE_FALSE(db.CreateRoom("r3", 0));
+        REQUIRE(db.GetContentionStats().busy_events == 1);
+
+        sqlite3_exec(holder, "ROLLBACK;", nullptr, nullptr, nullptr);
+        sqlite3_close(holder);
+        REQUIRE(db.CreateRoom("r4", 0));
+    }
+
+    SECTION("In-memory database has no background task") {
+        db::DB db(":memory:");
+        REQUIRE(db.OpenDB());
+        REQUIRE(db.StartMaintenance() == false);
+    }
+}
+TEST_CASE("Batch multi-get") {
+    db::DB db(":memory:");
+    db.OpenDB();
+    db.CreateUser({ "user1", "Name1", "hash", "user", false, 1 });
+    db.CreateUser({ "user2", "Name2", "hash", "admin", false, 2 });
+    db.CreateUser({ "quote\"back\\slash", "Odd", "hash", "user", false, 3 });
+    db.CreateRoom("general", 0);
+    db.CreateRoom("other", 0);
+    db.CreateRoom("empty", 0);
+    db.AddUserToRoom("user1", "general");
+    db.AddUserToRoom("user2", "general");
+    db.AddUserToRoom("user2", "other");
+    db.DeleteUser("user2"); // состоит в комнатах: только пометка is_deleted
+
+    SECTION("Users aligned with input, missing as nullopt") {
+        auto users = db.GetUsersData({ "user2", "missing", "user1", "quote\"back\\slash", "user1" });
+        REQUIRE(users.size() == 5);
+        REQUIRE(users[0]->login == "user2");
+        REQUIRE(users[0]->role == "admin");
+        REQUIRE(users[1] == std::nullopt);
+        REQUIRE(users[2]->name == "Name1");
+        REQUIRE(users[3]->name == "Odd");
+        REQUIRE(users[4]->login == "user1");
+        REQUIRE(db.GetUsersData({}).empty());
+    }
+
+    SECTION("Alive flags") {
+        auto alive = db.AreAliveUsers({ "user1", "user2", "missing", "quote\"back\\slash" });
+        REQUIRE(alive == std::vector<bool>{ true, false, false, true });
+    }
+
+    SECTION("Active members of several rooms") {
+        auto members = db.GetRoomsActiveUsers({ "other", "general", "missing", "empty" });
+        REQUIRE(members.size() == 4);
+        REQUIRE(members[0].empty());
+        REQUIRE(members[1].size() == 1);
+        REQUIRE(members[1][0].login == "user1");
+        REQUIRE(members[2].empty());
+        REQUIRE(members[3].empty());
+    }
+}
+TEST_CASE("Cached timestamp formatter") {
+    // Сверка с UnixTimeNsToDateTime вокруг переходов на летнее/зимнее время и границ суток.
+    auto check_range = [](utime::DateTimeCache& cache, int64_t from_s, int64_t to_s, int64_t step_s) {
+        int64_t first_mismatch = -1;
+        for (int64_t s = from_s; s < to_s && first_mismatch < 0; s += step_s) {
+            int64_t ns = s * 1'000'000'000 + 123'456'789;
+            if (cache.Format(ns) != utime::UnixTimeNsToDateTime(ns)) {
+                first_mismatch = s;
+            }
+        }
+        REQUIRE(first_mismatch == -1);
+    };
+    // 2024-03-09 00:00 UTC .. 2024-03-12 00:00 UTC и 2024-11-02 .. 2024-11-05: переходы в США
+    const int64_t march = 1709942400;
+    const int64_t november = 1730505600;
+
+#if !defined(_WIN32)
+    std::string saved_tz = std::getenv("TZ") ? std::getenv("TZ") : "";
+    bool had_tz = std::getenv("TZ") != nullptr;
+    for (const char* tz : { "UTC0", "EST5EDT,M3.2.0,M11.1.0", "<+1030>-10:30<+11>-11,M10.1.0,M4.1.0", "<-03>3" }) {
+        setenv("TZ", tz, 1);
+        tzset();
+        utime::DateTimeCache cache;
+        check_range(cache, march, march + 3 * 86'400, 37);
+        check_range(cache, november, november + 3 * 86'400, 37);
+        // 2024-10-05 .. 2024-10-08 UTC: переход на получасовое смещение
+        check_range(cache, 1728086400, 1728086400 + 3 * 86'400, 41);
+        // скачки назад и вперед между интервалами
+        for (int64_t s : { november, march, november + 86'399, int64_t{ 0 }, march - 1, int64_t{ 4102444800 } }) {
+            REQUIRE(cache.Format(s * 1'000'000'000) == utime::UnixTimeNsToDateTime(s * 1'000'000'000));
+        }
+    }
+    if (had_tz) {
+        setenv("TZ", saved_tz.c_str(), 1);
+    } else {
+        unsetenv("TZ");
+    }
+    tzset();
+#endif
+
+    utime::DateTimeCache cache;
+    check_range(cache, march, march + 86'400, 61);
+    std::vector<int64_t> batch = { march * 1'000'000'000, (march + 3600) * 1'000'000'000, november * 1'000'000'000 };
+    auto formatted = utime::UnixTimeNsToDateTimeBatch(batch);
+    REQUIRE(formatted.size() == 3);
+    for (size_t i = 0; i < batch.size(); ++i) {
+        REQUIRE(formatted[i] == utime::UnixTimeNsToDateTime(batch[i]));
+    }
+}
+
+TEST_CASE("I/O accounting") {
+    const TempDbFile file("io_stats_test.db");
+
+    db::DBOptions options;
+    options.io_accounting = true;
+
+    {
+        db::DB db(file.path, options);
+        REQUIRE(db.OpenDB());
+        REQUIRE(db.CreateRoom("room1", 0));
+        REQUIRE(db.CreateUser({ "user1", "Name", "hash", "user", false, 0 }));
+        db.ResetIoStats();
+
+        for (int i = 0; i < 20; ++i) {
+            REQUIRE(db.InsertMessageToDB({ std::string(100, 'x'), i, "user1", "room1", i }));
+        }
+        auto stats = db.GetIoStats();
+        const auto& insert = stats.by_method.at("InsertMessageToDB");
+        REQUIRE(insert.calls == 20);
+        REQUIRE(insert.writes >= 20);
+        REQUIRE(insert.write_bytes > 0);
+
+        {
+            db::Transaction tx(db);
+            REQUIRE(db.InsertMessageToDB({ "in tx", 20, "user1", "room1", 20 }));
+            REQUIRE(tx.Commit());
+        }
+        // страницы пишутся в WAL при фиксации: запись учитывается в Transaction::Commit
+        stats = db.GetIoStats();
+        REQUIRE(stats.by_method.at("InsertMessageToDB").calls == 21);
+        REQUIRE(stats.by_method.at("Transaction::Commit").writes > 0);
+
+        db::IoCounters sum;
+        for (const auto& [method, counters] : stats.by_method) {
+            sum.calls += counters.calls;
+            sum.writes += counters.writes;
+            sum.write_bytes += counters.write_bytes;
+            sum.reads += counters.reads;
+        }
+        REQUIRE(stats.total.calls == sum.calls);
+        REQUIRE(stats.total.writes == sum.writes);
+        REQUIRE(stats.total.write_bytes == sum.write_bytes);
+        REQUIRE(stats.total.reads == sum.reads);
+
+        db.CloseDB();
+        // закрытие последнего подключения переносит WAL в файл и синхронизирует его
+        REQUIRE(db.GetIoStats().by_method.at("CloseDB").syncs > 0);
+    }
+
+    {
+        // холодный кэш страниц: чтение истории идет через xRead
+        db::DB db(file.path, options);
+        REQUIRE(db.OpenDB());
+        db.ResetIoStats();
+        REQUIRE(db.GetRangeMessagesRoom("room1", 20, 0).size() == 21);
+        auto stats = db.GetIoStats();
+        REQUIRE(stats.by_method.at("GetRangeMessagesRoom").reads > 0);
+        REQUIRE(stats.by_method.at("GetRangeMessagesRoom").read_bytes > 0);
+    }
+
+    {
+        // без io_accounting учета нет
+        db::DB db(file.path);
+        REQUIRE(db.OpenDB());
+        REQUIRE(db.GetRangeMessagesRoom("room1", 20, 0).size() == 21);
+        REQUIRE(db.GetIoStats().by_method.empty());
+    }
+}
+
+TEST_CASE("Ephemeral rooms") {
+    const TempDbFile file("ephemeral_test.db");
+
+    // сообщения комнаты в файле, мимо подключения DB
+    auto count_in_file = [&file](const std::string& room) {
+        sqlite3* conn = nullptr;
+        sqlite3_open(file.path.c_str(), &conn);
+        sqlite3_stmt* stmt = nullptr;
+        sqlite3_prepare_v2(conn, "SELECT COUNT(*) FROM messages JOIN rooms USING(rooms_id) WHERE room = ?;", -1, &stmt, nullptr);
+        sqlite3_bind_text(stmt, 1, room.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_step(stmt);
+        int count = sqlite3_column_int(stmt, 0);
+        sqlite3_finalize(stmt);
+        sqlite3_close(conn);
+        return count;
+    };
+
+    db::DBOptions options;
+    options.ephemeral_rooms = true;
+    int64_t now = utime::GetUnixTimeNs();
+
+    SECTION("Messages stay in memory, reads merge both tiers") {
+        db::DB db(file.path, options);
+        REQUIRE(db.OpenDB());
+        REQUIRE(db.CreateRoom("lobby", now));
+        REQUIRE(db.CreateUser({ "user1", "Name", "hash", "user", false, now }));
+        REQUIRE(db.SetRoomEphemeral("lobby"));
+        REQUIRE(db.IsRoomEphemeral("lobby"));
+        REQUIRE_FALSE(db.SetRoomEphemeral("no_such_room"));
+
+        for (int i = 0; i < 5; ++i) {
+            REQUIRE(db.InsertMessageToDB({ "m" + std::to_string(i), now + i, "user1", "lobby", i }));
+        }
+        REQUIRE(db.GetEphemeralStats().messages == 5);
+        REQUIRE(count_in_file("lobby") == 0);
+        REQUIRE(db.GetCountRoomMessages("lobby") == 5);
+
+        REQUIRE(db.FlushEphemeral() == 5);
+        REQUIRE(count_in_file("lobby") == 5);
+        REQUIRE(db.GetEphemeralStats().messages == 0);
+        REQUIRE(db.GetEphemeralStats().persisted == 5);
+
+        for (int i = 5; i < 10; ++i) {
+            REQUIRE(db.InsertMessageToDB({ "m" + std::to_string(i), now + i, "user1", "lobby", i }));
+        }
+        auto messages = db.GetRangeMessagesRoom("lobby", 9, 0);
+        REQUIRE(messages.size() == 10);
+        for (int i = 0; i < 10; ++i) {
+            REQUIRE(messages[i].id_message_in_room == 9 - i);
+        }
+        REQUIRE(db.GetRangeMessagesRoomBatch("lobby", 9, 0).size() == 10);
+        auto by_time = db.GetMessagesByTime("lobby", now + 3, now + 6, 100);
+        REQUIRE(by_time.size() == 4);
+        REQUIRE(by_time.front().id_message_in_room == 3);
+        REQUIRE(by_time.back().id_message_in_room == 6);
+        REQUIRE(db.GetUserMessagesByTime("user1", now, now + 9, 100).size() == 10);
+        REQUIRE(db.GetFirstMessageIdAtOrAfter("lobby", now + 7) == 7);
+        REQUIRE(db.GetCountRoomMessages("lobby") == 10);
+
+        auto stats = db.GetRoomStats("lobby");
+        REQUIRE(stats);
+        REQUIRE(stats->message_count == 10);
+        REQUIRE(stats->last_message_id == 9);
+        REQUIRE(stats->last_activity == now + 9);
+        REQUIRE(db.GetRoomStatsByActivity(1).front().room == "lobby");
+        REQUIRE(db.GetAllRoomStats().front().message_count == 10);
+    }
+
+    SECTION("Expired messages are dropped, not persisted") {
+        db::DB db(file.path, options);
+        REQUIRE(db.OpenDB());
+        REQUIRE(db.CreateRoom("game", now));
+        REQUIRE(db.CreateUser({ "user1", "Name", "hash", "user", false, now }));
+        REQUIRE(db.SetRoomEphemeral("game", { false, std::chrono::milliseconds(1'000) }));
+
+        int64_t old = now - 10'000'000'000;
+        REQUIRE(db.InsertMessageToDB({ "old", old, "user1", "game", 0 }));
+        REQUIRE(db.InsertMessageToDB({ "new", now, "user1", "game", 1 }));
+        REQUIRE(db.FlushEphemeral() == 0);
+        REQUIRE(db.GetEphemeralStats().expired == 1);
+        auto messages = db.GetRangeMessagesRoom("game", 1, 0);
+        REQUIRE(messages.size() == 1);
+        REQUIRE(messages[0].message == "new");
+
+        db.CloseDB();
+        REQUIRE(count_in_file("game") == 0);
+    }
+
+    SECTION("Background snapshots, durable switch, delete and close") {
+        db::DB db(file.path, options);
+        REQUIRE(db.OpenDB());
+        REQUIRE(db.CreateRoom("lobby", now));
+        REQUIRE(db.CreateRoom("support", now));
+        REQUIRE(db.CreateRoom("temp", now));
+        REQUIRE(db.CreateUser({ "user1", "Name", "hash", "user", false, now }));
+        REQUIRE(db.SetRoomEphemeral("lobby"));
+        REQUIRE(db.SetRoomEphemeral("support"));
+        REQUIRE(db.SetRoomEphemeral("temp"));
+
+        db::EphemeralOptions snapshot_options;
+        snapshot_options.interval = std::chrono::milliseconds(20);
+        snapshot_options.batch_rows = 3;
+        REQUIRE(db.StartEphemeralSnapshots(snapshot_options));
+        for (int i = 0; i < 10; ++i) {
+            REQUIRE(db.InsertMessageToDB({ "m", now + i, "user1", "lobby", i }));
+        }
+        for (int attempt = 0; attempt < 250 && db.GetEphemeralStats().messages != 0; ++attempt) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }
+        REQUIRE(db.GetEphemeralStats().messages == 0);
+        REQUIRE(count_in_file("lobby") == 10);
+        REQUIRE(db.GetRangeMessagesRoom("lobby", 9, 0).size() == 10);
+        db.StopEphemeralSnapshots();
+
+        REQUIRE(db.InsertMessageToDB({ "s", now, "user1", "support", 0 }));
+        REQUIRE(db.SetRoomDurable("support"));
+        REQUIRE_FALSE(db.IsRoomEphemeral("support"));
+        REQUIRE(count_in_file("support") == 1);
+
+        REQUIRE(db.InsertMessageToDB({ "t", now, "user1", "temp", 0 }));
+        REQUIRE(db.DeleteRoom("temp"));
+        REQUIRE_FALSE(db.IsRoomEphemeral("temp"));
+        REQUIRE(db.GetEphemeralStats().messages == 0);
+
+        REQUIRE(db.InsertMessageToDB({ "last", now + 10, "user1", "lobby", 10 }));
+        db.CloseDB();
+        REQUIRE(count_in_file("lobby") == 11);
+    }
+
+    SECTION("Rooms with ttl do not hold back snapshots") {
+        db::DB db(file.path, options);
+        REQUIRE(db.OpenDB());
+        REQUIRE(db.CreateRoom("game", now));
+        REQUIRE(db.CreateRoom("lobby", now));
+        REQUIRE(db.CreateUser({ "user1", "Name", "hash", "user", false, now }));
+        REQUIRE(db.SetRoomEphemeral("game", { false, std::chrono::hours(1) }));
+        REQUIRE(db.SetRoomEphemeral("lobby"));
+
+        // строки комнаты с ttl раньше переносимых: окно среза не должно на них стоять
+        for (int i = 0; i < 10; ++i) {
+            REQUIRE(db.InsertMessageToDB({ "g", now + i, "user1", "game", i }));
+        }
+        for (int i = 0; i < 5; ++i) {
+            REQUIRE(db.InsertMessageToDB({ "l", now + i, "user1", "lobby", i }));
+        }
+
+        db::EphemeralOptions snapshot_options;
+        snapshot_options.interval = std::chrono::milliseconds(20);
+        snapshot_options.batch_rows = 3;
+        REQUIRE(db.StartEphemeralSnapshots(snapshot_options));
+        for (int attempt = 0; attempt < 250 && db.GetEphemeralStats().persisted != 5; ++attempt) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }
+        REQUIRE(db.GetEphemeralStats().persisted == 5);
+        REQUIRE(db.GetEphemeralStats().messages == 10);
+        REQUIRE(count_in_file("lobby") == 5);
+        REQUIRE(count_in_file("game") == 0);
+        REQUIRE(db.GetRangeMessagesRoom("game", 9, 0).size() == 10);
+        db.StopEphemeralSnapshots();
+    }
+
+    SECTION("Disabled without DBOptions::ephemeral_rooms") {
+        db::DB db(file.path);
+        REQUIRE(db.OpenDB());
+        REQUIRE(db.CreateRoom("lobby", now));
+        REQUIRE_FALSE(db.SetRoomEphemeral("lobby"));
+        REQUIRE(db.GetEphemeralStats().rooms == 0);
+    }
+}
+
+TEST_CASE("Cache warmup") {
+    const TempDbFile file("warmup_test.db");
+
+    db::DBOptions options;
+    options.cache_size_kib = 8 * 1024;
+    options.mmap_size = 64 * 1024 * 1024;
+
+    {
+        db::DB db(file.path, options);
+        REQUIRE(db.OpenDB());
+        REQUIRE(db.CreateUser({ "user1", "Name", "hash", "user", false, 0 }));
+        db::Transaction tx(db);
+        for (int r = 0; r < 4; ++r) {
+            std::string room = "room" + std::to_string(r);
+            REQUIRE(db.CreateRoom(room, 0));
+            for (int i = 0; i < 50; ++i) {
+                REQUIRE(db.InsertMessageToDB({ "text", r * 100 + i, "user1", room, i }));
+            }
+        }
+        REQUIRE(tx.Commit());
+    }
+
+    db::DB db(file.path, options);
+    REQUIRE(db.OpenDB());
+    REQUIRE_FALSE(db.GetWarmupProgress().running);
+
+    std::atomic<int> calls{ 0 };
+    std::atomic<bool> finished{ false };
+    db::WarmupOptions warmup;
+    warmup.hot_rooms = 3;
+    warmup.tail_messages = 20;
+    warmup.on_progress = [&calls, &finished](const db::WarmupProgress& p) {
+        ++calls;
+        finished = !p.running;
+    };
+    REQUIRE(db.StartWarmup(warmup));
+
+    // чтение не ждет прогрева
+    REQUIRE(db.GetRangeMessagesRoom("room0", 49, 0).size() == 50);
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (db.GetWarmupProgress().running && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    auto progress = db.GetWarmupProgress();
+    REQUIRE(progress.done);
+    REQUIRE_FALSE(progress.running);
+    REQUIRE(progress.steps_total > 3);
+    REQUIRE(progress.steps_done == progress.steps_total);
+    // users, rooms, их индексы и хвосты трех комнат по 20 сообщений
+    REQUIRE(progress.rows >= 1 + 4 + 3 * 20);
+    REQUIRE(calls == progress.steps_total + 1);
+    REQUIRE(finished);
+
+    // повторный запуск - новый проход
+    REQUIRE(db.StartWarmup());
+    db.StopWarmup();
+    REQUIRE_FALSE(db.GetWarmupProgress().running);
+    db.CloseDB();
+
+    db::DB memory(":memory:");
+    REQUIRE(memory.OpenDB());
+    REQUIRE_FALSE(memory.StartWarmup());
+}
+
+TEST_CASE("Columnar message export") {
+    const TempDbFile file("export_test.db");
+
+    db::DB db(file.path);
+    REQUIRE(db.OpenDB());
+    const char* users[] = { "alice", "bob", "carol" };
+    for (const char* login : users) {
+        REQUIRE(db.CreateUser({ login, "Name", "hash", "user", false, 0 }));
+    }
+    {
+        db::Transaction tx(db);
+        REQUIRE(db.CreateRoom("general", 0));
+        REQUIRE(db.CreateRoom("random", 0));
+        int64_t next_id[2] = { 0, 0 };
+        for (int i = 0; i < 500; ++i) {
+            int r = i % 3 == 0 ? 1 : 0;
+            std::string room = r == 1 ? "random" : "general";
+            std::string text = "message number " + std::to_string(i) + (i % 7 == 0 ? std::string(300, 'z') : "");
+            REQUIRE(db.InsertMessageToDB({ text, 1'000'000 + i * 1'000, users[i % 3], room, next_id[r]++ }));
+        }
+        REQUIRE(tx.Commit());
+    }
+
+    std::string exported;
+    auto sink = [&exported](const char* data, size_t size) {
+        exported.append(data, size);
+        return true;
+    };
+    auto source_of = [](const std::string& data) {
+        return [&data, pos = size_t{ 0 }](char* buffer, size_t cap) mutable {
+            size_t n = std::min(cap, data.size() - pos);
+            std::memcpy(buffer, data.data() + pos, n);
+            pos += n;
+            return n;
+        };
+    };
+
+    db::ExportOptions options;
+    options.block_rows = 128;
+    auto stats = db.ExportMessages(sink, options);
+    REQUIRE(stats);
+    REQUIRE(stats->rows == 500);
+    REQUIRE(stats->blocks == 4);
+    REQUIRE(stats->bytes == static_cast<int64_t>(exported.size()));
+    // словари, разности и сжатие текста
+    REQUIRE(exported.size() < static_cast<size_t>(stats->text_bytes) / 2);
+
+    SECTION("Round trip") {
+        auto general = db.GetRangeMessagesRoom("general", 1'000, 0);
+        auto random = db.GetRangeMessagesRoom("random", 1'000, 0);
+        std::map<std::pair<std::string, int64_t>, db::Message> expected;
+        for (const auto* list : { &general, &random }) {
+            for (const auto& m : *list) {
+                expected.emplace(std::make_pair(m.room, m.id_message_in_room), m);
+            }
+        }
+        REQUIRE(expected.size() == 500);
+
+        db::MessageExportReader reader(source_of(exported));
+        db::MessageBatch batch;
+        size_t rows = 0;
+        int64_t previous_id = 0;
+        while (reader.Next(batch)) {
+            REQUIRE(batch.size() == reader.size());
+            for (size_t i = 0; i < batch.size(); ++i, ++rows) {
+                REQUIRE(reader.messages_id(i) > previous_id);
+                previous_id = reader.messages_id(i);
+                const auto& m = expected.at({ std::string(batch.room(i)), batch.id_message_in_room(i) });
+                REQUIRE(batch.message(i) == m.message);
+                REQUIRE(batch.user_login(i) == m.user_login);
+                REQUIRE(batch.unixtime(i) == m.unixtime);
+            }
+        }
+        REQUIRE_FALSE(reader.Failed());
+        REQUIRE(rows == 500);
+        REQUIRE(reader.rooms().size() == 2);
+        REQUIRE(reader.logins().size() == 3);
+        REQUIRE(previous_id == stats->last_messages_id);
+    }
+
+    SECTION("Incremental export") {
+        REQUIRE(db.InsertMessageToDB({ "late", 9'000'000, "bob", "random", 167 }));
+        std::string previous = std::move(exported);
+        exported.clear();
+        options.after_messages_id = stats->last_messages_id;
+        auto next = db.ExportMessages(sink, options);
+        REQUIRE(next);
+        REQUIRE(next->rows == 1);
+        REQUIRE(next->last_messages_id == stats->last_messages_id + 1);
+
+        db::MessageExportReader reader(source_of(exported));
+        REQUIRE(reader.Next());
+        REQUIRE(reader.size() == 1);
+        REQUIRE(reader.messages_id(0) == next->last_messages_id);
+        REQUIRE(reader.message(0) == "late");
+        REQUIRE(reader.rooms()[reader.room_code(0)] == "random");
+        REQUIRE(reader.unixtime(0) == 9'000'000);
+        REQUIRE_FALSE(reader.Next());
+        REQUIRE_FALSE(reader.Failed());
+
+        // нет новых сообщений: пустой файл с блоком конца
+        exported.clear();
+        options.after_messages_id = next->last_messages_id;
+        auto empty = db.ExportMessages(sink, options);
+        REQUIRE(empty);
+        REQUIRE(empty->rows == 0);
+        REQUIRE(empty->last_messages_id == next->last_messages_id);
+        db::MessageExportReader empty_reader(source_of(exported));
+        REQUIRE_FALSE(empty_reader.Next());
+        REQUIRE_FALSE(empty_reader.Failed());
+    }
+
+    SECTION("Damaged file") {
+        std::string truncated = exported.substr(0, exported.size() / 2);
+        db::MessageExportReader reader(source_of(truncated));
+        while (reader.Next()) {
+        }
+        REQUIRE(reader.Failed());
+
+        std::string corrupted = exported;
+        for (size_t i = 40; i < corrupted.size(); i += 97) {
+            corrupted[i] = static_cast<char>(corrupted[i] ^ 0x5a);
+        }
+        db::MessageExportReader corrupted_reader(source_of(corrupted));
+        while (corrupted_reader.Next()) {
+        }
+        REQUIRE(corrupted_reader.Failed());
+    }
+
+    SECTION("Sink stops export") {
+        int calls = 0;
+        REQUIRE_FALSE(db.ExportMessages([&calls](const char*, size_t) { return ++calls < 2; }, options));
+        REQUIRE(calls == 2);
+    }
+    db.CloseDB();
+}
+
+TEST_CASE("Read snapshots") {
+    const TempDbFile file("snapshot_test.db");
+
+    db::DB db(file.path);
+    REQUIRE(db.OpenDB());
+    REQUIRE(db.CreateRoom("general", 0));
+    REQUIRE(db.CreateUser({ "alice", "Alice", "hash", "user", false, 0 }));
+    REQUIRE(db.AddUserToRoom("alice", "general"));
+    for (int i = 0; i < 10; ++i) {
+        REQUIRE(db.InsertMessageToDB({ "m" + std::to_string(i), i, "alice", "general", i }));
+    }
+
+    SECTION("Dedicated reader does not see later writes") {
+        db::ReadSnapshot snapshot(db, true);
+        REQUIRE(snapshot);
+        REQUIRE(snapshot.GetCountRoomMessages("general") == 10);
+
+        // запись через DB идет параллельно снимку
+        REQUIRE(db.CreateUser({ "bob", "Bob", "hash", "user", false, 0 }));
+        REQUIRE(db.AddUserToRoom("bob", "general"));
+        REQUIRE(db.InsertMessageToDB({ "late", 10, "bob", "general", 10 }));
+        REQUIRE(db.GetCountRoomMessages("general") == 11);
+
+        REQUIRE(snapshot.GetRoomActiveUsers("general").size() == 1);
+        REQUIRE(snapshot.GetRangeMessagesRoom("general", 100, 0).size() == 10);
+        REQUIRE(snapshot.GetCountRoomMessages("general") == 10);
+        REQUIRE(snapshot.GetRoomStats("general")->last_message_id == 9);
+        REQUIRE_FALSE(snapshot.IsUser("bob"));
+
+        // из другого потока
+        size_t from_thread = 0;
+        std::thread reader([&] { from_thread = snapshot.GetRangeMessagesRoom("general", 100, 0).size(); });
+        reader.join();
+        REQUIRE(from_thread == 10);
+
+        std::string exported;
+        auto stats = snapshot.ExportMessages([&exported](const char* data, size_t size) {
+            exported.append(data, size);
+            return true;
+        });
+        REQUIRE(stats);
+        REQUIRE(stats->rows == 10);
+
+        snapshot.Release();
+        REQUIRE_FALSE(snapshot);
+        REQUIRE(snapshot.GetRangeMessagesRoom("general", 100, 0).empty());
+
+        // подключение из пула, новый снимок видит все
+        db::ReadSnapshot next(db, true);
+        REQUIRE(next);
+        REQUIRE(next.GetCountRoomMessages("general") == 11);
+        REQUIRE(next.IsUser("bob"));
+    }
+
+    SECTION("Snapshot on the working connection") {
+        db::DB other(file.path);
+        REQUIRE(other.OpenDB());
+        {
+            db::ReadSnapshot snapshot(db);
+            REQUIRE(snapshot);
+            REQUIRE(db.InTransaction());
+            REQUIRE(other.InsertMessageToDB({ "other", 10, "alice", "general", 10 }));
+            REQUIRE(snapshot.GetCountRoomMessages("general") == 10);
+            // вызовы DB тоже в снимке
+            REQUIRE(db.GetRangeMessagesRoom("general", 100, 0).size() == 10);
+        }
+        REQUIRE_FALSE(db.InTransaction());
+        REQUIRE(db.GetCountRoomMessages("general") == 11);
+    }
+
+    SECTION("Working connection snapshot rejects writes") {
+        db::DB other(file.path);
+        REQUIRE(other.OpenDB());
+        {
+            db::ReadSnapshot snapshot(db);
+            REQUIRE(snapshot);
+            REQUIRE(other.CreateRoom("later", 0));
+            // запись после чужой фиксации не может присоединиться к снимку и не теряется молча при Release
+            REQUIRE_FALSE(db.CreateRoom("inside", 0));
+            REQUIRE_FALSE(db.InsertMessageToDB({ "inside", 10, "alice", "general", 10 }));
+            REQUIRE_FALSE(snapshot.IsRoom("later"));
+            REQUIRE(snapshot.GetCountRoomMessages("general") == 10);
+        }
+        REQUIRE(db.CreateRoom("inside", 0));
+        REQUIRE(db.IsRoom("later"));
+        REQUIRE(other.IsRoom("inside"));
+    }
+
+    SECTION("Reader returned after CloseDB is not pooled") {
+        db::ReadSnapshot snapshot(db, true);
+        REQUIRE(snapshot);
+        db.CloseDB();
+        REQUIRE(snapshot.GetCountRoomMessages("general") == 10);
+        snapshot.Release();
+        REQUIRE_FALSE(db::ReadSnapshot(db, true));
+
+        REQUIRE(db.OpenDB());
+        REQUIRE(db.InsertMessageToDB({ "reopened", 10, "alice", "general", 10 }));
+        db::ReadSnapshot next(db, true);
+        REQUIRE(next);
+        REQUIRE(next.GetCountRoomMessages("general") == 11);
+    }
+
+    SECTION("Concurrent dedicated snapshots") {
+        db::ReadSnapshot first(db, true);
+        REQUIRE(db.InsertMessageToDB({ "between", 10, "alice", "general", 10 }));
+        db::ReadSnapshot second(db, true);
+        REQUIRE(first);
+        REQUIRE(second);
+        REQUIRE(first.GetCountRoomMessages("general") == 10);
+        REQUIRE(second.GetCountRoomMessages("general") == 11);
+    }
+
+    db.CloseDB();
+
+    db::DB memory(":memory:");
+    REQUIRE(memory.OpenDB());
+    REQUIRE_FALSE(db::ReadSnapshot(memory, true));
+    db::ReadSnapshot in_memory(memory);
+    REQUIRE(in_memory);
+    REQUIRE(in_memory.GetRooms().empty());
+    in_memory.Release();
+}